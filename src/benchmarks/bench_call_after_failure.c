@@ -0,0 +1,43 @@
+#include <stdio.h>
+#include "../stackmap_checker/speculate.h"
+
+// The cost of the calls made after a deoptimization: the guard in
+// `more_indirection` fails once, and execution continues in `__unopt_work`,
+// which then calls `checksum`. The fresh calls run the optimized `checksum`;
+// only the frames restored by the runtime run the unoptimized code.
+
+#define ITERATIONS 200
+#define SIZE 100000
+
+int more_indirection()
+{
+    __speculate(0);
+    return 3;
+}
+
+unsigned long checksum(int n, int seed)
+{
+    // `checksum` may reach a guard, so the calls to it are recorded.
+    __speculate(n >= 0);
+    unsigned long sum = seed;
+    for (int i = 0; i < n; ++i) {
+        sum = sum * 31 + (i ^ seed);
+    }
+    return sum;
+}
+
+unsigned long work(int iterations)
+{
+    int x = more_indirection();
+    unsigned long sum = 0;
+    for (int i = 0; i < iterations; ++i) {
+        sum += checksum(SIZE, i + x);
+    }
+    return sum;
+}
+
+int main(int argc, char **argv)
+{
+    printf("sum = %lu\n", work(ITERATIONS));
+    return 0;
+}
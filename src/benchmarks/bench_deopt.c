@@ -0,0 +1,30 @@
+#include <stdio.h>
+#include "../stackmap_checker/speculate.h"
+
+// The cost of deoptimizing: the guard (`__speculate(0)`) in `more_indirection`
+// fails each time it is reached, so each iteration of the loop in `main`
+// restores the frames of `get_number` and `more_indirection`.
+
+#define ITERATIONS 2000
+
+int more_indirection(int x)
+{
+    __speculate(0);
+    return x + 1;
+}
+
+int get_number(int x)
+{
+    int y = more_indirection(x);
+    return y * 2;
+}
+
+int main(int argc, char **argv)
+{
+    long sum = 0;
+    for (int i = 0; i < ITERATIONS; ++i) {
+        sum += get_number(i);
+    }
+    printf("%ld\n", sum);
+    return 0;
+}
@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include "../stackmap_checker/speculate.h"
+
+// Guards which never fail, in hot loops: a loop-invariant guard in `scale`,
+// which `GuardOptPass` hoists out of the loop, and two range checks on the
+// same index in `window`, which it merges into one.
+
+#define ITERATIONS 20000
+#define LEN 1024
+
+int data[LEN];
+
+long scale(int *arr, int len, int factor)
+{
+    long total = 0;
+    for (int i = 0; i < len; ++i) {
+        __speculate(factor > 0);
+        __speculate(len <= LEN);
+        total += arr[i] * factor;
+    }
+    return total;
+}
+
+long window(int *arr, int start)
+{
+    __speculate(start < LEN);
+    long total = arr[start];
+    __speculate(start < LEN - 1);
+    return total + arr[start + 1];
+}
+
+int main(int argc, char **argv)
+{
+    for (int i = 0; i < LEN; ++i) {
+        data[i] = i;
+    }
+    long total = 0;
+    for (int i = 0; i < ITERATIONS; ++i) {
+        total += scale(data, LEN, i % 7 + 1);
+        for (int j = 0; j < LEN - 1; ++j) {
+            total += window(data, j);
+        }
+    }
+    printf("total = %ld\n", total);
+    return 0;
+}
@@ -0,0 +1,45 @@
+#include <stdio.h>
+#include <stdint.h>
+
+// An instruction-cache-bound workload: each iteration of the main loop calls
+// 256 distinct functions, whose code doesn't fit in the L1 instruction cache.
+// If the `__unopt_` versions of the functions are placed between them, the
+// optimized code is spread over twice as many cache lines and pages.
+
+#define ITERATIONS 100000
+
+#define STEP(n)                                                 \
+    __attribute__((noinline)) uint64_t step##n(uint64_t x)     \
+    {                                                           \
+        for (uint64_t i = 0; i < (x & 3) + 1; ++i) {            \
+            x = x * (2 * n + 1) + (x >> 7) + n;                 \
+            x ^= x << 11;                                       \
+        }                                                       \
+        return x;                                               \
+    }
+#define STEP4(n) STEP(n##1) STEP(n##2) STEP(n##3) STEP(n##4)
+#define STEP16(n) STEP4(n##1) STEP4(n##2) STEP4(n##3) STEP4(n##4)
+#define STEP64(n) STEP16(n##1) STEP16(n##2) STEP16(n##3) STEP16(n##4)
+
+#define CALL(n) x = step##n(x);
+#define CALL4(n) CALL(n##1) CALL(n##2) CALL(n##3) CALL(n##4)
+#define CALL16(n) CALL4(n##1) CALL4(n##2) CALL4(n##3) CALL4(n##4)
+#define CALL64(n) CALL16(n##1) CALL16(n##2) CALL16(n##3) CALL16(n##4)
+
+STEP64(1) STEP64(2) STEP64(3) STEP64(4)
+
+__attribute__((noinline)) uint64_t run(uint64_t x)
+{
+    CALL64(1) CALL64(2) CALL64(3) CALL64(4)
+    return x;
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t acc = 0;
+    for (uint64_t i = 0; i < ITERATIONS; ++i) {
+        acc += run(i + acc);
+    }
+    printf("%lu\n", acc);
+    return 0;
+}
@@ -0,0 +1,44 @@
+#include <stdio.h>
+
+// A function whose profile `SpeculationPass` can use: `filter_sum` is always
+// called with `mode == 2`, so `bench_pgo__pgo` runs a version specialized for
+// it, and its values are never negative, so the branch which handles them is
+// replaced with a guard.
+
+#define ITERATIONS 20000
+#define LEN 1024
+
+int data[LEN];
+
+long filter_sum(int *values, int len, int mode)
+{
+    long total = 0;
+    for (int i = 0; i < len; ++i) {
+        int value = values[i];
+        if (value < 0) {
+            fprintf(stderr, "negative value at %d\n", i);
+            value = -value;
+        }
+        if (mode == 0) {
+            total += value;
+        } else if (mode == 1) {
+            total += value & 1 ? value : 0;
+        } else {
+            total += value % 3 ? 0 : value;
+        }
+    }
+    return total;
+}
+
+int main(int argc, char **argv)
+{
+    for (int i = 0; i < LEN; ++i) {
+        data[i] = i * 7 % 1000;
+    }
+    long total = 0;
+    for (int i = 0; i < ITERATIONS; ++i) {
+        total += filter_sum(data, LEN, 2);
+    }
+    printf("total = %ld\n", total);
+    return 0;
+}
@@ -0,0 +1,35 @@
+#include <stdio.h>
+#include "../stackmap_checker/speculate.h"
+
+// The throughput of the code execution is resumed in after a deoptimization:
+// the guard at the entry of `run` fails, so the whole loop is executed by
+// `__unopt_run`. Compare it with `bench_post_deopt__baseline`, in which the
+// `__unopt_` functions are compiled as part of the baseline tier, and with
+// `bench_post_deopt__osr`, in which the loop is moved back to `run`.
+
+#define ITERATIONS 20
+#define SIZE 100000
+
+static double values[SIZE];
+
+double run(int n)
+{
+    __speculate(n < 0);
+    double sum = 0;
+    for (int j = 0; j < n; ++j) {
+        for (int i = 0; i < SIZE; ++i) {
+            double x = values[i];
+            sum += ((x * 0.5 + 1.25) * x - 3.0) * x;
+        }
+    }
+    return sum;
+}
+
+int main(int argc, char **argv)
+{
+    for (int i = 0; i < SIZE; ++i) {
+        values[i] = (i % 100) / 100.0;
+    }
+    printf("sum = %lf\n", run(ITERATIONS));
+    return 0;
+}
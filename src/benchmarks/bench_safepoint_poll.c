@@ -0,0 +1,30 @@
+#include <stdio.h>
+#include <stdint.h>
+
+// The cost of the safepoint polls on the fast path (when no safepoint is
+// requested): a poll on each back-edge of the inner loop, and at the entry of
+// `mix`, which is called on each iteration of the outer loop.
+
+#define OUTER_ITERATIONS 2000000
+#define INNER_ITERATIONS 64
+
+uint64_t mix(uint64_t seed)
+{
+    uint64_t x = seed;
+    for (int i = 0; i < INNER_ITERATIONS; ++i) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+    }
+    return x;
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t acc = 0;
+    for (uint64_t i = 0; i < OUTER_ITERATIONS; ++i) {
+        acc += mix(i + acc);
+    }
+    printf("%lu\n", acc);
+    return 0;
+}
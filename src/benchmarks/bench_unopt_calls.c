@@ -0,0 +1,31 @@
+#include <stdio.h>
+#include "../stackmap_checker/speculate.h"
+
+// The cost of the calls made by the `__unopt_` functions: the guard at the
+// entry of `run` fails, so the loop is executed by `__unopt_run`, which calls
+// the optimized `step`.
+
+#define ITERATIONS 10000000
+
+int step(int x, int i)
+{
+    // `step` may reach a guard, so the calls to it are recorded.
+    __speculate(x != -1);
+    return x ^ (x << 3) ^ i;
+}
+
+int run(int n)
+{
+    __speculate(n < 0);
+    int x = 1;
+    for (int i = 0; i < n; ++i) {
+        x = step(x, i);
+    }
+    return x;
+}
+
+int main(int argc, char **argv)
+{
+    printf("x = %d\n", run(ITERATIONS));
+    return 0;
+}
@@ -0,0 +1,66 @@
+import argparse
+import os
+import subprocess
+import tempfile
+import time
+
+
+def generate_function(num_calls):
+    # A function with `num_calls` calls to a small (instrumented) function,
+    # spread over a few loops and branches, with many variables live across
+    # the calls.
+    lines = ['int callee(int x)', '{', '    return x * 3 + 1;', '}', '',
+             'int big_function(int n)', '{']
+    num_vars = max(num_calls // 8, 1)
+    for i in range(num_vars):
+        lines.append('    int v{:} = n + {:};'.format(i, i))
+    for i in range(num_calls):
+        var = 'v{:}'.format(i % num_vars)
+        if i % 64 == 0:
+            lines.append('    for (int i{:} = 0; i{:} < n; ++i{:}) {{'.format(
+                i, i, i))
+        if i % 16 == 8:
+            lines.append('    if ({:} & 1) {{'.format(var))
+            lines.append('        {:} = callee({:});'.format(var, var))
+            lines.append('    } else {')
+            lines.append('        {:} -= callee({:} + 1);'.format(var, var))
+            lines.append('    }')
+        else:
+            lines.append('    {:} += callee({:});'.format(var, var))
+        if i % 64 == 63 or i == num_calls - 1:
+            lines.append('    }')
+    lines.append('    return {:};'.format(
+        ' + '.join('v{:}'.format(i) for i in range(num_vars))))
+    lines.append('}')
+    lines += ['', 'int main(int argc, char **argv)', '{',
+              '    return big_function(argc) & 0xff;', '}', '']
+    return '\n'.join(lines)
+
+
+def time_compile(cc, pass_flags, source):
+    with tempfile.TemporaryDirectory() as tmp_dir:
+        src_path = os.path.join(tmp_dir, 'big.c')
+        with open(src_path, 'w') as f:
+            f.write(source)
+        cmd = '{:} {:} -S -emit-llvm -O3 {:} -o {:}'.format(
+            cc, pass_flags, src_path, os.path.join(tmp_dir, 'big.ll'))
+        start = time.perf_counter()
+        subprocess.run(cmd, shell=True, stdout=subprocess.DEVNULL, check=True)
+        return time.perf_counter() - start
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Measure the compile time of large synthetic functions.')
+    parser.add_argument('--cc', default='clang')
+    parser.add_argument('--pass-flags', default='')
+    parser.add_argument('--sizes', type=int, nargs='+',
+                        default=[500, 1000, 2000, 4000])
+    args = parser.parse_args()
+    for num_calls in args.sizes:
+        t = time_compile(args.cc, args.pass_flags, generate_function(num_calls))
+        print('{:} calls: {:.3f}s'.format(num_calls, t))
+
+
+if __name__ == '__main__':
+    main()
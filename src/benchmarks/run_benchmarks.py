@@ -0,0 +1,69 @@
+import argparse
+import os
+import statistics
+import subprocess
+import time
+
+# The sections whose sizes are reported for each benchmark.
+SECTIONS = ['.text', '.llvm_stackmaps', '.llvm_stackmap_sizes']
+
+
+def time_binary(path, runs):
+    # Deoptimize each time a guard fails (see the tier-up policy).
+    env = dict(os.environ, GUARD_TIERUP_THRESHOLD='0')
+    times = []
+    for _ in range(runs):
+        start = time.perf_counter()
+        subprocess.run(path, shell=True, stdout=subprocess.DEVNULL,
+                       stderr=subprocess.DEVNULL, check=True, env=env)
+        times.append(time.perf_counter() - start)
+    return statistics.median(times)
+
+
+def section_sizes(path):
+    out = subprocess.run(['readelf', '-SW', path], stdout=subprocess.PIPE,
+                         check=True).stdout.decode()
+    sizes = {}
+    for line in out.splitlines():
+        # [Nr] Name Type Address Off Size ...
+        fields = line.replace('[ ', '[').split()
+        if len(fields) > 5 and fields[1] in SECTIONS:
+            sizes[fields[1]] = int(fields[5], 16)
+    return sizes
+
+
+def format_sizes(path):
+    sizes = section_sizes(path)
+    return ', '.join('{:} {:} bytes'.format(name, sizes[name])
+                     for name in SECTIONS if name in sizes)
+
+
+def group_variants(names):
+    # `bench__nopoll`, `bench__cloneall`, `bench__nocold`, `bench__noguardopt`,
+    # `bench__compact`, `bench__baseline`, `bench__osr` and `bench__pgo` are
+    # variants of `bench`.
+    groups = {}
+    for name in names:
+        groups.setdefault(name.split('__')[0], []).append(name)
+    return groups
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Run the benchmarks.')
+    parser.add_argument('binaries', nargs='+')
+    parser.add_argument('--runs', type=int, default=5)
+    args = parser.parse_args()
+    for bench, variants in sorted(group_variants(args.binaries).items()):
+        baseline = time_binary('./{:}'.format(bench), args.runs)
+        print('{:}: {:.3f}s ({:})'.format(bench, baseline, format_sizes(bench)))
+        for variant in sorted(variants):
+            if variant == bench:
+                continue
+            t = time_binary('./{:}'.format(variant), args.runs)
+            print('  {:}: {:.3f}s ({:} is {:+.1f}% slower; {:})'.format(
+                variant, t, bench, (baseline - t) / t * 100,
+                format_sizes(variant)))
+
+
+if __name__ == '__main__':
+    main()
@@ -1,4 +1,13 @@
 #include "Utils.h"
+#include <vector>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/SCCIterator.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/IR/CFG.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/Intrinsics.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Metadata.h>
 
 using namespace llvm;
 
@@ -20,3 +29,226 @@ PatchpointType getPatchpointType(Function *fun) {
   }
   return PatchpointType{ type };
 }
+
+void setRecordKind(CallInst *call, RecordKind kind) {
+  LLVMContext &ctx = call->getContext();
+  call->setMetadata(RECORD_KIND_MD,
+                    MDNode::get(ctx, ConstantAsMetadata::get(ConstantInt::get(
+                                         Type::getInt32Ty(ctx), kind))));
+}
+
+RecordKind getRecordKind(const CallInst *call) {
+  MDNode *md = call->getMetadata(RECORD_KIND_MD);
+  if (!md) {
+    return RECORD_CALL;
+  }
+  return (RecordKind)mdconst::extract<ConstantInt>(md->getOperand(0))
+      ->getZExtValue();
+}
+
+StringRef getGenericName(StringRef name, unsigned &version) {
+  version = 0;
+  if (!name.startswith(SPEC_PREFIX)) {
+    return name;
+  }
+  StringRef rest = name.drop_front(StringRef(SPEC_PREFIX).size());
+  size_t sep = rest.find('_');
+  if (sep == StringRef::npos || rest.substr(0, sep).getAsInteger(10, version)) {
+    version = 0;
+    return name;
+  }
+  return rest.drop_front(sep + 1);
+}
+
+/*
+ * Return true if `call` is a call to an actual function (not to an intrinsic,
+ * to an `asm` block, to a guard, to a safepoint poll, or to the profiling
+ * functions, which are only called by the `__unopt_` functions).
+ *
+ * The `musttail` calls which dispatch the calls to a function to its
+ * specialized versions are not counted: the version replaces the frame of the
+ * function, and makes the same calls as the function.
+ */
+static bool isFunctionCall(const CallInst &call) {
+  if (call.isInlineAsm() || call.isMustTailCall()) {
+    return false;
+  }
+  const Function *calledFun = call.getCalledFunction();
+  return !calledFun || (!calledFun->isIntrinsic() &&
+                        calledFun->getName() != SAFEPOINT_POLL_SITE &&
+                        !isGuardFunName(calledFun->getName()) &&
+                        !calledFun->getName().startswith(PROFILE_PREFIX));
+}
+
+bool isGuardFunName(StringRef name) {
+  return name == SPECULATE_FUN_NAME ||
+         name == SPECULATE_INVALIDATABLE_FUN_NAME;
+}
+
+bool containsGuard(const Function &fun) {
+  for (auto &bb : fun) {
+    for (auto &inst : bb) {
+      if (!isa<CallInst>(inst)) {
+        continue;
+      }
+      const Function *calledFun = cast<CallInst>(inst).getCalledFunction();
+      if (calledFun && isGuardFunName(calledFun->getName())) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+/*
+ * Return the name of the optimized function which `name` is the name of, or
+ * the name of the twin or of a specialized version of.
+ */
+static StringRef getOptName(StringRef name) {
+  if (name.startswith(UNOPT_PREFIX)) {
+    return name.drop_front(StringRef(UNOPT_PREFIX).size());
+  }
+  unsigned version;
+  return getGenericName(name, version);
+}
+
+/*
+ * Return the function `arg` is (possibly through a cast), or nullptr.
+ */
+static const Function *getPassedFunction(const Value *arg) {
+  return dyn_cast<Function>(arg->stripPointerCasts());
+}
+
+/*
+ * Return true if the function pointer `arg`, passed to a function which is
+ * not defined in the module, may point to any function.
+ */
+static bool isUnknownFunctionPointer(const Value *arg) {
+  auto ptrType = dyn_cast<PointerType>(arg->getType());
+  return !getPassedFunction(arg) && ptrType &&
+    ptrType->getElementType()->isFunctionTy();
+}
+
+/*
+ * Return true if `fun` may call itself, directly or through other functions
+ * defined in the module. The twin and the versions of a function count as the
+ * function, so the result is the same for all of them. Indirect calls, and
+ * calls which pass a function pointer to a function defined in another
+ * module, may call back into `fun`.
+ */
+static bool mayRecurse(const Function &fun) {
+  StringRef name = getOptName(fun.getName());
+  SmallPtrSet<const Function *, 16> visited;
+  std::vector<const Function *> worklist { &fun };
+  while (!worklist.empty()) {
+    const Function *caller = worklist.back();
+    worklist.pop_back();
+    for (auto &bb : *caller) {
+      for (auto &inst : bb) {
+        if (!isa<CallInst>(inst) || !isFunctionCall(cast<CallInst>(inst))) {
+          continue;
+        }
+        const CallInst &call = cast<CallInst>(inst);
+        const Function *calledFun = call.getCalledFunction();
+        if (!calledFun || getOptName(calledFun->getName()) == name) {
+          return true;
+        }
+        if (!calledFun->isDeclaration()) {
+          if (visited.insert(calledFun).second) {
+            worklist.push_back(calledFun);
+          }
+          continue;
+        }
+        for (auto &arg : call.arg_operands()) {
+          if (isUnknownFunctionPointer(arg)) {
+            return true;
+          }
+          const Function *passed = getPassedFunction(arg);
+          if (passed && !passed->isDeclaration() &&
+              visited.insert(passed).second) {
+            worklist.push_back(passed);
+          }
+        }
+      }
+    }
+  }
+  return false;
+}
+
+bool needsSafepointPoll(Function &fun) {
+  for (auto scc = scc_begin(&fun); !scc.isAtEnd(); ++scc) {
+    if (scc.hasLoop()) {
+      return true;
+    }
+  }
+  return mayRecurse(fun);
+}
+
+DeoptReachability::DeoptReachability(Module &mod, bool safepointsEnabled)
+  : externalCallsReach(mod.getModuleFlag(EXTERNAL_CALLS_FLAG) != nullptr),
+    numFunctions(0) {
+  // The callers of each function.
+  DenseMap<const Function *, std::vector<Function *>> callers;
+  std::vector<Function *> worklist;
+  for (auto &fun : mod) {
+    // The twins and the specialized versions have the result of the function.
+    if (fun.isDeclaration() || getOptName(fun.getName()) != fun.getName()) {
+      continue;
+    }
+    ++numFunctions;
+    defined.insert(fun.getName());
+    bool reachesDeoptPoint = containsGuard(fun) ||
+      (safepointsEnabled && needsSafepointPoll(fun));
+    for (auto &bb : fun) {
+      for (auto &inst : bb) {
+        if (!isa<CallInst>(inst) || !isFunctionCall(cast<CallInst>(inst))) {
+          continue;
+        }
+        const CallInst &call = cast<CallInst>(inst);
+        const Function *calledFun = call.getCalledFunction();
+        if (!calledFun) {
+          // Indirect calls may reach a deoptimization point.
+          reachesDeoptPoint = true;
+        } else if (!calledFun->isDeclaration()) {
+          callers[calledFun].push_back(&fun);
+        } else if (externalCallsReach) {
+          // The functions defined in other instrumented modules may reach a
+          // deoptimization point.
+          reachesDeoptPoint = true;
+        } else {
+          // A function defined in another module (a library function) only
+          // reaches a deoptimization point if it calls back into this module
+          // through a function pointer passed to it.
+          for (auto &arg : call.arg_operands()) {
+            const Function *passed = getPassedFunction(arg);
+            if (isUnknownFunctionPointer(arg)) {
+              reachesDeoptPoint = true;
+            } else if (passed && !passed->isDeclaration()) {
+              callers[passed].push_back(&fun);
+            }
+          }
+        }
+      }
+    }
+    if (reachesDeoptPoint) {
+      reaching.insert(fun.getName());
+      worklist.push_back(&fun);
+    }
+  }
+  // Propagate the result to the callers of each function which may reach a
+  // deoptimization point.
+  while (!worklist.empty()) {
+    Function *fun = worklist.back();
+    worklist.pop_back();
+    for (auto caller : callers.lookup(fun)) {
+      if (reaching.insert(caller->getName()).second) {
+        worklist.push_back(caller);
+      }
+    }
+  }
+}
+
+bool DeoptReachability::mayReachDeoptPoint(const Function *fun) const {
+  StringRef name = getOptName(fun->getName());
+  return defined.count(name) ? reaching.count(name) : externalCallsReach;
+}
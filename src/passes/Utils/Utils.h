@@ -1,9 +1,71 @@
 #ifndef FUNCTION_PASS_UTILS_H
 #define FUNCTION_PASS_UTILS_H
 
+#include <llvm/ADT/StringRef.h>
+#include <llvm/ADT/StringSet.h>
 #include <llvm/IR/Function.h>
+#include <llvm/IR/Instructions.h>
 #include <llvm/IR/Module.h>
 
+#define UNOPT_PREFIX "__unopt_"
+#define SAFEPOINT_POLL_SITE "__safepoint_poll_site"
+// The guard functions (see speculate.h).
+#define SPECULATE_FUN_NAME "__speculate"
+#define SPECULATE_INVALIDATABLE_FUN_NAME "__speculate_invalidatable"
+// The n-th specialized version of a function `fun` is called `__spec<n>_fun`
+// (see `UnoptimizedCopyPass`). Its calls are dispatched from the version
+// table `__versions_fun`.
+#define SPEC_PREFIX "__spec"
+#define VERSION_TABLE_PREFIX "__versions_"
+// The maximum number of specialized versions of a function (the version is
+// encoded in 3 bits of each patchpoint ID).
+#define MAX_VERSION 7
+// The function attribute which lists the specializations
+// (`<argument>=<value>,...`) `SpeculationPass` chose for a function.
+#define SPECIALIZE_ATTR "specialize"
+// The prefix of the profiling functions of the runtime (see profile.h).
+#define PROFILE_PREFIX "__profile_"
+// The metadata which holds the kind of each stackmap/patchpoint call created
+// by `CheckPointPass` (see `RecordKind`).
+#define RECORD_KIND_MD "stackmap.kind"
+// The module flag `CheckPointPass` sets when it records the calls to the
+// functions defined in other modules (`-instrument-external-calls`).
+#define EXTERNAL_CALLS_FLAG "stackmap.external-calls"
+
+/*
+ * What a stackmap/patchpoint call records. `LiveVariablesPass` emits the kind
+ * of each call into the location size table, so the runtime can tell, for
+ * example, whether an ID it is asked to patch is the ID of a guard (see
+ * `record_kind` in stmap.h).
+ */
+enum RecordKind {
+  // The return address of a call.
+  RECORD_CALL                = 0,
+  // A guard of an optimized function, which calls the guard failure handler.
+  RECORD_GUARD               = 1,
+  // An invalidatable guard of an optimized function, whose shadow is a no-op
+  // until the runtime patches in the call of the invalidation handler.
+  RECORD_INVALIDATABLE_GUARD = 2,
+  // The `stackmap` call which follows the call of a compact guard.
+  RECORD_COMPACT_GUARD       = 3,
+  // A safepoint poll of an optimized function.
+  RECORD_SAFEPOINT_POLL      = 4,
+  // A guard or a safepoint poll of an `__unopt_` function, where execution
+  // is resumed after a deoptimization.
+  RECORD_RESUME_POINT        = 5
+};
+
+/*
+ * Record the kind of the stackmap/patchpoint call `call`.
+ */
+void setRecordKind(llvm::CallInst *call, RecordKind kind);
+
+/*
+ * Return the kind of the stackmap/patchpoint call `call` (`RECORD_CALL` if it
+ * has none).
+ */
+RecordKind getRecordKind(const llvm::CallInst *call);
+
 struct PatchpointType {
   unsigned int type : 3;
   static const unsigned int STACKMAP        = 1 << 0;
@@ -22,4 +84,82 @@ struct PatchpointType {
 
 PatchpointType getPatchpointType(llvm::Function *fun);
 
+/*
+ * If `name` is the name of a specialized version of a function, return the
+ * name of the function, and store the number of the version in `version`.
+ * Otherwise, return `name`, and set `version` to 0.
+ */
+llvm::StringRef getGenericName(llvm::StringRef name, unsigned &version);
+
+/*
+ * Return true if `name` is the name of one of the guard functions
+ * (`__speculate` or `__speculate_invalidatable`).
+ */
+bool isGuardFunName(llvm::StringRef name);
+
+/*
+ * Return true if `fun` contains a guard (a call to `__speculate` or
+ * `__speculate_invalidatable`).
+ */
+bool containsGuard(const llvm::Function &fun);
+
+/*
+ * Return true if `SafepointPass` must insert safepoint polls in `fun`: if it
+ * contains a loop, or if it may call itself.
+ *
+ * Other functions return to their caller after a bounded number of
+ * instructions (the functions they call have their own polls), so they don't
+ * need a poll: the thread parks at the next poll of the caller instead.
+ */
+bool needsSafepointPoll(llvm::Function &fun);
+
+/*
+ * The functions of a module which may be on the call stack when a thread is
+ * deoptimized: those which contain a guard or a safepoint poll, and those
+ * which transitively call them.
+ *
+ * Indirect calls may reach a deoptimization point. The functions defined in
+ * other modules only do if `CheckPointPass` records the calls to them (see
+ * `EXTERNAL_CALLS_FLAG`); otherwise, a call to one of them (a library
+ * function) only reaches a deoptimization point through the function pointers
+ * passed to it.
+ *
+ * The analysis must be computed before `CheckPointPass` lowers the guards
+ * and the safepoint polls, and after it sets `EXTERNAL_CALLS_FLAG`. The twin and the specialized versions of a
+ * function have the same result as the function.
+ */
+class DeoptReachability {
+public:
+  /*
+   * Analyze the functions defined in `mod`. If `safepointsEnabled` is set,
+   * the safepoint polls are also deoptimization points.
+   */
+  DeoptReachability(llvm::Module &mod, bool safepointsEnabled);
+
+  /*
+   * Return true if a deoptimization point may be reached from `fun`.
+   * Functions which are not defined in the module are assumed to reach one
+   * if the calls to them are recorded.
+   */
+  bool mayReachDeoptPoint(const llvm::Function *fun) const;
+
+  /*
+   * Return the number of functions defined in the module, and the number of
+   * those which may reach a deoptimization point.
+   */
+  unsigned getNumFunctions() const { return numFunctions; }
+  unsigned getNumReaching() const { return reaching.size(); }
+
+private:
+  // Whether the functions defined in other modules may reach a
+  // deoptimization point.
+  bool externalCallsReach;
+  // The names of the (optimized) functions which may reach a deoptimization
+  // point.
+  llvm::StringSet<> reaching;
+  // The names of the functions defined in the module.
+  llvm::StringSet<> defined;
+  unsigned numFunctions;
+};
+
 #endif // FUNCTION_PASS_UTILS_H
@@ -1,12 +1,16 @@
 #include <vector>
-#include <map>
+#include <memory>
 #include <stdint.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/StringMap.h>
 #include <llvm/Pass.h>
 #include <llvm/IR/Intrinsics.h>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/InlineAsm.h>
 #include <llvm/IR/BasicBlock.h>
 #include <llvm/IR/Function.h>
+#include <llvm/IR/GlobalVariable.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/DataLayout.h>
 #include <llvm/IR/Instruction.h>
@@ -15,110 +19,220 @@
 #include <llvm/IR/Type.h>
 #include <llvm/IR/Value.h>
 #include <llvm/Support/raw_ostream.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/ErrorHandling.h>
 #include <llvm/Transforms/IPO/PassManagerBuilder.h>
 #include <llvm/IR/Dominators.h>
 #include <llvm/Transforms/Utils/BasicBlockUtils.h>
+#include "Utils.h"
 
-#define GUARD_FUN_NAME "__guard_failure"
-#define UNOPT_PREFIX "__unopt_"
+#define GUARD_FUN_NAME "__guard_failure_entry"
+#define COMPACT_GUARD_FUN_NAME "__guard_failure_compact_entry"
+#define SAFEPOINT_POLL_FUN_NAME "__safepoint_poll_entry"
+#define SAFEPOINT_FLAG_NAME "__safepoint_requested"
+#define OSR_FUN_NAME "__osr_enter"
+#define OSR_THRESHOLD_NAME "__osr_threshold"
+// The prefix of the symbol each translation unit defines, followed by its ID.
+#define TU_SYMBOL_PREFIX "__stackmap_tu_"
+// The size of the shadow of an invalidatable guard: a single `nop`, which the
+// runtime replaces with a `call rel32` (see guard_control.c).
+#define INVALIDATABLE_GUARD_SHADOW_SIZE 5
+// The maximum values of the fields of a patchpoint ID (see `CheckPointPass`).
+#define MAX_TU_ID ((1u << 20) - 1)
+#define MAX_FUN_INDEX ((1u << 16) - 1)
+#define MAX_CALLSITE ((1u << 24) - 1)
+// The weights of the branches of guards and safepoint polls: guards almost
+// never fail, and safepoints are almost never requested (these are the weights
+// LLVM uses for `__builtin_expect`).
+#define LIKELY_WEIGHT 2000
+#define UNLIKELY_WEIGHT 1
 
 using namespace llvm;
 using std::vector;
-using std::map;
 using std::pair;
 
+// If set, the guards of optimized functions are compiled as direct calls to a
+// shared failure handler, followed by a `stackmap` call, instead of as
+// patchpoints (see `lowerGuard`).
+static cl::opt<bool> CompactGuards(
+    "compact-guards",
+    cl::desc("Compile guards as direct calls to a shared failure handler"),
+    cl::init(false));
+
+// The ID of the translation unit, which is encoded in each patchpoint ID. If
+// 0, the ID is derived from the name of the module.
+static cl::opt<unsigned> TranslationUnitID(
+    "stackmap-tu-id",
+    cl::desc("The ID of the translation unit (1 to 2^20 - 1) in the stack map"),
+    cl::init(0));
+
+// If set, calls to functions declared (but not defined) in this module are
+// also recorded, so that functions defined in other translation units can be
+// deoptimized through.
+static cl::opt<bool> InstrumentExternalCalls(
+    "instrument-external-calls",
+    cl::desc("Record calls to functions defined in other translation units"),
+    cl::init(false));
+
+// If set, the safepoint polls on the loop back-edges of the `__unopt_`
+// functions count the iterations of the loops, and ask the runtime to move
+// the frame to the optimized function when a loop becomes hot (see
+// `insertOSRCheck`).
+static cl::opt<bool> OSREntries(
+    "osr-entries",
+    cl::desc("Resume hot loops of unoptimized functions in optimized code"),
+    cl::init(false));
+
 namespace {
 
 /*
  * Insert a `stackmap` call after each call to record its return address.
  *
+ * Only the calls to functions which may reach a guard or a safepoint poll are
+ * recorded (see `DeoptReachability`): the functions which can't are never on
+ * the call stack when a thread is deoptimized.
+ *
  * The unoptimized version of each function contains the same number of
  * `llvm.experimental.stackmap` calls as the original (user-defined) version.
  * Knowing the ID of a `stackmap` call in the optimized version of the function,
  * the ID of the corresponding call in the unoptimized version can be obtained
  * by calculating the logical negation of the ID.
+ *
+ * The ID of the n-th call in a function is
+ * (version << 60) | (TU << 40) | (funIndex << 24) | n, where `version` is the
+ * number of the specialized version of the function (0 for the function
+ * itself), `TU` identifies the translation unit, `funIndex` is the index of
+ * the function (shared by the function, its versions and its twin), and n
+ * starts at 1. The translation unit ID ensures the IDs of different modules
+ * don't collide when they are linked into the same binary.
+ *
+ * The versions of a function are copies of the function (see
+ * `UnoptimizedCopyPass`), so the n-th call of each version corresponds to the
+ * n-th call of the twin, whose ID is the negation of the ID of the n-th call
+ * of version 0.
  */
 struct CheckPointPass: public FunctionPass {
   static char id;
 
-  // Map each function name to the patchpoint IDs of the stackmap calls
-  // in the function. This is used to ensure the runtime can associate the
-  // stackmap calls inside each function with stackmap calls from the
-  // unoptimized version of the function.
-  static map<StringRef, vector<uint64_t>> stackMaps;
+  // Map the name of each optimized function to its index. The
+  // `__unopt_` twin and the specialized versions of a function use the index
+  // of the function.
+  static StringMap<uint32_t> funIndices;
+  // Map each function name to the number of IDs allocated in the function.
+  static StringMap<uint32_t> callsiteCounts;
+  // The ID of the current translation unit.
+  static uint64_t tuID;
+  // The functions which may reach a deoptimization point.
+  static std::unique_ptr<DeoptReachability> reachability;
+  // The number of calls which were recorded, and the number of calls which
+  // weren't, because they can't reach a deoptimization point.
+  static unsigned numRecordedCalls;
+  static unsigned numSkippedCalls;
 
   CheckPointPass() : FunctionPass(id) {}
 
   virtual bool doInitialization(Module &mod) {
     // Declare the guard failure function. This is necessary because the
-    // `__guard_failure` function is not defined in the current module.
+    // `__guard_failure` function is not defined in the current module. The
+    // patchpoints call its entry stub, which saves the registers of the
+    // optimized function before calling `__guard_failure`.
     LLVMContext &ctx = mod.getContext();
     Type* i64 = Type::getInt64Ty(ctx);
-    FunctionType* signature = FunctionType::get(Type::getVoidTy(ctx),
-                                                i64, false);
-    Function *stackmap_func = Function::Create(
-        signature, Function::ExternalLinkage, "__guard_failure", &mod);
+    Function::Create(FunctionType::get(Type::getVoidTy(ctx), false),
+                     Function::ExternalLinkage, GUARD_FUN_NAME, &mod);
+    // The handler of the compact guards preserves all the registers, like the
+    // `anyregcc` patchpoints (see `lowerGuard`).
+    Function *compactHandler = Function::Create(
+        FunctionType::get(Type::getVoidTy(ctx), false),
+        Function::ExternalLinkage, COMPACT_GUARD_FUN_NAME, &mod);
+    compactHandler->setCallingConv(CallingConv::PreserveAll);
+    // The callback of the safepoint polls, and the flag which indicates
+    // whether a safepoint was requested, are defined by the runtime.
+    Function::Create(FunctionType::get(Type::getVoidTy(ctx), i64, false),
+                     Function::ExternalLinkage, SAFEPOINT_POLL_FUN_NAME, &mod);
+    mod.getOrInsertGlobal(SAFEPOINT_FLAG_NAME, Type::getInt8Ty(ctx));
+    if (OSREntries) {
+      // The OSR handler, and the number of iterations after which it is
+      // called, are defined by the runtime.
+      Function::Create(FunctionType::get(Type::getVoidTy(ctx), i64, false),
+                       Function::ExternalLinkage, OSR_FUN_NAME, &mod);
+      mod.getOrInsertGlobal(OSR_THRESHOLD_NAME, Type::getInt32Ty(ctx));
+    }
+    tuID = TranslationUnitID ? TranslationUnitID
+                             : hashModuleName(mod.getModuleIdentifier());
+    if (!tuID || tuID > MAX_TU_ID) {
+      report_fatal_error("Invalid translation unit ID");
+    }
+    // Define a (non-weak) symbol named after the ID, so that linking two
+    // translation units with the same ID fails with a duplicate symbol.
+    new GlobalVariable(mod, Type::getInt8Ty(ctx), true,
+                       GlobalValue::ExternalLinkage,
+                       ConstantInt::get(Type::getInt8Ty(ctx), 0),
+                       TU_SYMBOL_PREFIX + Twine(tuID));
+    // The other passes which analyze the module find out whether the calls
+    // to the functions defined in other modules are recorded from this flag.
+    if (InstrumentExternalCalls) {
+      mod.addModuleFlag(Module::Warning, EXTERNAL_CALLS_FLAG, 1);
+    }
+    // `SafepointPass` declares the poll function if it is enabled.
+    reachability.reset(new DeoptReachability(
+        mod, mod.getFunction(SAFEPOINT_POLL_SITE) != nullptr));
     return true;
   }
 
+  virtual bool doFinalization(Module &mod) {
+    // Each skipped call would have needed a `stackmap` call, and two block
+    // splits (see `BarrierPass`).
+    outs() << "CheckPointPass: " << reachability->getNumReaching() << " of "
+           << reachability->getNumFunctions()
+           << " functions may reach a guard; recorded " << numRecordedCalls
+           << " calls, skipped " << numSkippedCalls << " stackmaps and "
+           << 2 * numSkippedCalls << " block splits\n";
+    return false;
+  }
+
   virtual bool runOnFunction(Function &fun) {
     Module *mod = fun.getParent();
     StringRef funName = fun.getName();
     outs() << "Running CheckPointPass on function: " << funName << '\n';
-    Type *i8ptr_t = PointerType::getUnqual(
-        IntegerType::getInt8Ty(mod->getContext()));
     vector <Instruction *> callInsts;
-    // The callback to call when a guard fails.
-    Constant* guardHandler = ConstantExpr::getBitCast(
-        mod->getFunction(GUARD_FUN_NAME), i8ptr_t);
+    // The guards and the safepoint polls in this function, and their
+    // patchpoint IDs.
+    vector<pair<CallInst *, uint64_t>> guards;
+    vector<pair<CallInst *, uint64_t>> safepointPolls;
+    // The polls on the loop back-edges (the poll at the entry of the function
+    // is the only one in the entry block).
+    SmallPtrSet<CallInst *, 8> backEdgePolls;
     for (auto &bb : fun) {
       for (BasicBlock::iterator it = bb.begin(); it != bb.end(); ++it) {
-        // XXX This is where the guard must fail (an arbitrary instruction in
-        // the "more_indirection" function).
-        if (funName.endswith("more_indirection") && isa<ReturnInst>(it)) {
-          LLVMContext &ctx = bb.getContext();
-          IRBuilder<> builder(&bb, it->getIterator());
-          uint64_t PPID = getNextPatchpointID(funName);
-          // The first two arguments of a stackmap/patchpoint intrinsic call
-          // are the unique identifier of the call, and the number of bytes
-          // in the shadow of the call.
-          auto args = vector<Value*> { builder.getInt64(PPID),
-                                       builder.getInt32(13) // XXX shadow
-                                      };
-          // The intrinsic to call: patchpoint, if the current function is
-          // optimized; stackmap, if the current function is unoptimized.
-          Function *intrinsic = nullptr;
-          if (!funName.startswith(UNOPT_PREFIX)) {
-            // The current function is an optimized one -> insert a patchpoint
-            // call. The arguments of the patchpoint call are: a callback, an
-            // integer which represents the number of arguments of the
-            // callback, and the arguments to pass to the callback.
-            args.insert(args.end(),
-                        { guardHandler,          // the callback
-                          builder.getInt32(1),   // the callback has 1 argument
-                          builder.getInt64(PPID) // the argument
-                        });
-            intrinsic = Intrinsic::getDeclaration(
-                mod, Intrinsic::experimental_patchpoint_void);
-          } else {
-            // The function is not optimized -> insert a patchpoint call with
-            // no callback
-            auto callback = builder.CreateIntToPtr(builder.getInt64(0),
-                                                   builder.getInt8PtrTy());
-            args.insert(args.end(),
-                        { callback,              // no callback
-                          builder.getInt32(0),   // the callback has no arguments
-                        });
-            intrinsic = Intrinsic::getDeclaration(
-                mod, Intrinsic::experimental_patchpoint_void);
+        if (isGuard(&*it)) {
+          // The guards are lowered after all the IDs are allocated, because
+          // lowering a guard splits the current basic block.
+          guards.push_back({ cast<CallInst>(&*it),
+                             getNextPatchpointID(funName) });
+        } else if (isSafepointPollSite(&*it)) {
+          // The polls are lowered after all the IDs are allocated, because
+          // lowering a poll splits the current basic block.
+          safepointPolls.push_back({ cast<CallInst>(&*it),
+                                     getNextPatchpointID(funName) });
+          if (&bb != &fun.getEntryBlock()) {
+            backEdgePolls.insert(cast<CallInst>(&*it));
           }
-          auto callInst = builder.CreateCall(intrinsic, args);
         } else if (isa<CallInst>(it)) {
           CallInst &oldCallInst = cast<CallInst>(*it);
           Function *calledFun = oldCallInst.getCalledFunction();
-          if (!oldCallInst.isInlineAsm() &&
+          // A `musttail` call (to a specialized version of this function)
+          // replaces the frame of this function, so its return address is
+          // never on the call stack.
+          if (!oldCallInst.isInlineAsm() && !oldCallInst.isMustTailCall() &&
               !calledFun->hasAvailableExternallyLinkage() &&
-              !calledFun->isDeclaration()) {
+              (!calledFun->isDeclaration() || isExternalCall(calledFun))) {
+            if (!reachability->mayReachDeoptPoint(calledFun)) {
+              // A guard can't fail while this call is on the call stack.
+              ++numSkippedCalls;
+              continue;
+            }
+            ++numRecordedCalls;
             // This is a function call. A guard might fail inside the called
             // function, so its return address must be recorded.
             uint64_t PPID = getNextPatchpointID(funName);
@@ -126,75 +240,33 @@ struct CheckPointPass: public FunctionPass {
             auto args = vector<Value*> { builder.getInt64(PPID),
                                          builder.getInt32(13)
                                        };
-            if (funName.startswith(UNOPT_PREFIX)) {
-              // The current function is an unoptimized one, so we must replace
-              // all calls inside it with patchpoint calls. The originally
-              // called functions will be passed as callbacks to the patchpoint
-              // calls. This enables the runtime to accurately identify the
-              // return addresses of the calls.
-              if (!calledFun->getName().startswith(UNOPT_PREFIX)) {
-                calledFun = mod->getFunction(getTwinName(calledFun->getName()));
-              }
-              // The callback to pass to the patchpoint call.
-              Constant* callback = ConstantExpr::getBitCast(calledFun, i8ptr_t);
-              args.insert(args.end(),
-                          { callback,          // the callback
-                            builder.getInt32(oldCallInst.getNumArgOperands())
-                          });
-              for (unsigned i = 0; i < oldCallInst.getNumArgOperands(); ++i) {
-                args.push_back(oldCallInst.getArgOperand(i));
-              }
-              // Find the correct `llvm.experimental.patchpoint.*` to call,
-              // according to the return value of the called function.
-              Function *intrinsic = nullptr;
-              if (calledFun->getReturnType()->isVoidTy()) {
-                intrinsic = Intrinsic::getDeclaration(
-                  mod, Intrinsic::experimental_patchpoint_void);
-              } else {
-                intrinsic = Intrinsic::getDeclaration(
-                  mod, Intrinsic::experimental_patchpoint_i64);
-              }
-              // Recreate this call instruction as a patchpoint call.
-              auto callInst = CallInst::Create(intrinsic, args);
-              // Replace the uses of this call instruction with the newly
-              // created patchpoint call.
-              auto calledFunRetTy = calledFun->getReturnType();
-              if (calledFunRetTy->isVoidTy()) {
-                if (!oldCallInst.use_empty()) {
-                  oldCallInst.replaceAllUsesWith(callInst);
-                }
-              } else {
-                auto retTy = oldCallInst.getCalledFunction()->getReturnType();
-                Value *retValue = nullptr;
-                if (calledFunRetTy->isIntegerTy()) {
-                  retValue = builder.CreateTruncOrBitCast(callInst, retTy);
-                } else {
-                  auto floatPtrTy = PointerType::getUnqual(retTy);
-                  retValue = builder.CreateIntToPtr(callInst, floatPtrTy);
-                  retValue = builder.CreateLoad(retValue, retTy);
-                }
-                if (!oldCallInst.use_empty()) {
-                  oldCallInst.replaceAllUsesWith(retValue);
-                }
-              }
-              ReplaceInstWithInst(&oldCallInst, callInst);
-              it = callInst->getIterator();
-              callInsts.push_back(&*it);
-            } else {
-              // The function is not an __unopt_ function. Insert a  stackmap
-              // call after the current call instruction to record the return
-              // address of the call. Patchpoint callbacks are never inlined,
-              // which is why we must use `stackmap` calls in the optimized
-              // versions of the functions.
-              auto intrinsic = Intrinsic::getDeclaration(
-                  mod, Intrinsic::experimental_stackmap);
-              builder.CreateCall(intrinsic, args);
-              callInsts.push_back(&*it);
-            }
+            // The calls of the `__unopt_` functions are not redirected: a
+            // fresh call made after a deoptimization runs the optimized
+            // version of the called function. Only the frames restored by the
+            // runtime execute the `__unopt_` versions.
+            // Insert a stackmap call after the current call instruction to
+            // record the return address of the call. The runtime finds the
+            // end of the call instruction which precedes the stackmap call
+            // (see `stmap_get_call_ret_addr`).
+            auto intrinsic = Intrinsic::getDeclaration(
+                mod, Intrinsic::experimental_stackmap);
+            setRecordKind(builder.CreateCall(intrinsic, args), RECORD_CALL);
+            callInsts.push_back(&*it);
           }
         }
       }
     }
+    for (auto &guard : guards) {
+      if (guard.first->getCalledFunction()->getName() == SPECULATE_FUN_NAME) {
+        lowerGuard(guard.first, guard.second);
+      } else {
+        lowerInvalidatableGuard(guard.first, guard.second);
+      }
+    }
+    for (auto &poll : safepointPolls) {
+      lowerSafepointPoll(poll.first, poll.second,
+                         backEdgePolls.count(poll.first));
+    }
     for (auto inst: callInsts) {
       IRBuilder<> builder(inst);
       FunctionType *funType = FunctionType::get(builder.getVoidTy(), false);
@@ -210,63 +282,373 @@ struct CheckPointPass: public FunctionPass {
   }
 
   /*
-   * Return the name of the 'twin' of the specified function.
+   * Return true if the calls to the declared function `fun` should be
+   * recorded (see `InstrumentExternalCalls`).
+   *
+   * Variadic functions, functions which don't return an integer, intrinsics,
+   * and the functions of the runtime are never recorded.
+   */
+  static bool isExternalCall(Function *fun) {
+    Type *retTy = fun->getReturnType();
+    return InstrumentExternalCalls && !fun->isIntrinsic() &&
+           !fun->isVarArg() && !fun->getName().startswith("__") &&
+           (retTy->isVoidTy() || retTy->isIntegerTy());
+  }
+
+  /*
+   * Return the ID of a translation unit called `name`: a 20-bit FNV-1a hash of
+   * the name, which is never 0. Translation units whose IDs collide can't be
+   * linked together (see `doInitialization`), and must be given an ID using
+   * `-stackmap-tu-id`.
+   */
+  static uint64_t hashModuleName(StringRef name) {
+    uint32_t hash = 2166136261u;
+    for (char c : name) {
+      hash = (hash ^ (uint8_t)c) * 16777619u;
+    }
+    hash = (hash >> 20 ^ hash) & MAX_TU_ID;
+    return hash ? hash : 1;
+  }
+
+  /*
+   * Return true if `inst` is a guard (a call to `__speculate` or
+   * `__speculate_invalidatable`).
+   */
+  static bool isGuard(Instruction *inst) {
+    if (!isa<CallInst>(inst)) {
+      return false;
+    }
+    Function *calledFun = cast<CallInst>(inst)->getCalledFunction();
+    return calledFun && isGuardFunName(calledFun->getName());
+  }
+
+  /*
+   * Replace the guard `guard` (a call to `__speculate(cond)`) with a check of
+   * its condition, and a patchpoint call which is only executed if the
+   * condition doesn't hold:
+   *
+   *   %holds = icmp ne i32 %cond, 0
+   *   br i1 %holds, label %guard.cont, label %guard.fail, !prof
+   *   ...
+   * guard.fail:
+   *   call void @llvm.experimental.patchpoint.void(i64 ID, i32 13, ...)
+   *   br label %guard.cont
+   *
+   * The failure block is placed at the end of the function. In optimized
+   * functions, the patchpoint calls `__guard_failure` (through its entry
+   * stub), which doesn't return. Its shadow consists of two instructions:
+   *
+   *   movabs $__guard_failure_entry, %r11
+   *   callq *%r11
+   *
+   * These guards can't be patched: they always deoptimize when their
+   * condition doesn't hold (see `lowerInvalidatableGuard` for the guards the
+   * runtime can invalidate).
+   *
+   * The patchpoints of optimized functions use the `anyregcc` calling
+   * convention, which preserves all the registers: the values which are live
+   * after the guard don't need to be moved to callee-saved registers or
+   * spilled around it. The callback has no arguments (`anyregcc` would pass
+   * them in arbitrary registers); the runtime finds the ID of the guard from
+   * the return address of the call.
    *
-   * If the specified name is the name of an optimized function, then the name
-   * of the function's 'twin' is the name prefixed with '__unopt_'. If the
-   * specified name is the name of an unoptimized function, then this returns
-   * the name of the optimized function (it strips off the '__unopt_' prefix).
+   * If `CompactGuards` is set, the failure block of a guard of an optimized
+   * function instead contains a direct call to the shared
+   * `__guard_failure_compact_entry` stub (5 bytes instead of the 13 bytes of
+   * the patchpoint shadow), which uses the `preserve_allcc` calling
+   * convention, followed by a `stackmap` call which records the live values
+   * at its return address. The runtime identifies the guard from the
+   * return address of the call.
    *
-   * Example: "fun" -> "__unopt_fun" or "__unopt_fun" -> "fun"
+   * In unoptimized functions, the patchpoint has no callback. It marks the
+   * position at which execution is resumed after the guard fails in the
+   * optimized function. The check is kept, so that the same values are live
+   * at the patchpoints of both versions of the function.
    */
-  static std::string getTwinName(StringRef name) {
-    if (name.startswith(UNOPT_PREFIX)) {
-      return name.drop_front(StringRef(UNOPT_PREFIX).size()).str();
+  static void lowerGuard(CallInst *guard, uint64_t PPID) {
+    Function *fun = guard->getFunction();
+    Module *mod = fun->getParent();
+    LLVMContext &ctx = mod->getContext();
+    Function *intrinsic = Intrinsic::getDeclaration(
+        mod, Intrinsic::experimental_patchpoint_void);
+    Value *cond = guard->getArgOperand(0);
+    BasicBlock *bb = guard->getParent();
+    BasicBlock *contBB = bb->splitBasicBlock(guard->getIterator(),
+                                             "guard.cont");
+    BasicBlock *failBB = BasicBlock::Create(ctx, "guard.fail", fun);
+    // Replace the unconditional branch created by `splitBasicBlock` with a
+    // check of the condition.
+    TerminatorInst *oldTerm = bb->getTerminator();
+    IRBuilder<> builder(oldTerm);
+    Value *holds = builder.CreateICmpNE(
+        cond, Constant::getNullValue(cond->getType()));
+    builder.CreateCondBr(holds, contBB, failBB,
+                         MDBuilder(ctx).createBranchWeights(
+                             LIKELY_WEIGHT, UNLIKELY_WEIGHT));
+    oldTerm->eraseFromParent();
+    builder.SetInsertPoint(failBB);
+    bool isOptimized = !fun->getName().startswith(UNOPT_PREFIX);
+    if (isOptimized && CompactGuards) {
+      builder.CreateCall(mod->getFunction(COMPACT_GUARD_FUN_NAME))
+        ->setCallingConv(CallingConv::PreserveAll);
+      setRecordKind(
+          builder.CreateCall(
+              Intrinsic::getDeclaration(mod, Intrinsic::experimental_stackmap),
+              { builder.getInt64(PPID),
+                builder.getInt32(0) // no shadow
+              }),
+          RECORD_COMPACT_GUARD);
+      builder.CreateBr(contBB);
+      guard->eraseFromParent();
+      return;
     }
-    return UNOPT_PREFIX + name.str();
+    Type *i8ptr_t = builder.getInt8PtrTy();
+    Value *noCallback = builder.CreateIntToPtr(builder.getInt64(0), i8ptr_t);
+    auto args = vector<Value*> { builder.getInt64(PPID),
+                                 builder.getInt32(13) };
+    Value *callback = noCallback;
+    if (isOptimized) {
+      callback = ConstantExpr::getBitCast(mod->getFunction(GUARD_FUN_NAME),
+                                          i8ptr_t);
+    }
+    args.insert(args.end(),
+                { callback,
+                  builder.getInt32(0) // the callback has no arguments
+                });
+    CallInst *patchpoint = builder.CreateCall(intrinsic, args);
+    if (isOptimized) {
+      patchpoint->setCallingConv(CallingConv::AnyReg);
+      setRecordKind(patchpoint, RECORD_GUARD);
+    } else {
+      setRecordKind(patchpoint, RECORD_RESUME_POINT);
+    }
+    builder.CreateBr(contBB);
+    guard->eraseFromParent();
+  }
+
+  /*
+   * Replace the invalidatable guard `guard` (a call to
+   * `__speculate_invalidatable(cond)`) with a patchpoint call on the fast
+   * path. The condition is not checked.
+   *
+   * In optimized functions, the patchpoint has no callback, so its shadow is
+   * a single 5-byte `nop`, which the runtime replaces with a call to the
+   * `__invalidated_guard_entry` stub when it invalidates the guard (see
+   * guard_control.h). The patchpoint uses the `anyregcc` calling convention,
+   * like the other guards. It is followed by an assumption that the
+   * condition holds, which the optimizer may use in the code that follows
+   * the guard: that code only runs while the guard is valid.
+   *
+   *   %holds = icmp ne i32 %cond, 0
+   *   call anyregcc void @llvm.experimental.patchpoint.void(i64 ID, i32 5, ...)
+   *   call void @llvm.assume(i1 %holds)
+   *
+   * The condition is computed before the patchpoint, and `LiveVariablesPass`
+   * ignores the operands of `llvm.assume`, so the guard records the same
+   * values as the patchpoint of the unoptimized function.
+   *
+   * In unoptimized functions, the patchpoint marks the position at which
+   * execution is resumed after the guard is reached while it is invalid.
+   */
+  static void lowerInvalidatableGuard(CallInst *guard, uint64_t PPID) {
+    Function *fun = guard->getFunction();
+    Module *mod = fun->getParent();
+    Function *intrinsic = Intrinsic::getDeclaration(
+        mod, Intrinsic::experimental_patchpoint_void);
+    bool isOptimized = !fun->getName().startswith(UNOPT_PREFIX);
+    IRBuilder<> builder(guard);
+    Value *cond = guard->getArgOperand(0);
+    Value *holds = nullptr;
+    if (isOptimized) {
+      holds = builder.CreateICmpNE(cond,
+                                   Constant::getNullValue(cond->getType()));
+    }
+    auto args = vector<Value*> { builder.getInt64(PPID),
+                                 builder.getInt32(isOptimized ? INVALIDATABLE_GUARD_SHADOW_SIZE
+                                                             : 13),
+                                 builder.CreateIntToPtr(builder.getInt64(0),
+                                                        builder.getInt8PtrTy()),
+                                 builder.getInt32(0) // no callback
+                               };
+    CallInst *patchpoint = builder.CreateCall(intrinsic, args);
+    if (isOptimized) {
+      patchpoint->setCallingConv(CallingConv::AnyReg);
+      setRecordKind(patchpoint, RECORD_INVALIDATABLE_GUARD);
+      builder.CreateCall(Intrinsic::getDeclaration(mod, Intrinsic::assume),
+                         { holds });
+    } else {
+      setRecordKind(patchpoint, RECORD_RESUME_POINT);
+    }
+    guard->eraseFromParent();
+  }
+
+  /*
+   * Return true if `inst` is a safepoint poll inserted by `SafepointPass`.
+   */
+  static bool isSafepointPollSite(Instruction *inst) {
+    if (!isa<CallInst>(inst)) {
+      return false;
+    }
+    Function *calledFun = cast<CallInst>(inst)->getCalledFunction();
+    return calledFun && calledFun->getName() == SAFEPOINT_POLL_SITE;
+  }
+
+  /*
+   * Replace the safepoint poll `pollSite` with a patchpoint call.
+   *
+   * In optimized functions, the patchpoint calls `__safepoint_poll` (through
+   * its entry stub), and it is only executed if `__safepoint_requested` is set:
+   *
+   *   %flag = load volatile i8, i8* @__safepoint_requested
+   *   %requested = icmp ne i8 %flag, 0
+   *   br i1 %requested, label %safepoint.poll, label %safepoint.cont, !prof
+   *
+   * In unoptimized functions, the patchpoint has no callback. It marks the
+   * position at which execution is resumed after a thread is deoptimized
+   * at the corresponding poll in the optimized function. If `onBackEdge` is
+   * set and `OSREntries` is enabled, it is preceded by an OSR check.
+   */
+  static void lowerSafepointPoll(CallInst *pollSite, uint64_t PPID,
+                                 bool onBackEdge) {
+    Function *fun = pollSite->getFunction();
+    Module *mod = fun->getParent();
+    LLVMContext &ctx = mod->getContext();
+    Function *intrinsic = Intrinsic::getDeclaration(
+        mod, Intrinsic::experimental_patchpoint_void);
+    bool isUnopt = fun->getName().startswith(UNOPT_PREFIX);
+    if (isUnopt && onBackEdge && OSREntries) {
+      insertOSRCheck(pollSite, PPID);
+    }
+    IRBuilder<> builder(pollSite);
+    auto args = vector<Value*> { builder.getInt64(PPID),
+                                 builder.getInt32(13) };
+    if (isUnopt) {
+      args.insert(args.end(),
+                  { builder.CreateIntToPtr(builder.getInt64(0),
+                                           builder.getInt8PtrTy()),
+                    builder.getInt32(0) });
+      setRecordKind(builder.CreateCall(intrinsic, args), RECORD_RESUME_POINT);
+      pollSite->eraseFromParent();
+      return;
+    }
+    BasicBlock *bb = pollSite->getParent();
+    BasicBlock *contBB = bb->splitBasicBlock(pollSite->getIterator(),
+                                             "safepoint.cont");
+    BasicBlock *pollBB = BasicBlock::Create(ctx, "safepoint.poll", fun,
+                                            contBB);
+    // Replace the unconditional branch created by `splitBasicBlock` with a
+    // check of the safepoint flag.
+    TerminatorInst *oldTerm = bb->getTerminator();
+    builder.SetInsertPoint(oldTerm);
+    Value *flag = builder.CreateLoad(
+        mod->getNamedGlobal(SAFEPOINT_FLAG_NAME), true /* isVolatile */);
+    Value *requested = builder.CreateICmpNE(flag, builder.getInt8(0));
+    // The poll block is unlikely to be executed, so it is moved out of the
+    // hot path, to the end of the function.
+    builder.CreateCondBr(requested, pollBB, contBB,
+                         MDBuilder(ctx).createBranchWeights(
+                             UNLIKELY_WEIGHT, LIKELY_WEIGHT));
+    oldTerm->eraseFromParent();
+    builder.SetInsertPoint(pollBB);
+    Type *i8ptr_t = builder.getInt8PtrTy();
+    args.insert(args.end(),
+                { ConstantExpr::getBitCast(
+                      mod->getFunction(SAFEPOINT_POLL_FUN_NAME), i8ptr_t),
+                  builder.getInt32(1),   // the callback has 1 argument
+                  builder.getInt64(PPID) // the argument
+                });
+    setRecordKind(builder.CreateCall(intrinsic, args), RECORD_SAFEPOINT_POLL);
+    builder.CreateBr(contBB);
+    pollSite->eraseFromParent();
+  }
+
+  /*
+   * Count the iterations of the loop whose back-edge contains the poll
+   * `pollSite` of an unoptimized function, and call the OSR handler of the
+   * runtime after `__osr_threshold` iterations:
+   *
+   *   %count = add i32 %prev, 1
+   *   store i32 %count, i32* @__osr_counter
+   *   %hot = icmp uge i32 %count, %threshold
+   *   br i1 %hot, label %osr.entry, label %osr.cont, !prof
+   *
+   * osr.entry:
+   *   store i32 0, i32* @__osr_counter
+   *   call void @__osr_enter(i64 PPID)
+   *   br label %osr.cont
+   *
+   * The handler moves the frame to the optimized function, and resumes
+   * execution after the poll with ID `~PPID`. If it can't, it returns. The
+   * counter of each loop is thread-local.
+   */
+  static void insertOSRCheck(CallInst *pollSite, uint64_t PPID) {
+    Function *fun = pollSite->getFunction();
+    Module *mod = fun->getParent();
+    LLVMContext &ctx = mod->getContext();
+    Type *i32 = Type::getInt32Ty(ctx);
+    auto counter = new GlobalVariable(
+        *mod, i32, false /* isConstant */, GlobalValue::PrivateLinkage,
+        ConstantInt::get(i32, 0), "__osr_counter", nullptr,
+        GlobalValue::GeneralDynamicTLSModel);
+    BasicBlock *bb = pollSite->getParent();
+    BasicBlock *contBB = bb->splitBasicBlock(pollSite->getIterator(),
+                                             "osr.cont");
+    BasicBlock *osrBB = BasicBlock::Create(ctx, "osr.entry", fun, contBB);
+    TerminatorInst *oldTerm = bb->getTerminator();
+    IRBuilder<> builder(oldTerm);
+    Value *count = builder.CreateAdd(builder.CreateLoad(counter),
+                                     builder.getInt32(1));
+    builder.CreateStore(count, counter);
+    Value *threshold =
+        builder.CreateLoad(mod->getNamedGlobal(OSR_THRESHOLD_NAME));
+    builder.CreateCondBr(builder.CreateICmpUGE(count, threshold), osrBB,
+                         contBB,
+                         MDBuilder(ctx).createBranchWeights(
+                             UNLIKELY_WEIGHT, LIKELY_WEIGHT));
+    oldTerm->eraseFromParent();
+    builder.SetInsertPoint(osrBB);
+    builder.CreateStore(builder.getInt32(0), counter);
+    builder.CreateCall(mod->getFunction(OSR_FUN_NAME),
+                       { builder.getInt64(PPID) });
+    builder.CreateBr(contBB);
   }
 
   /*
    * Generate a new patchpoint ID for the specified function.
+   *
+   * The k-th ID generated for a function and the k-th ID generated for its
+   * twin are each other's logical negation, regardless of which of the two
+   * functions is processed first. The k-th ID generated for a specialized
+   * version of the function only differs from the ID of the function in its
+   * version bits.
    */
   static uint64_t getNextPatchpointID(StringRef funName) {
-    uint64_t nextPatchpointID = 0;
-    if (!stackMaps.empty()) {
-        std::string twinFun = getTwinName(funName);
-        if (stackMaps.find(twinFun) == stackMaps.end()) {
-          // The `twin` of the function doesn't have any IDs allocated yet.
-          // This means the next ID is equal to the last ID generated for the
-          // current function plus one.
-          auto maxPos = std::max_element(stackMaps.begin(), stackMaps.end(),
-              [] (const pair<StringRef, vector<uint64_t>> &a,
-                    const pair<StringRef, vector<uint64_t>> &b) {
-                return a.second.back() < b.second.back();
-              });
-          nextPatchpointID = (*maxPos).second.back() + 1;
-        } else {
-          // Find (in the `twin` function) the ID of the `stackmap` which
-          // corresponds to the ID currently being generated. Negate the ID
-          // found, to obtain a new ID for the current function.
-          size_t lastIndex = stackMaps[funName].size();
-          nextPatchpointID = ~stackMaps[twinFun][lastIndex];
-        }
-    }
-    if (stackMaps.find(funName) == stackMaps.end() &&
-        stackMaps.find(getTwinName(funName)) == stackMaps.end()) {
-      // This ensures `stackmap`/`patchpoint` calls which belong to the same
-      // function have consecutive identifiers. When a new function is found,
-      // `nextPatchpointID` has to be incremented.
-      ++nextPatchpointID;
+    bool isUnopt = funName.startswith(UNOPT_PREFIX);
+    unsigned version = 0;
+    StringRef optName =
+        isUnopt ? funName.drop_front(StringRef(UNOPT_PREFIX).size())
+                : getGenericName(funName, version);
+    auto index = funIndices.insert({ optName, funIndices.size() + 1 });
+    uint64_t callsite = ++callsiteCounts[funName];
+    if (index.first->second > MAX_FUN_INDEX || callsite > MAX_CALLSITE ||
+        version > MAX_VERSION) {
+      report_fatal_error("Too many stackmap calls in module");
     }
-    stackMaps[funName].push_back(nextPatchpointID);
-    return nextPatchpointID;
+    uint64_t PPID = (uint64_t)version << 60 | tuID << 40 |
+                    (uint64_t)index.first->second << 24 | callsite;
+    return isUnopt ? ~PPID : PPID;
   }
 };
 
 } // end anonymous namespace
 
 char CheckPointPass::id = 0;
-map<StringRef, vector<uint64_t>> CheckPointPass::stackMaps;
+StringMap<uint32_t> CheckPointPass::funIndices;
+StringMap<uint32_t> CheckPointPass::callsiteCounts;
+uint64_t CheckPointPass::tuID = 0;
+std::unique_ptr<DeoptReachability> CheckPointPass::reachability;
+unsigned CheckPointPass::numRecordedCalls = 0;
+unsigned CheckPointPass::numSkippedCalls = 0;
 
 // Automatically enable the pass.
 // http://adriansampson.net/blog/clangpass.html
@@ -0,0 +1,529 @@
+#include <vector>
+#include <llvm/Pass.h>
+#include <llvm/ADT/APInt.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IntrinsicInst.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Analysis/PostDominators.h>
+#include <llvm/Analysis/ValueTracking.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/IPO/PassManagerBuilder.h>
+#include <llvm/Transforms/Utils/Local.h>
+#include <llvm/Transforms/Utils/ValueMapper.h>
+#include "Utils.h"
+
+// The maximum depth of the expressions `GuardOptPass` compares and copies.
+#define MAX_EXPR_DEPTH 8
+
+using namespace llvm;
+using std::vector;
+
+namespace {
+
+/*
+ * Remove the redundant checks of the guards (the calls to `__speculate`) of
+ * each function:
+ *  - a guard whose condition doesn't change in a loop, and which is executed
+ *    on each iteration of the loop, is hoisted to the preheader of the loop.
+ *    If the loop may exit before its first iteration, the hoisted guard is
+ *    only checked if the loop is entered. If it fails, execution is resumed
+ *    at the entry of the loop in the `__unopt_` function.
+ *  - a guard which is dominated by a guard with the same condition is
+ *    removed.
+ *  - a guard which is always executed after a dominating guard is merged into
+ *    the dominating guard, which is widened to check both conditions. If both
+ *    conditions compare the same value against a constant, only the stronger
+ *    comparison is kept.
+ *
+ * A hoisted or widened guard may fail earlier than the original guards, but
+ * never if the original guards would have succeeded: the `__unopt_` function
+ * then executes the code between the two positions.
+ *
+ * The conditions are compared and moved only if they are "stable": if they
+ * are computed (without side effects) from constants, arguments, and
+ * variables which are only assigned in the entry block (see `isStable`).
+ *
+ * This pass must run before `CheckPointPass` lowers the guards. Since the
+ * `__unopt_` twins are created before any function is transformed, the same
+ * guards are moved and removed in each function and in its twin, and the
+ * patchpoint IDs of the remaining guards still match.
+ */
+struct GuardOptPass: public FunctionPass {
+  static char id;
+  // The number of guards of optimized functions which were hoisted out of
+  // loops, removed, and merged into other guards.
+  static unsigned numHoisted;
+  static unsigned numRemoved;
+  static unsigned numWidened;
+
+  GuardOptPass() : FunctionPass(id) {}
+
+  virtual bool runOnFunction(Function &fun) {
+    outs() << "Running GuardOptPass on function: " << fun.getName() << '\n';
+    vector<CallInst *> guards;
+    for (auto &bb : fun) {
+      for (auto &inst : bb) {
+        if (isGuard(&inst)) {
+          guards.push_back(cast<CallInst>(&inst));
+        }
+      }
+    }
+    if (guards.empty()) {
+      return false;
+    }
+    bool isOptimized = !fun.getName().startswith(UNOPT_PREFIX);
+    DominatorTree DT(fun);
+    LoopInfo LI(DT);
+    PostDominatorTree PDT;
+    PDT.recalculate(fun);
+    DenseMap<Loop *, Value *> entryConds;
+    for (auto &guard : guards) {
+      CallInst *hoisted = hoistGuard(guard, DT, LI, entryConds);
+      if (hoisted != guard && isOptimized) {
+        ++numHoisted;
+      }
+      guard = hoisted;
+    }
+    for (size_t i = 0; i < guards.size(); ++i) {
+      for (size_t j = 0; j < guards.size() && guards[i]; ++j) {
+        if (i == j || !guards[j] || !DT.dominates(guards[i], guards[j])) {
+          continue;
+        }
+        if (removeDuplicate(guards[i], guards[j], DT)) {
+          numRemoved += isOptimized;
+          guards[j] = nullptr;
+        } else if (widenGuard(guards[i], guards[j], DT, PDT)) {
+          numWidened += isOptimized;
+          guards[j] = nullptr;
+        }
+      }
+    }
+    return true;
+  }
+
+  virtual bool doFinalization(Module &mod) {
+    outs() << "GuardOptPass: hoisted " << numHoisted << ", removed "
+           << numRemoved << " and widened " << numWidened << " guards\n";
+    return false;
+  }
+
+  /*
+   * Return true if `inst` is a guard (a call to `__speculate`).
+   */
+  static bool isGuard(Instruction *inst) {
+    if (!isa<CallInst>(inst)) {
+      return false;
+    }
+    Function *calledFun = cast<CallInst>(inst)->getCalledFunction();
+    return calledFun && calledFun->getName() == SPECULATE_FUN_NAME;
+  }
+
+  /*
+   * Return true if `ptr` is an `alloca` which doesn't escape, and which is
+   * only stored to in the entry block, before `at`. Each load from `ptr`
+   * which is executed after `at` reads the same value.
+   */
+  static bool isAssignedOnEntry(Value *ptr, Instruction *at,
+                                DominatorTree &DT) {
+    if (!isa<AllocaInst>(ptr)) {
+      return false;
+    }
+    BasicBlock *entry = &at->getFunction()->getEntryBlock();
+    for (auto user : ptr->users()) {
+      if (isa<LoadInst>(user)) {
+        continue;
+      }
+      if (auto store = dyn_cast<StoreInst>(user)) {
+        if (store->getPointerOperand() == ptr &&
+            store->getParent() == entry && DT.dominates(store, at)) {
+          continue;
+        }
+        return false;
+      }
+      // clang marks the lifetime of local variables with intrinsics which
+      // take the address of the variable as an `i8 *`.
+      if (isa<BitCastInst>(user)) {
+        for (auto castUser : user->users()) {
+          auto intrinsic = dyn_cast<IntrinsicInst>(castUser);
+          if (!intrinsic ||
+              (intrinsic->getIntrinsicID() != Intrinsic::lifetime_start &&
+               intrinsic->getIntrinsicID() != Intrinsic::lifetime_end)) {
+            return false;
+          }
+        }
+        continue;
+      }
+      return false;
+    }
+    return true;
+  }
+
+  /*
+   * Return true if `val` can be computed at `at`, and has the same value
+   * there as anywhere else it is stable. `val` is stable if it is a constant,
+   * an argument, a load from a variable which is only assigned on entry (see
+   * `isAssignedOnEntry`), or an instruction without side effects whose
+   * operands are stable.
+   */
+  static bool isStable(Value *val, Instruction *at, DominatorTree &DT,
+                       unsigned depth = 0) {
+    if (isa<Constant>(val) || isa<Argument>(val)) {
+      return true;
+    }
+    auto inst = dyn_cast<Instruction>(val);
+    if (!inst || depth > MAX_EXPR_DEPTH) {
+      return false;
+    }
+    if (auto load = dyn_cast<LoadInst>(inst)) {
+      return !load->isVolatile() &&
+             isAssignedOnEntry(load->getPointerOperand(), at, DT);
+    }
+    if (isa<AllocaInst>(inst)) {
+      return inst->getParent() == &inst->getFunction()->getEntryBlock();
+    }
+    if (isa<PHINode>(inst) || !isSafeToSpeculativelyExecute(inst)) {
+      return false;
+    }
+    for (auto &op : inst->operands()) {
+      if (!isStable(op, at, DT, depth + 1)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /*
+   * Return true if the stable values `a` and `b` are equal.
+   */
+  static bool isSameValue(Value *a, Value *b, unsigned depth = 0) {
+    if (a == b) {
+      return true;
+    }
+    auto instA = dyn_cast<Instruction>(a);
+    auto instB = dyn_cast<Instruction>(b);
+    if (!instA || !instB || depth > MAX_EXPR_DEPTH ||
+        !instA->isSameOperationAs(instB)) {
+      return false;
+    }
+    if (isa<LoadInst>(instA)) {
+      return instA->getOperand(0) == instB->getOperand(0);
+    }
+    for (unsigned i = 0; i < instA->getNumOperands(); ++i) {
+      if (!isSameValue(instA->getOperand(i), instB->getOperand(i),
+                       depth + 1)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /*
+   * Return a value equal to the stable value `val`, which is available at
+   * `at`. The instructions which compute `val` are copied before `at`, unless
+   * they dominate it.
+   */
+  static Value *materialize(Value *val, Instruction *at, DominatorTree &DT) {
+    auto inst = dyn_cast<Instruction>(val);
+    if (!inst || DT.dominates(inst, at)) {
+      return val;
+    }
+    Instruction *copy = inst->clone();
+    for (unsigned i = 0; i < copy->getNumOperands(); ++i) {
+      copy->setOperand(i, materialize(inst->getOperand(i), at, DT));
+    }
+    copy->insertBefore(at);
+    return copy;
+  }
+
+  /*
+   * Remove `guard`, and the computation of its condition, if it isn't used
+   * elsewhere.
+   */
+  static void eraseGuard(CallInst *guard) {
+    Value *cond = guard->getArgOperand(0);
+    guard->eraseFromParent();
+    RecursivelyDeleteTriviallyDeadInstructions(cond);
+  }
+
+  /*
+   * Return a value which is true if `loop` is entered from its preheader,
+   * computed at the end of the preheader, or null if it can't be computed.
+   *
+   * The condition is computed by copying the instructions of the header to
+   * the preheader, which is only possible if the header exits the loop with a
+   * conditional branch, and if it has no side effects. The condition of each
+   * loop is only computed once, and cached in `entryConds`.
+   */
+  static Value *getEntryCondition(Loop *loop,
+                                  DenseMap<Loop *, Value *> &entryConds) {
+    auto cached = entryConds.find(loop);
+    if (cached != entryConds.end()) {
+      return cached->second;
+    }
+    Value *&entryCond = entryConds[loop];
+    BasicBlock *header = loop->getHeader();
+    Instruction *at = loop->getLoopPreheader()->getTerminator();
+    auto br = dyn_cast<BranchInst>(header->getTerminator());
+    if (!br || !br->isConditional() ||
+        loop->contains(br->getSuccessor(0)) ==
+        loop->contains(br->getSuccessor(1))) {
+      return nullptr;
+    }
+    for (auto &inst : *header) {
+      if (&inst != br && inst.mayHaveSideEffects()) {
+        return nullptr;
+      }
+    }
+    ValueToValueMapTy map;
+    vector<Instruction *> copies;
+    for (auto &inst : *header) {
+      if (auto phi = dyn_cast<PHINode>(&inst)) {
+        map[phi] = phi->getIncomingValueForBlock(at->getParent());
+      } else if (&inst != br) {
+        Instruction *copy = inst.clone();
+        copy->insertBefore(at);
+        RemapInstruction(copy, map,
+                         RF_NoModuleLevelChanges | RF_IgnoreMissingLocals);
+        map[&inst] = copy;
+        copies.push_back(copy);
+      }
+    }
+    Value *cond = br->getCondition();
+    if (Value *copy = map.lookup(cond)) {
+      cond = copy;
+    }
+    if (!loop->contains(br->getSuccessor(0))) {
+      cond = BinaryOperator::CreateNot(cond, "", at);
+    }
+    // Only keep the instructions which compute the condition.
+    for (auto it = copies.rbegin(); it != copies.rend(); ++it) {
+      if ((*it)->use_empty()) {
+        (*it)->eraseFromParent();
+      }
+    }
+    entryCond = cond;
+    return cond;
+  }
+
+  /*
+   * Move `guard` to the preheader of the outermost loop it can be hoisted out
+   * of, and return the new guard.
+   *
+   * A guard is hoisted out of a loop if its condition is stable at the end
+   * of the preheader, and if it is executed on each iteration (if it
+   * dominates the latches of the loop). It must also be executed on the
+   * first iteration, before the loop exits: otherwise, the hoisted guard
+   * could fail even if the loop doesn't run the original guard. If the
+   * guard dominates each exiting block, except the header, it is checked
+   * only if the loop is entered (see `getEntryCondition`), and it isn't
+   * hoisted further.
+   */
+  static CallInst *hoistGuard(CallInst *guard, DominatorTree &DT,
+                              LoopInfo &LI,
+                              DenseMap<Loop *, Value *> &entryConds) {
+    Value *cond = guard->getArgOperand(0);
+    BasicBlock *bb = guard->getParent();
+    Instruction *target = nullptr;
+    Value *entryCond = nullptr;
+    for (Loop *loop = LI.getLoopFor(bb); loop; loop = LI.getLoopFor(bb)) {
+      BasicBlock *preheader = loop->getLoopPreheader();
+      if (!preheader || !isStable(cond, preheader->getTerminator(), DT)) {
+        break;
+      }
+      SmallVector<BasicBlock *, 4> latches;
+      loop->getLoopLatches(latches);
+      bool runsEachIteration = true;
+      for (auto latch : latches) {
+        runsEachIteration &= DT.dominates(bb, latch);
+      }
+      SmallVector<BasicBlock *, 4> exitingBlocks;
+      loop->getExitingBlocks(exitingBlocks);
+      bool headerExits = false;
+      for (auto exiting : exitingBlocks) {
+        if (DT.dominates(bb, exiting)) {
+          continue;
+        }
+        if (exiting == loop->getHeader()) {
+          headerExits = true;
+        } else {
+          runsEachIteration = false;
+        }
+      }
+      if (!runsEachIteration) {
+        break;
+      }
+      if (headerExits) {
+        entryCond = getEntryCondition(loop, entryConds);
+        if (entryCond) {
+          target = preheader->getTerminator();
+        }
+        break;
+      }
+      bb = preheader;
+      target = preheader->getTerminator();
+    }
+    if (!target) {
+      return guard;
+    }
+    Value *hoistedCond = materialize(cond, target, DT);
+    if (entryCond) {
+      IRBuilder<> builder(target);
+      hoistedCond = builder.CreateSelect(
+          entryCond, hoistedCond, ConstantInt::get(hoistedCond->getType(), 1));
+    }
+    CallInst *hoisted = CallInst::Create(guard->getCalledFunction(),
+                                         { hoistedCond }, "", target);
+    eraseGuard(guard);
+    return hoisted;
+  }
+
+  /*
+   * Return the condition checked by `guard`, and store in `entryCond` the
+   * condition under which it is checked, if it was hoisted out of a loop
+   * which may not be entered (see `hoistGuard`), or null otherwise.
+   */
+  static Value *getCheckedCondition(CallInst *guard, Value *&entryCond) {
+    Value *cond = guard->getArgOperand(0);
+    auto select = dyn_cast<SelectInst>(cond);
+    auto otherwise = select ? dyn_cast<ConstantInt>(select->getFalseValue())
+                            : nullptr;
+    if (otherwise && otherwise->isOne()) {
+      entryCond = select->getCondition();
+      return select->getTrueValue();
+    }
+    entryCond = nullptr;
+    return cond;
+  }
+
+  /*
+   * Remove `guard` if it checks the same condition as `dom`, which dominates
+   * it.
+   */
+  static bool removeDuplicate(CallInst *dom, CallInst *guard,
+                              DominatorTree &DT) {
+    Value *domEntryCond, *entryCond;
+    Value *domCond = getCheckedCondition(dom, domEntryCond);
+    Value *cond = getCheckedCondition(guard, entryCond);
+    if (domEntryCond && domEntryCond != entryCond) {
+      return false;
+    }
+    if (domCond != cond &&
+        !(isStable(domCond, dom, DT) && isStable(cond, guard, DT) &&
+          isSameValue(domCond, cond))) {
+      return false;
+    }
+    eraseGuard(guard);
+    return true;
+  }
+
+  /*
+   * If `cond` is a range check (a comparison of a value against a constant,
+   * which clang extends to the `int` argument of `__speculate`), return the
+   * comparison.
+   */
+  static ICmpInst *getRangeCheck(Value *cond) {
+    if (isa<ZExtInst>(cond)) {
+      cond = cast<ZExtInst>(cond)->getOperand(0);
+    }
+    auto cmp = dyn_cast<ICmpInst>(cond);
+    if (!cmp || cmp->isEquality() || !isa<ConstantInt>(cmp->getOperand(1))) {
+      return nullptr;
+    }
+    return cmp;
+  }
+
+  /*
+   * Return true if the range check `a` implies the range check `b`. Both
+   * must compare the same value, using the same predicate.
+   */
+  static bool impliesRangeCheck(ICmpInst *a, ICmpInst *b) {
+    const APInt &limitA = cast<ConstantInt>(a->getOperand(1))->getValue();
+    const APInt &limitB = cast<ConstantInt>(b->getOperand(1))->getValue();
+    switch (a->getPredicate()) {
+      case CmpInst::ICMP_ULT:
+      case CmpInst::ICMP_ULE:
+        return limitA.ule(limitB);
+      case CmpInst::ICMP_SLT:
+      case CmpInst::ICMP_SLE:
+        return limitA.sle(limitB);
+      case CmpInst::ICMP_UGT:
+      case CmpInst::ICMP_UGE:
+        return limitA.uge(limitB);
+      default:
+        return limitA.sge(limitB);
+    }
+  }
+
+  /*
+   * Merge `guard` into `dom`, which dominates it, if `guard` is always
+   * executed after `dom`, and if its condition can be checked at `dom`.
+   * Merging a guard which isn't always executed would deoptimize the code
+   * even if that guard isn't reached.
+   */
+  static bool widenGuard(CallInst *dom, CallInst *guard, DominatorTree &DT,
+                         PostDominatorTree &PDT) {
+    bool alwaysExecuted = dom->getParent() == guard->getParent() ||
+      PDT.dominates(guard->getParent(), dom->getParent());
+    Value *domEntryCond, *entryCond;
+    Value *domCond = getCheckedCondition(dom, domEntryCond);
+    Value *cond = getCheckedCondition(guard, entryCond);
+    if (!alwaysExecuted || domEntryCond != entryCond ||
+        !isStable(cond, dom, DT)) {
+      return false;
+    }
+    ICmpInst *domCheck = getRangeCheck(domCond);
+    ICmpInst *check = getRangeCheck(cond);
+    Value *widened = nullptr;
+    if (domCheck && check &&
+        domCheck->getPredicate() == check->getPredicate() &&
+        isStable(domCheck->getOperand(0), dom, DT) &&
+        isSameValue(domCheck->getOperand(0), check->getOperand(0))) {
+      // Keep the stronger of the two range checks.
+      if (!impliesRangeCheck(domCheck, check)) {
+        widened = materialize(cond, dom, DT);
+      }
+    } else {
+      IRBuilder<> builder(dom);
+      Value *zero = Constant::getNullValue(domCond->getType());
+      Value *both = builder.CreateAnd(
+          builder.CreateICmpNE(domCond, zero),
+          builder.CreateICmpNE(materialize(cond, dom, DT),
+                               Constant::getNullValue(cond->getType())));
+      widened = builder.CreateZExt(both, domCond->getType());
+    }
+    if (widened) {
+      Value *oldCond = dom->getArgOperand(0);
+      if (entryCond) {
+        IRBuilder<> builder(dom);
+        widened = builder.CreateSelect(
+            entryCond, widened, ConstantInt::get(widened->getType(), 1));
+      }
+      dom->setArgOperand(0, widened);
+      RecursivelyDeleteTriviallyDeadInstructions(oldCond);
+    }
+    eraseGuard(guard);
+    return true;
+  }
+};
+
+} // end anonymous namespace
+
+char GuardOptPass::id = 0;
+unsigned GuardOptPass::numHoisted = 0;
+unsigned GuardOptPass::numRemoved = 0;
+unsigned GuardOptPass::numWidened = 0;
+
+static void registerPass(const PassManagerBuilder &,
+                         legacy::PassManagerBase &PM) {
+  PM.add(new GuardOptPass());
+}
+static RegisterStandardPasses RegisterPass(
+    PassManagerBuilder::EP_EarlyAsPossible, registerPass);
@@ -8,27 +8,394 @@
 #include <llvm/IR/Module.h>
 #include <llvm/IR/DataLayout.h>
 #include <llvm/IR/Instruction.h>
+#include <llvm/IR/IntrinsicInst.h>
 #include <llvm/IR/LegacyPassManager.h>
 #include <llvm/IR/Constants.h>
 #include <llvm/IR/Type.h>
 #include <llvm/IR/Value.h>
+#include <llvm/IR/Operator.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Transforms/IPO/PassManagerBuilder.h>
+#include <llvm/IR/CFG.h>
 #include <llvm/IR/Dominators.h>
+#include <llvm/ADT/BitVector.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/PostOrderIterator.h>
 #include <llvm/Transforms/Utils/BasicBlockUtils.h>
+#include <llvm/Transforms/Utils/Local.h>
+#include <llvm/Transforms/Utils/ModuleUtils.h>
 #include "Utils.h"
 
-#define UNOPT_PREFIX "__unopt_"
+#define LOCATION_SIZES_SECTION ".llvm_stackmap_sizes"
+#define LOCATION_SIZES_GLOBAL "__stackmap_location_sizes"
 
 using namespace llvm;
 using std::vector;
 
 namespace {
 
+// The operations of the rematerialization recipes (see `remat_op` in the
+// runtime).
+enum RematOp {
+  REMAT_ADD = 0x1,
+  REMAT_SUB = 0x2,
+  REMAT_MUL = 0x3,
+  REMAT_AND = 0x4,
+  REMAT_OR  = 0x5,
+  REMAT_XOR = 0x6,
+  REMAT_SHL = 0x7
+};
+
+/*
+ * A recipe which recomputes the value of the location at index `location` of a
+ * record from the location at index `base`: value = base <op> constant.
+ */
+struct RematRecipe {
+  int64_t constant;
+  uint32_t location;
+  uint16_t base;
+  uint16_t op;
+};
+
+/*
+ * The values which are live after each instruction of a function.
+ *
+ * Liveness is computed once per function, using a backward dataflow analysis
+ * over its basic blocks. Only instructions which have uses are tracked (the
+ * arguments of the function are never recorded).
+ *
+ * The contents of an `alloca` which does not escape (whose address is only
+ * used to load from it and to store to it, possibly through a chain of GEPs
+ * and bitcasts) are live if they can be loaded before they are overwritten by
+ * a store to the whole `alloca`. An `alloca` which escapes is live at each
+ * instruction it dominates, since its contents can be read through a pointer
+ * at any time.
+ */
+class Liveness {
+public:
+  Liveness(Function &fun)
+      : dataLayout(fun.getParent()->getDataLayout()), DT(fun) {
+    unsigned pos = 0;
+    for (auto &bb : fun) {
+      for (auto &inst : bb) {
+        position[&inst] = pos++;
+        if (inst.use_empty()) {
+          continue;
+        }
+        index[&inst] = values.size();
+        values.push_back(&inst);
+        if (isa<AllocaInst>(inst)) {
+          if (escapes(&inst)) {
+            escaping.push_back(cast<AllocaInst>(&inst));
+          } else {
+            nonEscaping.insert(cast<AllocaInst>(&inst));
+          }
+        }
+      }
+    }
+    computeBlockLiveness(fun);
+  }
+
+  /*
+   * Return the instructions tracked by the analysis, in the order in which
+   * they appear in the function.
+   */
+  const vector<Instruction *>& getValues() const {
+    return values;
+  }
+
+  /*
+   * Return the index of `value` in `getValues()`, or -1 if it is not tracked.
+   */
+  int getIndex(Value *value) const {
+    auto pos = isa<Instruction>(value) ?
+      index.find(cast<Instruction>(value)) : index.end();
+    return pos == index.end() ? -1 : pos->second;
+  }
+
+  /*
+   * Return the values live immediately after each of the specified
+   * instructions. The result of an instruction is not live after it.
+   */
+  DenseMap<Instruction *, BitVector>
+  getLiveAfter(const vector<Instruction *> &points) const {
+    SmallPtrSet<Instruction *, 16> pointSet(points.begin(), points.end());
+    SmallPtrSet<BasicBlock *, 16> blocks;
+    for (auto point : points) {
+      blocks.insert(point->getParent());
+    }
+    DenseMap<Instruction *, BitVector> liveAfter;
+    for (auto bb : blocks) {
+      // Walk the block backwards, starting from the values live on exit.
+      BitVector live = getLiveOut(bb);
+      for (auto it = bb->rbegin(); it != bb->rend(); ++it) {
+        if (pointSet.count(&*it)) {
+          BitVector &pointLive = liveAfter[&*it] = live;
+          int idx = getIndex(&*it);
+          if (idx >= 0) {
+            pointLive.reset(idx);
+          }
+          for (auto alloca : escaping) {
+            if (dominates(alloca, &*it)) {
+              pointLive.set(getIndex(alloca));
+            }
+          }
+        }
+        transfer(*it, live);
+      }
+    }
+    return liveAfter;
+  }
+
+private:
+  const DataLayout &dataLayout;
+  DominatorTree DT;
+  vector<Instruction *> values;
+  DenseMap<Instruction *, unsigned> index;
+  // The position of each instruction in the function.
+  DenseMap<Instruction *, unsigned> position;
+  // The `alloca`s whose contents are tracked through loads and stores.
+  SmallPtrSet<AllocaInst *, 16> nonEscaping;
+  vector<AllocaInst *> escaping;
+  DenseMap<BasicBlock *, BitVector> liveIn;
+  DenseMap<BasicBlock *, BitVector> liveOut;
+
+  BitVector getLiveOut(BasicBlock *bb) const {
+    auto pos = liveOut.find(bb);
+    return pos == liveOut.end() ? BitVector(values.size()) : pos->second;
+  }
+
+  /*
+   * Return true if `inst` is an `llvm.assume`, a lifetime marker or a debug
+   * intrinsic. These don't read or write memory at run time: they don't make
+   * the values they use live, or an `alloca` whose address they use escape.
+   */
+  static bool isMarker(const Instruction *inst) {
+    auto intrinsic = dyn_cast<IntrinsicInst>(inst);
+    if (!intrinsic) {
+      return false;
+    }
+    switch (intrinsic->getIntrinsicID()) {
+    case Intrinsic::assume:
+    case Intrinsic::lifetime_start:
+    case Intrinsic::lifetime_end:
+      return true;
+    default:
+      return isa<DbgInfoIntrinsic>(intrinsic);
+    }
+  }
+
+  /*
+   * Return true if the address of `alloca` is used by anything other than
+   * loads, stores to it, the GEPs and bitcasts which derive pointers from it,
+   * and markers (see `isMarker`). clang marks the lifetime of each local
+   * variable with intrinsics which take its address as an `i8 *`.
+   */
+  static bool escapes(Instruction *alloca) {
+    vector<Instruction *> worklist { alloca };
+    while (!worklist.empty()) {
+      Instruction *ptr = worklist.back();
+      worklist.pop_back();
+      for (auto user : ptr->users()) {
+        if (isa<LoadInst>(user)) {
+          continue;
+        }
+        if (isa<StoreInst>(user) &&
+            cast<StoreInst>(user)->getPointerOperand() == ptr) {
+          continue;
+        }
+        if (isa<GetElementPtrInst>(user) || isa<BitCastInst>(user)) {
+          worklist.push_back(cast<Instruction>(user));
+          continue;
+        }
+        if (isMarker(cast<Instruction>(user))) {
+          continue;
+        }
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /*
+   * Return the non-escaping `alloca` `ptr` points into, or nullptr.
+   */
+  AllocaInst* getTrackedAlloca(Value *ptr) const {
+    while (isa<GetElementPtrInst>(ptr) || isa<BitCastInst>(ptr)) {
+      ptr = cast<Instruction>(ptr)->getOperand(0);
+    }
+    if (isa<AllocaInst>(ptr) && nonEscaping.count(cast<AllocaInst>(ptr))) {
+      return cast<AllocaInst>(ptr);
+    }
+    return nullptr;
+  }
+
+  /*
+   * Return true if `inst` comes after `alloca` on every path from the entry
+   * of the function.
+   */
+  bool dominates(AllocaInst *alloca, Instruction *inst) const {
+    if (alloca->getParent() == inst->getParent()) {
+      return position.lookup(alloca) < position.lookup(inst);
+    }
+    return DT.dominates(alloca->getParent(), inst->getParent());
+  }
+
+  /*
+   * Return the index of the value which is dead before `inst`: the result of
+   * `inst`, the `alloca` which `inst` overwrites entirely, or the `alloca`
+   * whose lifetime `inst` starts or ends (its contents are undefined outside
+   * its lifetime). Return -1 if there is no such value.
+   */
+  int getKilled(Instruction &inst) const {
+    auto intrinsic = dyn_cast<IntrinsicInst>(&inst);
+    if (intrinsic &&
+        (intrinsic->getIntrinsicID() == Intrinsic::lifetime_start ||
+         intrinsic->getIntrinsicID() == Intrinsic::lifetime_end)) {
+      AllocaInst *alloca = getTrackedAlloca(intrinsic->getArgOperand(1));
+      auto size = cast<ConstantInt>(intrinsic->getArgOperand(0));
+      if (alloca && !alloca->isArrayAllocation() &&
+          (size->isMinusOne() ||
+           size->getZExtValue() >= dataLayout.getTypeAllocSize(
+                                       alloca->getAllocatedType()))) {
+        return getIndex(alloca);
+      }
+      return -1;
+    }
+    if (isa<StoreInst>(inst)) {
+      StoreInst &store = cast<StoreInst>(inst);
+      Value *ptr = store.getPointerOperand();
+      if (isa<AllocaInst>(ptr) && nonEscaping.count(cast<AllocaInst>(ptr))) {
+        AllocaInst *alloca = cast<AllocaInst>(ptr);
+        uint64_t storeSize = dataLayout.getTypeStoreSize(
+            store.getValueOperand()->getType());
+        if (!alloca->isArrayAllocation() &&
+            storeSize >= dataLayout.getTypeAllocSize(
+                alloca->getAllocatedType())) {
+          return getIndex(alloca);
+        }
+      }
+      return -1;
+    }
+    return getIndex(&inst);
+  }
+
+  /*
+   * Update `live` (the values live after `inst`) to contain the values live
+   * before `inst`. The operands of PHI nodes are live at the end of the
+   * corresponding predecessors instead.
+   */
+  void transfer(Instruction &inst, BitVector &live) const {
+    int idx = getKilled(inst);
+    if (idx >= 0) {
+      live.reset(idx);
+    }
+    if (isa<PHINode>(inst)) {
+      return;
+    }
+    // The markers are removed before code generation, so the values they
+    // use (e.g. the conditions of the invalidatable guards, see
+    // `CheckPointPass`, and the `i8 *` addresses of the variables) aren't
+    // live because of them.
+    if (isMarker(&inst)) {
+      return;
+    }
+    if (isa<LoadInst>(inst)) {
+      // Loading from a non-escaping `alloca` reads its contents.
+      auto alloca = getTrackedAlloca(cast<LoadInst>(inst).getPointerOperand());
+      if (alloca) {
+        live.set(getIndex(alloca));
+      }
+    }
+    for (auto &op : inst.operands()) {
+      // The contents of a non-escaping `alloca` are only used by loads.
+      if (isa<AllocaInst>(op.get()) &&
+          nonEscaping.count(cast<AllocaInst>(op.get()))) {
+        continue;
+      }
+      int opIdx = getIndex(op.get());
+      if (opIdx >= 0) {
+        live.set(opIdx);
+      }
+    }
+  }
+
+  /*
+   * Compute the values live on entry to, and on exit from, each basic block
+   * reachable from the entry block, iterating until a fixed point is reached.
+   */
+  void computeBlockLiveness(Function &fun) {
+    // gen: the values used in the block before they are defined.
+    // kill: the values defined (or overwritten) in the block.
+    DenseMap<BasicBlock *, BitVector> gen, kill;
+    vector<BasicBlock *> blocks;
+    for (auto bb : post_order(&fun.getEntryBlock())) {
+      blocks.push_back(bb);
+      BitVector blockGen(values.size()), blockKill(values.size());
+      for (auto it = bb->rbegin(); it != bb->rend(); ++it) {
+        transfer(*it, blockGen);
+        int idx = getKilled(*it);
+        if (idx >= 0) {
+          blockKill.set(idx);
+        }
+      }
+      gen[bb] = blockGen;
+      kill[bb] = blockKill;
+      liveIn[bb] = blockGen;
+      liveOut[bb] = BitVector(values.size());
+    }
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      // Visiting the blocks in post-order propagates liveness backwards
+      // quickly.
+      for (auto bb : blocks) {
+        BitVector out(values.size());
+        for (auto succ : successors(bb)) {
+          out |= liveIn[succ];
+          for (auto &inst : *succ) {
+            if (!isa<PHINode>(inst)) {
+              break;
+            }
+            int idx = getIndex(
+                cast<PHINode>(inst).getIncomingValueForBlock(bb));
+            if (idx >= 0) {
+              out.set(idx);
+            }
+          }
+        }
+        if (out == liveOut[bb]) {
+          continue;
+        }
+        changed = true;
+        BitVector in = out;
+        in.reset(kill[bb]);
+        in |= gen[bb];
+        liveOut[bb] = out;
+        liveIn[bb] = in;
+      }
+    }
+  }
+};
+
+// A value which may be recorded, and the number of bytes it occupies.
+typedef std::pair<Value *, uint32_t> RecordedValue;
+
 /*
  * Searches for each call to `llvm.experimental.stackmap` or
  * `llvm.experimental.patchpoint` and passes the variables which are live at
  * the callsite as arguments to the call.
+ *
+ * The runtime needs to know how many bytes to copy for each recorded location.
+ * The sizes are not part of the stack map: they are emitted into the
+ * `.llvm_stackmap_sizes` section, in an entry keyed by the ID of the call.
+ *
+ * In optimized functions, the live values which are cheap to recompute from
+ * another recorded value (constant-offset GEPs and bitcasts, and arithmetic
+ * with a constant operand) are not kept live across the call. A null constant
+ * is recorded in their place, and the entry of the call in the side table
+ * contains a recipe the runtime uses to rematerialize them.
  */
 struct LiveVariablesPass: public FunctionPass {
   static char id;
@@ -39,95 +406,334 @@ struct LiveVariablesPass: public FunctionPass {
     Module *mod = fun.getParent();
     StringRef funName = fun.getName();
     outs() << "Running LiveVariablesPass on function: " << funName << '\n';
+    // The stackmap/patchpoint calls, and the instructions the variables must
+    // be live across.
+    vector<CallInst *> recordCalls;
+    vector<Instruction *> livePoints;
     for (auto &bb : fun) {
-      for (BasicBlock::iterator it = bb.begin(); it != bb.end(); ++it) {
-        if (isa<CallInst>(it)) {
-          CallInst &callInst = cast<CallInst>(*it);
-          Function *calledFun = callInst.getCalledFunction();
-          if (callInst.isInlineAsm()) {
-            continue;
-          }
-          auto type = getPatchpointType(calledFun);
-          if (type.producesStackmapRecords()) {
-            // This is a stackmap/patchpoint call, so it needs to record all
-            // the variables live at this point.
-            vector<Value *> liveVariables;
-            auto prevInst = it->getPrevNode();
-            if (type.type == PatchpointType::STACKMAP && prevInst) {
-              liveVariables = getLiveRegisters(*prevInst);
-            } else {
-              liveVariables = getLiveRegisters(*it);
-            }
-            vector<Value *> args(callInst.arg_begin(), callInst.arg_end());
-            // Pass the live locations to the stackmap/patchpoint call. This
-            // also inserts the size of each 'live' location into the stackmap.
-            std::move(liveVariables.begin(), liveVariables.end(),
-                      std::back_inserter(args));
-            CallInst *newCall = CallInst::Create(calledFun, args);
-            if (!callInst.use_empty()) {
-              callInst.replaceAllUsesWith(newCall);
-            }
-            ReplaceInstWithInst(callInst.getParent()->getInstList(),
-                                it, newCall);
+      for (auto &inst : bb) {
+        if (!isa<CallInst>(inst) || cast<CallInst>(inst).isInlineAsm()) {
+          continue;
+        }
+        CallInst &callInst = cast<CallInst>(inst);
+        Function *calledFun = callInst.getCalledFunction();
+        if (!calledFun) {
+          continue;
+        }
+        auto type = getPatchpointType(calledFun);
+        if (type.producesStackmapRecords()) {
+          // This is a stackmap/patchpoint call, so it needs to record all
+          // the variables live at this point.
+          auto prevInst = inst.getPrevNode();
+          recordCalls.push_back(&callInst);
+          if (type.type == PatchpointType::STACKMAP && prevInst) {
+            livePoints.push_back(prevInst);
+          } else {
+            livePoints.push_back(&inst);
           }
         }
       }
     }
+    if (recordCalls.empty()) {
+      return false;
+    }
+    // Compute all the live sets before the calls are replaced.
+    Liveness liveness(fun);
+    auto liveAfter = liveness.getLiveAfter(livePoints);
+    DataLayout dataLayout(mod);
+    // The calls replaced so far (a replaced call might be live across one of
+    // the following calls).
+    DenseMap<Value *, Value *> replaced;
+    vector<GlobalValue *> sizeTables;
+    vector<vector<Value *>> allLiveValues(recordCalls.size());
+    vector<vector<uint32_t>> allSizes(recordCalls.size());
+    vector<RecordedValue> tracked, constantReturns;
+    getRecordedValues(fun, liveness, dataLayout, tracked, constantReturns);
+    for (size_t i = 0; i < recordCalls.size(); ++i) {
+      allLiveValues[i] = getLiveRegisters(tracked, constantReturns,
+                                          liveAfter[livePoints[i]],
+                                          allSizes[i]);
+    }
+    if (funName.startswith(UNOPT_PREFIX) &&
+        !fun.hasFnAttribute(Attribute::OptimizeNone)) {
+      demoteLiveValues(fun, allLiveValues);
+    }
+    for (size_t i = 0; i < recordCalls.size(); ++i) {
+      CallInst *callInst = recordCalls[i];
+      vector<Value *> args(callInst->arg_begin(), callInst->arg_end());
+      const vector<uint32_t> &sizes = allSizes[i];
+      const vector<Value *> &liveValues = allLiveValues[i];
+      vector<RematRecipe> recipes;
+      if (!funName.startswith(UNOPT_PREFIX)) {
+        recipes = getRematRecipes(liveValues, dataLayout);
+      }
+      // Pass the live locations to the stackmap/patchpoint call.
+      auto recipe = recipes.begin();
+      for (size_t j = 0; j < liveValues.size(); ++j) {
+        Value *value = liveValues[j];
+        if (recipe != recipes.end() && recipe->location == j) {
+          // The runtime recomputes this value.
+          args.push_back(Constant::getNullValue(value->getType()));
+          ++recipe;
+          continue;
+        }
+        auto pos = replaced.find(value);
+        args.push_back(pos == replaced.end() ? value : pos->second);
+      }
+      uint64_t id = cast<ConstantInt>(callInst->getArgOperand(0))
+        ->getZExtValue();
+      sizeTables.push_back(emitLocationSizes(*mod, id,
+                                             getRecordKind(callInst), sizes,
+                                             recipes));
+      CallInst *newCall = CallInst::Create(callInst->getCalledFunction(),
+                                           args);
+      // Guards are lowered to `anyregcc` patchpoints (see `CheckPointPass`).
+      newCall->setCallingConv(callInst->getCallingConv());
+      if (!callInst->use_empty()) {
+        callInst->replaceAllUsesWith(newCall);
+      }
+      replaced[callInst] = newCall;
+      ReplaceInstWithInst(callInst, newCall);
+    }
+    // The tables are not referenced by the code, so they must be kept alive
+    // explicitly.
+    appendToCompilerUsed(*mod, sizeTables);
     return true;
   }
 
   /*
-   * Return the list of registers which are live across the given instruction.
+   * Move the values recorded by the `stackmap`/`patchpoint` calls of the
+   * baseline version of a function (see `UnoptimizedCopyPass`) to the stack,
+   * and record their stack slots instead.
+   *
+   * The runtime can only restore the values of the frames it creates if they
+   * are stored in memory (`optnone` functions keep every variable in an
+   * `alloca`). A value and its stack slot have the same size, so the value
+   * recorded in the optimized function is copied into the stack slot.
    */
-  static vector<Value *> getLiveRegisters(Instruction &instr) {
-    vector<Value *> args;
-    Function *fun = instr.getFunction();
-    Module *mod = fun->getParent();
-    DataLayout dataLayout(mod);
-    DominatorTree DT(*fun);
-    // Iterarate over each instruction in the function.
-    for (auto &bb : *fun) {
-      IRBuilder<> builder(bb.getContext());
-      for (BasicBlock::iterator it = bb.begin(); it != bb.end(); ++it) {
-        if (!it->use_empty() && DT.dominates(&*it, &instr)) {
-          for (Value::user_iterator user = (*it).user_begin();
-               user != (*it).user_end(); ++user) {
-            // This instruction is defined 'above' `instr` and used 'below'
-            // `instr`, so it is live across `instr`.
-            if (isa<Instruction>(*user)) {
-              auto userInst = cast<Instruction>(*user);
-              if (!DT.dominates(userInst, &instr)) {
-                args.push_back(&*it);
-                Type *t = nullptr;
-                // The runtime may need to copy an arbitrary number of bytes
-                // starting from this location. We can store the size of the
-                // object being allocated in the stack map.
-                if (isa<AllocaInst>(it)) {
-                  t = cast<AllocaInst>(*it).getAllocatedType();
-                } else {
-                  t = it->getType();
-                }
-                Value *instSize =
-                  builder.getInt64(dataLayout.getTypeAllocSize(t));
-                // Also insert the size of the recorded location to know how
-                // many bytes to copy at runtime.
-                args.push_back(instSize);
-                break;
-              }
-            }
-          }
-        } else if (isa<ReturnInst>(it) && it->getNumOperands() > 0) {
-          ReturnInst &retInst = cast<ReturnInst>(*it);
-          auto retValue = retInst.getReturnValue();
-          if (isa<Constant>(retValue)) {
-            args.push_back(retValue);
-            auto instSize = builder.getInt64(
-                dataLayout.getTypeAllocSize(retValue->getType()));
-            args.push_back(instSize);
-          }
+  static void demoteLiveValues(Function &fun,
+                               vector<vector<Value *>> &allLiveValues) {
+    // The values are demoted in the order in which they are first recorded,
+    // so the layout of the frame doesn't depend on the addresses of the
+    // values.
+    DenseMap<Value *, AllocaInst *> demoted;
+    vector<Instruction *> toDemote;
+    for (auto &liveValues : allLiveValues) {
+      for (auto value : liveValues) {
+        if (isa<Instruction>(value) && !isa<AllocaInst>(value) &&
+            demoted.insert({ value, nullptr }).second) {
+          toDemote.push_back(cast<Instruction>(value));
+        }
+      }
+    }
+    Instruction *allocaPoint = &*fun.getEntryBlock().getFirstInsertionPt();
+    for (auto inst : toDemote) {
+      if (isa<PHINode>(inst)) {
+        demoted[inst] = DemotePHIToStack(cast<PHINode>(inst), allocaPoint);
+      } else {
+        demoted[inst] = DemoteRegToStack(*inst, false, allocaPoint);
+      }
+    }
+    for (auto &liveValues : allLiveValues) {
+      for (auto &value : liveValues) {
+        auto pos = demoted.find(value);
+        if (pos != demoted.end()) {
+          value = pos->second;
         }
       }
     }
+  }
+
+  /*
+   * If `value` can be computed from a single other value using one of the
+   * operations in `RematOp` and a constant, return that value, and set `op`
+   * and `constant`. Otherwise, return nullptr.
+   */
+  static Value* getRematBase(Value *value, const DataLayout &dataLayout,
+                             RematOp &op, int64_t &constant) {
+    Type *type = value->getType();
+    if (!type->isPointerTy() &&
+        !(type->isIntegerTy() && type->getIntegerBitWidth() <= 64)) {
+      return nullptr;
+    }
+    if (isa<BitCastInst>(value)) {
+      op = REMAT_ADD;
+      constant = 0;
+      return cast<BitCastInst>(value)->getOperand(0);
+    }
+    if (isa<GetElementPtrInst>(value)) {
+      auto gep = cast<GEPOperator>(value);
+      APInt offset(dataLayout.getPointerSizeInBits(
+                       gep->getPointerAddressSpace()), 0);
+      if (!gep->accumulateConstantOffset(dataLayout, offset)) {
+        return nullptr;
+      }
+      op = REMAT_ADD;
+      constant = offset.getSExtValue();
+      return gep->getPointerOperand();
+    }
+    if (!isa<BinaryOperator>(value)) {
+      return nullptr;
+    }
+    auto binOp = cast<BinaryOperator>(value);
+    Value *lhs = binOp->getOperand(0);
+    Value *rhs = binOp->getOperand(1);
+    if (binOp->isCommutative() && isa<ConstantInt>(lhs)) {
+      std::swap(lhs, rhs);
+    }
+    if (!isa<ConstantInt>(rhs)) {
+      return nullptr;
+    }
+    switch (binOp->getOpcode()) {
+      case Instruction::Add: op = REMAT_ADD; break;
+      case Instruction::Sub: op = REMAT_SUB; break;
+      case Instruction::Mul: op = REMAT_MUL; break;
+      case Instruction::And: op = REMAT_AND; break;
+      case Instruction::Or:  op = REMAT_OR;  break;
+      case Instruction::Xor: op = REMAT_XOR; break;
+      case Instruction::Shl: op = REMAT_SHL; break;
+      default: return nullptr;
+    }
+    constant = cast<ConstantInt>(rhs)->getSExtValue();
+    return lhs;
+  }
+
+  /*
+   * Return the recipes of the values in `liveValues` which can be recomputed
+   * from another value in `liveValues`, ordered by location.
+   *
+   * The base of a recipe is never rematerialized itself, so the runtime can
+   * evaluate the recipes in any order.
+   */
+  static vector<RematRecipe> getRematRecipes(const vector<Value *> &liveValues,
+                                             const DataLayout &dataLayout) {
+    DenseMap<Value *, unsigned> position;
+    for (size_t i = 0; i < liveValues.size(); ++i) {
+      position.insert({ liveValues[i], i });
+    }
+    vector<RematRecipe> candidates;
+    SmallPtrSet<Value *, 16> rematerialized;
+    for (size_t i = 0; i < liveValues.size(); ++i) {
+      RematOp op;
+      int64_t constant;
+      Value *base = getRematBase(liveValues[i], dataLayout, op, constant);
+      if (!base || !position.count(base) || position[base] > UINT16_MAX) {
+        continue;
+      }
+      candidates.push_back({ constant, (uint32_t)i,
+                             (uint16_t)position[base], (uint16_t)op });
+      rematerialized.insert(liveValues[i]);
+    }
+    vector<RematRecipe> recipes;
+    for (auto &recipe : candidates) {
+      if (!rematerialized.count(liveValues[recipe.base])) {
+        recipes.push_back(recipe);
+      }
+    }
+    return recipes;
+  }
+
+  /*
+   * Emit the entry of the location size table which describes the locations
+   * recorded by the stackmap/patchpoint call with the specified ID and kind:
+   *
+   *   { i64 id, i32 num_locations, i32 num_recipes, i32 kind,
+   *     [num_locations x i32] sizes,
+   *     [num_recipes x { i64 constant, i32 location, i16 base, i16 op }] }
+   */
+  static GlobalVariable* emitLocationSizes(
+      Module &mod, uint64_t id, RecordKind kind, const vector<uint32_t> &sizes,
+      const vector<RematRecipe> &recipes) {
+    LLVMContext &ctx = mod.getContext();
+    Type *i64 = Type::getInt64Ty(ctx);
+    Type *i32 = Type::getInt32Ty(ctx);
+    Type *i16 = Type::getInt16Ty(ctx);
+    Constant *sizeArray = ConstantDataArray::get(ctx, sizes);
+    StructType *recipeTy = StructType::get(ctx, { i64, i32, i16, i16 });
+    vector<Constant *> recipeConstants;
+    for (auto &recipe : recipes) {
+      recipeConstants.push_back(ConstantStruct::get(
+          recipeTy, { ConstantInt::get(i64, recipe.constant),
+                      ConstantInt::get(i32, recipe.location),
+                      ConstantInt::get(i16, recipe.base),
+                      ConstantInt::get(i16, recipe.op) }));
+    }
+    Constant *recipeArray = ConstantArray::get(
+        ArrayType::get(recipeTy, recipes.size()), recipeConstants);
+    StructType *entryTy = StructType::get(ctx, { i64, i32, i32, i32,
+                                                 sizeArray->getType(),
+                                                 recipeArray->getType() });
+    Constant *entry = ConstantStruct::get(
+        entryTy, { ConstantInt::get(i64, id),
+                   ConstantInt::get(i32, sizes.size()),
+                   ConstantInt::get(i32, recipes.size()),
+                   ConstantInt::get(i32, kind),
+                   sizeArray,
+                   recipeArray });
+    auto table = new GlobalVariable(mod, entryTy, true /* isConstant */,
+                                    GlobalValue::PrivateLinkage, entry,
+                                    LOCATION_SIZES_GLOBAL);
+    table->setSection(LOCATION_SIZES_SECTION);
+    table->setAlignment(8);
+    return table;
+  }
+
+  /*
+   * Find the values which may be recorded in `fun`, and the size of each of
+   * them: the values tracked by `liveness`, stored in `tracked` at their
+   * index in `liveness.getValues()`, and the constants returned by `fun`,
+   * which are recorded by each call.
+   */
+  static void getRecordedValues(Function &fun, const Liveness &liveness,
+                                const DataLayout &dataLayout,
+                                vector<RecordedValue> &tracked,
+                                vector<RecordedValue> &constantReturns) {
+    for (auto inst : liveness.getValues()) {
+      // The runtime may need to copy an arbitrary number of bytes starting
+      // from this location. We can store the size of the object being
+      // allocated in the stack map.
+      Type *t = isa<AllocaInst>(inst) ?
+        cast<AllocaInst>(inst)->getAllocatedType() : inst->getType();
+      tracked.push_back({ inst, (uint32_t)dataLayout.getTypeAllocSize(t) });
+    }
+    for (auto &bb : fun) {
+      auto ret = dyn_cast<ReturnInst>(bb.getTerminator());
+      if (ret && ret->getReturnValue() &&
+          isa<Constant>(ret->getReturnValue())) {
+        Value *retValue = ret->getReturnValue();
+        constantReturns.push_back(
+          { retValue,
+            (uint32_t)dataLayout.getTypeAllocSize(retValue->getType()) });
+      }
+    }
+  }
+
+  /*
+   * Return the list of registers which are live across an instruction, given
+   * the set of values `live` after it, and the values `tracked` and
+   * `constantReturns` found by `getRecordedValues`. The size of each of them
+   * is appended to `sizes`.
+   *
+   * The tracked values are listed in the order in which they are defined in
+   * the function, followed by the constant return values, so the same
+   * variables are recorded in the same order in a function and in its
+   * `__unopt_` twin.
+   */
+  static vector<Value *> getLiveRegisters(
+      const vector<RecordedValue> &tracked,
+      const vector<RecordedValue> &constantReturns, const BitVector &live,
+      vector<uint32_t> &sizes) {
+    vector<Value *> args;
+    for (unsigned idx : live.set_bits()) {
+      args.push_back(tracked[idx].first);
+      // Also record the size of the location to know how many bytes to
+      // copy at runtime.
+      sizes.push_back(tracked[idx].second);
+    }
+    for (auto &retValue : constantReturns) {
+      args.push_back(retValue.first);
+      sizes.push_back(retValue.second);
+    }
     return args;
   }
 
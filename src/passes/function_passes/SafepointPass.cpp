@@ -0,0 +1,119 @@
+#include <vector>
+#include <llvm/Pass.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/IPO/PassManagerBuilder.h>
+#include "Utils.h"
+
+using namespace llvm;
+using std::vector;
+
+namespace {
+
+/*
+ * Insert a safepoint poll at the entry of each function, and on each loop
+ * back-edge.
+ *
+ * A poll is a call to `__safepoint_poll_site`, which `CheckPointPass` lowers
+ * into a `patchpoint` call. In optimized functions, the `patchpoint` is only
+ * reached if a safepoint was requested (if `__safepoint_requested` is set).
+ * Its callback, `__safepoint_poll`, parks the thread until the safepoint ends,
+ * and then deoptimizes the call stack of the thread, if necessary. In
+ * unoptimized functions, the `patchpoint` has no callback. It only records the
+ * location execution is resumed at after the deoptimization.
+ *
+ * Functions which contain no loops, and which can't call themselves, don't
+ * need polls (see `needsSafepointPoll`).
+ *
+ * This pass must run before `CheckPointPass`. The polls are inserted
+ * in the same positions in each function and in its `__unopt_` twin.
+ */
+struct SafepointPass: public FunctionPass {
+  static char id;
+
+  SafepointPass() : FunctionPass(id) {}
+
+  virtual bool doInitialization(Module &mod) {
+    // `CheckPointPass` checks whether this function is declared to find out
+    // whether the safepoint polls are enabled.
+    mod.getOrInsertFunction(
+        SAFEPOINT_POLL_SITE,
+        FunctionType::get(Type::getVoidTy(mod.getContext()), false));
+    return true;
+  }
+
+  virtual bool runOnFunction(Function &fun) {
+    Module *mod = fun.getParent();
+    outs() << "Running SafepointPass on function: " << fun.getName() << '\n';
+    if (!needsSafepointPoll(fun)) {
+      return false;
+    }
+    Function *pollSite = mod->getFunction(SAFEPOINT_POLL_SITE);
+    vector<Instruction *> pollPoints { getEntryPollPoint(fun) };
+    DominatorTree DT(fun);
+    LoopInfo LI(DT);
+    for (auto loop : LI) {
+      collectBackEdgePollPoints(loop, pollPoints);
+    }
+    for (auto inst : pollPoints) {
+      CallInst::Create(pollSite, {}, "", inst);
+    }
+    return true;
+  }
+
+  /*
+   * Return the instruction before which the poll at the entry of the function
+   * must be inserted.
+   *
+   * The poll is inserted after the arguments of the function are stored in
+   * their `alloca`s. This ensures the arguments are recorded in the stack map
+   * if the function is deoptimized at its entry.
+   */
+  static Instruction* getEntryPollPoint(Function &fun) {
+    for (auto &inst : fun.getEntryBlock()) {
+      if (isa<AllocaInst>(inst)) {
+        continue;
+      }
+      if (isa<StoreInst>(inst) &&
+          isa<Argument>(cast<StoreInst>(inst).getValueOperand())) {
+        continue;
+      }
+      return &inst;
+    }
+    return fun.getEntryBlock().getTerminator();
+  }
+
+  /*
+   * Collect the terminators of the latches of `loop` and of its subloops.
+   */
+  static void collectBackEdgePollPoints(Loop *loop,
+                                        vector<Instruction *> &pollPoints) {
+    SmallVector<BasicBlock *, 4> latches;
+    loop->getLoopLatches(latches);
+    for (auto latch : latches) {
+      pollPoints.push_back(latch->getTerminator());
+    }
+    for (auto subLoop : loop->getSubLoops()) {
+      collectBackEdgePollPoints(subLoop, pollPoints);
+    }
+  }
+};
+
+} // end anonymous namespace
+
+char SafepointPass::id = 0;
+
+// Automatically enable the pass.
+// http://adriansampson.net/blog/clangpass.html
+static void registerPass(const PassManagerBuilder &,
+                         legacy::PassManagerBase &PM) {
+  PM.add(new SafepointPass());
+}
+static RegisterStandardPasses RegisterPass(
+    PassManagerBuilder::EP_EarlyAsPossible, registerPass);
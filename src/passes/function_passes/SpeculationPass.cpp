@@ -0,0 +1,406 @@
+#include <vector>
+#include <string>
+#include <map>
+#include <llvm/Pass.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/SCCIterator.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/IR/CFG.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Metadata.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/ErrorHandling.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Transforms/IPO/PassManagerBuilder.h>
+#include "Utils.h"
+
+#define PROFILE_ARG_FUN_NAME "__profile_arg"
+#define PROFILE_BRANCH_FUN_NAME "__profile_branch"
+// The metadata of the branches whose condition is guarded by a guard inserted
+// by `SpeculationPass`. Its operand is the value of the condition.
+#define SPECULATED_MD "speculated"
+
+using namespace llvm;
+using std::vector;
+
+// If set, the `__unopt_` functions record the values of their arguments and
+// the conditions of their branches, and the calls to the optimized functions
+// call the `__unopt_` functions instead. Only the functions which have a twin
+// are profiled (see `-clone-all-functions` in `UnoptimizedCopyPass`).
+static cl::opt<bool> ProfileValues(
+    "profile-values",
+    cl::desc("Record the value and branch profiles of the unoptimized "
+             "functions"),
+    cl::init(false));
+
+// The profile (written by a program compiled with `ProfileValues`) the guards
+// and the specialized versions are derived from.
+static cl::opt<std::string> SpeculationProfile(
+    "speculation-profile",
+    cl::desc("Speculate on the values and branches recorded in a profile"),
+    cl::init(""));
+
+// The minimum number of times an argument or a branch must have been recorded
+// for the pass to speculate on it.
+static cl::opt<unsigned> SpeculationMinCount(
+    "speculation-min-count",
+    cl::desc("The minimum number of samples to speculate on"),
+    cl::init(100));
+
+// The minimum percentage of the calls in which an argument must have had the
+// same value for the function to be specialized for that value.
+static cl::opt<unsigned> SpeculationMinRatio(
+    "speculation-min-ratio",
+    cl::desc("The percentage of the calls with the same argument needed to "
+             "specialize a function"),
+    cl::init(90));
+
+namespace {
+
+/*
+ * The profile of a function (see profile.h).
+ */
+struct FunctionProfile {
+  // The number of calls, the count of each value recorded in the profile,
+  // and the most frequent value and its count, of each argument.
+  struct ArgProfile {
+    uint64_t count;
+    std::map<int64_t, uint64_t> valueCounts;
+    int64_t value;
+    uint64_t valueCount;
+  };
+  DenseMap<unsigned, ArgProfile> args;
+  // The number of times the condition of each branch held, and didn't.
+  DenseMap<unsigned, std::pair<uint64_t, uint64_t>> branches;
+};
+
+/*
+ * Profile-guided speculation.
+ *
+ * With `ProfileValues`, the pass instruments the `__unopt_` functions: each
+ * of them records the value of its integer arguments at its entry (the first
+ * stackmap site of the function) and the condition of each of its
+ * conditional branches, by calling the profiling functions of the runtime
+ * (see profile.h). The calls to the optimized functions are redirected to
+ * their `__unopt_` twins, so the whole program (except for `main`) runs in
+ * the unoptimized tier, whose guards never fail. The profile is written when
+ * the program exits.
+ *
+ * With `SpeculationProfile`, the pass reads the profile, and speculates in
+ * the optimized functions:
+ *  - each branch whose condition had the same value each of the (at least
+ *    `SpeculationMinCount`) times it was recorded is preceded by a guard on
+ *    the condition. Once the twins are created and instrumented, the branch
+ *    is replaced with an unconditional branch in the optimized function, so
+ *    the optimizer removes the code which was never executed.
+ *  - a function which contains a loop, and which was called with the same
+ *    value of an integer argument in at least `SpeculationMinRatio` percent of
+ *    (at least `SpeculationMinCount`) calls, is specialized for that value:
+ *    `UnoptimizedCopyPass` creates the version (see `SPECIALIZE_ATTR`).
+ *
+ * The branches are numbered in the order they appear in each function before
+ * the other passes transform it, so this pass must be loaded before the other
+ * passes. Since the twins are created after the guards are inserted, the
+ * guards are also inserted in the twins, and the patchpoint IDs still match.
+ */
+struct SpeculationPass: public FunctionPass {
+  static char id;
+  // The number of guards inserted, and of the functions specialized.
+  static unsigned numGuards;
+  static unsigned numSpecialized;
+
+  SpeculationPass() : FunctionPass(id) {}
+
+  virtual bool doInitialization(Module &mod) {
+    LLVMContext &ctx = mod.getContext();
+    if (ProfileValues) {
+      // The profiling functions are defined by the runtime.
+      Type *i8ptr = Type::getInt8PtrTy(ctx);
+      Type *i32 = Type::getInt32Ty(ctx);
+      Function::Create(FunctionType::get(Type::getVoidTy(ctx),
+                                         { i8ptr, i32, Type::getInt64Ty(ctx) },
+                                         false),
+                       Function::ExternalLinkage, PROFILE_ARG_FUN_NAME, &mod);
+      Function::Create(FunctionType::get(Type::getVoidTy(ctx),
+                                         { i8ptr, i32, i32 }, false),
+                       Function::ExternalLinkage, PROFILE_BRANCH_FUN_NAME,
+                       &mod);
+    }
+    if (SpeculationProfile.empty()) {
+      return ProfileValues;
+    }
+    StringMap<FunctionProfile> profiles;
+    readProfile(profiles);
+    for (auto &fun : mod) {
+      if (fun.isDeclaration()) {
+        continue;
+      }
+      auto profile = profiles.find(fun.getName());
+      if (profile != profiles.end()) {
+        speculate(fun, profile->second);
+      }
+    }
+    outs() << "SpeculationPass: inserted " << numGuards << " guards, "
+           << "specialized " << numSpecialized << " functions\n";
+    return true;
+  }
+
+  /*
+   * Replace the speculated branches of the optimized functions with
+   * unconditional branches, and redirect the calls to the optimized functions
+   * if the program is being profiled.
+   *
+   * The branches are only folded once the other passes have instrumented the
+   * functions: the code the branches skip must be instrumented like the code
+   * of the twins.
+   */
+  virtual bool doFinalization(Module &mod) {
+    unsigned kind = mod.getContext().getMDKindID(SPECULATED_MD);
+    for (auto &fun : mod) {
+      bool isUnopt = fun.getName().startswith(UNOPT_PREFIX);
+      for (auto &bb : fun) {
+        BranchInst *br = dyn_cast<BranchInst>(bb.getTerminator());
+        MDNode *md = br ? br->getMetadata(kind) : nullptr;
+        if (!md) {
+          continue;
+        }
+        if (!isUnopt) {
+          br->setCondition(
+              cast<ConstantAsMetadata>(md->getOperand(0))->getValue());
+        }
+        br->setMetadata(kind, nullptr);
+      }
+    }
+    if (!ProfileValues) {
+      return true;
+    }
+    // Only the calls are redirected: the other uses of the optimized
+    // functions (by the runtime) must still refer to them.
+    for (auto &fun : mod) {
+      Function *twin = mod.getFunction((UNOPT_PREFIX + fun.getName()).str());
+      if (!twin) {
+        continue;
+      }
+      vector<CallInst *> calls;
+      for (auto *user : fun.users()) {
+        CallInst *call = dyn_cast<CallInst>(user);
+        if (call && call->getCalledFunction() == &fun) {
+          calls.push_back(call);
+        }
+      }
+      for (auto *call : calls) {
+        call->setCalledFunction(twin);
+      }
+    }
+    return true;
+  }
+
+  /*
+   * Instrument the `__unopt_` functions if `ProfileValues` is set.
+   */
+  virtual bool runOnFunction(Function &fun) {
+    outs() << "Running SpeculationPass on function: " << fun.getName()
+           << '\n';
+    if (!ProfileValues || !fun.getName().startswith(UNOPT_PREFIX)) {
+      return false;
+    }
+    Module *mod = fun.getParent();
+    BasicBlock &entry = fun.getEntryBlock();
+    IRBuilder<> builder(&entry, entry.getFirstInsertionPt());
+    // The profile is indexed by the name of the optimized function.
+    Value *name = builder.CreateGlobalStringPtr(
+        fun.getName().drop_front(StringRef(UNOPT_PREFIX).size()));
+    Function *profileArg = mod->getFunction(PROFILE_ARG_FUN_NAME);
+    for (auto &arg : fun.args()) {
+      if (arg.getType()->isIntegerTy()) {
+        builder.CreateCall(profileArg,
+                           { name, builder.getInt32(arg.getArgNo()),
+                             builder.CreateSExt(&arg, builder.getInt64Ty()) });
+      }
+    }
+    Function *profileBranch = mod->getFunction(PROFILE_BRANCH_FUN_NAME);
+    vector<BranchInst *> branches = getConditionalBranches(fun);
+    for (size_t i = 0; i < branches.size(); ++i) {
+      builder.SetInsertPoint(branches[i]);
+      builder.CreateCall(profileBranch,
+                         { name, builder.getInt32(i),
+                           builder.CreateZExt(branches[i]->getCondition(),
+                                              builder.getInt32Ty()) });
+    }
+    return true;
+  }
+
+  /*
+   * Return the conditional branches of `fun`, in order.
+   */
+  static vector<BranchInst *> getConditionalBranches(Function &fun) {
+    vector<BranchInst *> branches;
+    for (auto &bb : fun) {
+      BranchInst *br = dyn_cast<BranchInst>(bb.getTerminator());
+      if (br && br->isConditional()) {
+        branches.push_back(br);
+      }
+    }
+    return branches;
+  }
+
+  /*
+   * Read `SpeculationProfile` into `profiles` (indexed by function name).
+   *
+   * A function, argument or branch may have several entries: static
+   * functions with the same name in different translation units are profiled
+   * separately, and profiles may be concatenated. Their counts are summed.
+   */
+  static void readProfile(StringMap<FunctionProfile> &profiles) {
+    auto buffer = MemoryBuffer::getFile(SpeculationProfile);
+    if (!buffer) {
+      report_fatal_error(Twine("Can't read the profile ") +
+                         SpeculationProfile);
+    }
+    SmallVector<StringRef, 16> lines;
+    (*buffer)->getBuffer().split(lines, '\n', -1, false /* KeepEmpty */);
+    for (auto line : lines) {
+      SmallVector<StringRef, 8> fields;
+      line.split(fields, ' ', -1, false /* KeepEmpty */);
+      unsigned index;
+      if (fields.size() < 4 || fields[2].getAsInteger(10, index)) {
+        report_fatal_error("Invalid profile entry: " + line);
+      }
+      FunctionProfile &profile = profiles[fields[1]];
+      if (fields[0] == "branch" && fields.size() == 5) {
+        uint64_t held, notHeld;
+        if (fields[3].getAsInteger(10, held) ||
+            fields[4].getAsInteger(10, notHeld)) {
+          report_fatal_error("Invalid profile entry: " + line);
+        }
+        auto &counts = profile.branches[index];
+        counts.first += held;
+        counts.second += notHeld;
+        continue;
+      }
+      if (fields[0] != "arg") {
+        report_fatal_error("Invalid profile entry: " + line);
+      }
+      FunctionProfile::ArgProfile &arg = profile.args[index];
+      uint64_t calls;
+      if (fields[3].getAsInteger(10, calls)) {
+        report_fatal_error("Invalid profile entry: " + line);
+      }
+      arg.count += calls;
+      // <value>:<count>... other:<count>
+      for (size_t i = 4; i < fields.size(); ++i) {
+        StringRef value, count;
+        std::tie(value, count) = fields[i].split(':');
+        int64_t parsedValue;
+        uint64_t parsedCount;
+        if (value == "other") {
+          continue;
+        }
+        if (value.getAsInteger(10, parsedValue) ||
+            count.getAsInteger(10, parsedCount)) {
+          report_fatal_error("Invalid profile entry: " + line);
+        }
+        arg.valueCounts[parsedValue] += parsedCount;
+      }
+    }
+    for (auto &profile : profiles) {
+      for (auto &arg : profile.second.args) {
+        FunctionProfile::ArgProfile &argProfile = arg.second;
+        argProfile.value = argProfile.valueCount = 0;
+        for (auto &valueCount : argProfile.valueCounts) {
+          if (valueCount.second > argProfile.valueCount) {
+            argProfile.value = valueCount.first;
+            argProfile.valueCount = valueCount.second;
+          }
+        }
+      }
+    }
+  }
+
+  /*
+   * Insert the guards, and choose the specializations, which `profile`
+   * suggests for the (optimized) function `fun`.
+   */
+  static void speculate(Function &fun, const FunctionProfile &profile) {
+    LLVMContext &ctx = fun.getContext();
+    Module *mod = fun.getParent();
+    vector<BranchInst *> branches = getConditionalBranches(fun);
+    for (size_t i = 0; i < branches.size(); ++i) {
+      auto counts = profile.branches.find(i);
+      if (counts == profile.branches.end() ||
+          counts->second.first + counts->second.second < SpeculationMinCount ||
+          (counts->second.first && counts->second.second)) {
+        continue;
+      }
+      bool holds = counts->second.first;
+      BranchInst *br = branches[i];
+      IRBuilder<> builder(br);
+      Value *cond = br->getCondition();
+      if (!holds) {
+        cond = builder.CreateNot(cond);
+      }
+      Constant *speculate = mod->getOrInsertFunction(
+          SPECULATE_FUN_NAME,
+          FunctionType::get(builder.getVoidTy(), { builder.getInt32Ty() },
+                            false));
+      builder.CreateCall(speculate,
+                         { builder.CreateZExt(cond, builder.getInt32Ty()) });
+      br->setMetadata(SPECULATED_MD,
+                      MDNode::get(ctx, ConstantAsMetadata::get(
+                                           builder.getInt1(holds))));
+      ++numGuards;
+    }
+    if (!containsLoop(fun)) {
+      // Calling a version costs more than it saves.
+      return;
+    }
+    std::string specs;
+    for (auto &arg : fun.args()) {
+      auto argProfile = profile.args.find(arg.getArgNo());
+      if (!arg.getType()->isIntegerTy() || argProfile == profile.args.end() ||
+          argProfile->second.count < SpeculationMinCount ||
+          argProfile->second.valueCount * 100 <
+            (uint64_t)SpeculationMinRatio * argProfile->second.count) {
+        continue;
+      }
+      specs += (specs.empty() ? "" : ",") + std::to_string(arg.getArgNo()) +
+               "=" + std::to_string(argProfile->second.value);
+    }
+    if (!specs.empty()) {
+      fun.addFnAttr(SPECIALIZE_ATTR, specs);
+      ++numSpecialized;
+    }
+  }
+
+  static bool containsLoop(Function &fun) {
+    for (auto scc = scc_begin(&fun); !scc.isAtEnd(); ++scc) {
+      if (scc.hasLoop()) {
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+} // end anonymous namespace
+
+char SpeculationPass::id = 0;
+unsigned SpeculationPass::numGuards = 0;
+unsigned SpeculationPass::numSpecialized = 0;
+
+// Automatically enable the pass.
+// http://adriansampson.net/blog/clangpass.html
+static void registerPass(const PassManagerBuilder &,
+                         legacy::PassManagerBase &PM) {
+  PM.add(new SpeculationPass());
+}
+static RegisterStandardPasses RegisterPass(
+    PassManagerBuilder::EP_EarlyAsPossible, registerPass);
@@ -1,23 +1,78 @@
+#include <vector>
+#include <iterator>
+#include <llvm/ADT/MapVector.h>
+#include <llvm/ADT/SmallVector.h>
 #include <llvm/Pass.h>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/LegacyPassManager.h>
 #include <llvm/IR/Constants.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/GlobalVariable.h>
 #include <llvm/Support/raw_ostream.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/ErrorHandling.h>
 #include <llvm/Transforms/IPO/PassManagerBuilder.h>
 #include <llvm/Transforms/Utils/Cloning.h>
 #include <llvm/Transforms/Utils/BasicBlockUtils.h>
 #include "Utils.h"
 
-#define UNOPT_PREFIX "__unopt_"
-#define GUARD_FUN "__guard_failure"
-
 using namespace llvm;
 
+// If set, every function is cloned, even if it can't be on the call stack
+// when a thread is deoptimized.
+static cl::opt<bool> CloneAllFunctions(
+    "clone-all-functions",
+    cl::desc("Create an unoptimized version of every function"),
+    cl::init(false));
+
+// The section of the unoptimized functions. They are only executed after a
+// deoptimization, so they are kept away from the optimized code. If empty,
+// they are placed in the same section as the optimized code.
+static cl::opt<std::string> DeoptSection(
+    "deopt-section",
+    cl::desc("The section of the unoptimized versions of the functions"),
+    cl::init(".text.unlikely.deopt"));
+
+// If set, the unoptimized versions of the functions are compiled with the
+// optimizations which preserve the stack map records (the baseline tier),
+// instead of being marked `optnone`.
+static cl::opt<bool> BaselineTier(
+    "baseline-tier",
+    cl::desc("Optimize the unoptimized versions of the functions"),
+    cl::init(false));
+
+// The specialized versions to create, as `<function>:<argument>=<value>`,
+// where `<argument>` is the index of an integer argument of the function (see
+// `createVersions`).
+static cl::list<std::string> Specialize(
+    "specialize",
+    cl::desc("Create a version of a function for a constant argument "
+             "(<function>:<argument>=<value>)"),
+    cl::CommaSeparated);
+
 namespace {
 
 /*
- * Create an unoptimized version of each function defined in this module.
+ * Create an unoptimized version of each function defined in this module which
+ * may be on the call stack when a thread is deoptimized (see
+ * `DeoptReachability`).
+ *
+ * Execution is only ever resumed in the unoptimized versions of these
+ * functions, in the frames restored by the runtime. The unoptimized code calls
+ * the optimized versions of the functions, which have their own guards, so a
+ * call made after a deoptimization runs at full speed.
+ *
+ * The unoptimized functions are placed in a separate section (see
+ * `DeoptSection`), so that they don't take up space in the instruction cache
+ * and in the iTLB between the optimized functions.
+ *
+ * By default, the unoptimized functions are marked `optnone`. With
+ * `BaselineTier`, they are optimized instead (see `makeBaseline`).
+ *
+ * The pass also creates the specialized versions of the functions requested
+ * with `Specialize`. They share the `__unopt_` twin of the function.
  */
 struct UnoptimizedCopyPass: public FunctionPass {
   static char id;
@@ -25,67 +80,259 @@ struct UnoptimizedCopyPass: public FunctionPass {
   UnoptimizedCopyPass() : FunctionPass(id) {}
 
   virtual bool doInitialization(Module &mod) {
+    // `SafepointPass` declares the poll function if it is enabled, and
+    // `CheckPointPass` (whose `doInitialization` runs first) sets
+    // `EXTERNAL_CALLS_FLAG` if it records the calls to library functions, so
+    // the functions which only call library functions aren't cloned unless
+    // these calls are recorded.
+    DeoptReachability reachability(
+        mod, mod.getFunction(SAFEPOINT_POLL_SITE) != nullptr);
+    unsigned numDefined = 0;
+    unsigned numCloned = 0;
+    // Cloning a function appends it to the function list of the module.
+    std::vector<Function *> funs;
     for (auto &fun : mod.functions()) {
+      funs.push_back(&fun);
+    }
+    for (auto funPtr : funs) {
+      Function &fun = *funPtr;
       // only duplicate the functions that are defined in this module
       if (!fun.getName().startswith(UNOPT_PREFIX) && !fun.isDeclaration()
           && !fun.hasAvailableExternallyLinkage())  {
+        ++numDefined;
+        if (!CloneAllFunctions && !reachability.mayReachDeoptPoint(&fun)) {
+          continue;
+        }
+        ++numCloned;
         ValueToValueMapTy val;
         Function *unopt_fun = CloneFunction(&fun, val);
         // NoInline is required if OptimizeNone is set
         unopt_fun->addFnAttr(llvm::Attribute::NoInline);
-        unopt_fun->addFnAttr(llvm::Attribute::OptimizeNone);
+        if (BaselineTier) {
+          makeBaseline(*unopt_fun, reachability);
+        } else {
+          unopt_fun->addFnAttr(llvm::Attribute::OptimizeNone);
+        }
         // the unoptimized clone of each function starts with the
         // '__unopt_prefix'
         unopt_fun->setName(UNOPT_PREFIX + fun.getName().str());
+        if (!DeoptSection.empty()) {
+          unopt_fun->setSection(DeoptSection);
+          unopt_fun->addFnAttr(llvm::Attribute::Cold);
+        }
       }
     }
+    outs() << "UnoptimizedCopyPass: cloned " << numCloned << " of "
+           << numDefined << " functions\n";
+    createVersions(mod);
     return true;
   }
 
   /*
-   * Replace calls in __unopt_ functions with calls to other __unopt_ functions.
+   * Create the specialized versions of the functions requested with
+   * `Specialize`, and of those listed in the `SPECIALIZE_ATTR` attribute of
+   * each function (see `SpeculationPass`), and dispatch the calls to each
+   * function to its versions.
+   *
+   * The n-th version of `fun` (`__spec<n>_fun`) is a copy of `fun` in which an
+   * argument is replaced with a constant, so the optimizer propagates the
+   * constant through the version. Since the twin of `fun` is created first,
+   * and the other passes instrument the versions as they instrument `fun`,
+   * the n-th `stackmap`/`patchpoint` call of each version corresponds to the
+   * n-th call of the twin (see `CheckPointPass`): if a guard fails in a
+   * version, its frame is restored as a frame of the twin.
    */
-  virtual bool runOnFunction(Function &fun) {
-    auto funName = fun.getName();
-    outs() << "Running UnoptCopyPass on function: " << funName << '\n';
-    if (funName.startswith(UNOPT_PREFIX)) {
-      Module *mod = fun.getParent();
-      for (auto &bb : fun) {
-        for (auto &inst : bb) {
-          if (isa<CallInst>(inst)) {
-            // Replace each call in this function with a call to the
-            // unoptimized version of the called function.
-            CallInst &call = cast<CallInst>(inst);
-            if (call.isInlineAsm()) {
-              continue;
-            }
-            Function *calledFun = call.getCalledFunction();
-            if (getPatchpointType(calledFun).isPatchpoint()) {
-              Value *callback = call.getArgOperand(2)->stripPointerCasts();
-              if (callback && isa<Function>(callback)) {
-                Function *callbackFunction = cast<Function>(callback);
-                StringRef calledFunName = callbackFunction->getName();
-                if (calledFunName != GUARD_FUN &&
-                    !calledFunName.startswith(UNOPT_PREFIX)) {
-                  // This is not an unoptimized function -> call the unoptimized
-                  // version of this function instead.
-                  Function *newFun =
-                    mod->getFunction(UNOPT_PREFIX + calledFunName.str());
-                  if (newFun) {
-                    Type *i8ptr_t = PointerType::getUnqual(
-                        IntegerType::getInt8Ty(mod->getContext()));
-                    Constant* newCallback =
-                      ConstantExpr::getBitCast(newFun, i8ptr_t);
-                    call.setArgOperand(2, newCallback);
-                  }
-                }
-              }
-            }
-          }
+  static void createVersions(Module &mod) {
+    // The specialized argument and its value in each version of each
+    // function.
+    MapVector<Function *, std::vector<std::pair<unsigned, ConstantInt *>>>
+      versions;
+    // The specializations, as `<function>:<argument>=<value>`.
+    std::vector<std::string> specs(Specialize.begin(), Specialize.end());
+    for (auto &fun : mod) {
+      if (!fun.hasFnAttribute(SPECIALIZE_ATTR)) {
+        continue;
+      }
+      // The twins copied the attribute.
+      if (!fun.getName().startswith(UNOPT_PREFIX)) {
+        SmallVector<StringRef, 4> funSpecs;
+        fun.getFnAttribute(SPECIALIZE_ATTR).getValueAsString().split(
+            funSpecs, ',', -1, false /* KeepEmpty */);
+        for (auto spec : funSpecs) {
+          specs.push_back((fun.getName() + ":" + spec).str());
         }
       }
+      fun.removeFnAttr(SPECIALIZE_ATTR);
     }
-    return true;
+    for (auto &spec : specs) {
+      StringRef funName, argNo, value;
+      std::tie(funName, argNo) = StringRef(spec).split(':');
+      std::tie(argNo, value) = argNo.split('=');
+      Function *fun = mod.getFunction(funName);
+      if (!fun || fun->isDeclaration()) {
+        // The function is defined in another translation unit.
+        continue;
+      }
+      unsigned index;
+      int64_t constant;
+      if (argNo.getAsInteger(10, index) || value.getAsInteger(10, constant) ||
+          index >= fun->arg_size() || fun->isVarArg() ||
+          !std::next(fun->arg_begin(), index)->getType()->isIntegerTy()) {
+        report_fatal_error(Twine("Invalid specialization: ") + spec);
+      }
+      Type *argType = std::next(fun->arg_begin(), index)->getType();
+      versions[fun].push_back(
+          { index, cast<ConstantInt>(ConstantInt::get(argType, constant,
+                                                      true /* isSigned */)) });
+    }
+    for (auto &entry : versions) {
+      Function &fun = *entry.first;
+      if (entry.second.size() > MAX_VERSION) {
+        report_fatal_error("Too many versions of " + fun.getName());
+      }
+      std::vector<Function *> specFuns;
+      for (size_t i = 0; i < entry.second.size(); ++i) {
+        ValueToValueMapTy val;
+        Function *specFun = CloneFunction(&fun, val);
+        specFun->setName(SPEC_PREFIX + Twine(i + 1) + "_" + fun.getName());
+        std::next(specFun->arg_begin(), entry.second[i].first)
+          ->replaceAllUsesWith(entry.second[i].second);
+        specFuns.push_back(specFun);
+      }
+      insertDispatch(fun, entry.second, specFuns);
+      outs() << "UnoptimizedCopyPass: created " << specFuns.size()
+             << " versions of " << fun.getName() << '\n';
+    }
+  }
+
+  /*
+   * Dispatch the calls to `fun` to its specialized versions `specFuns`.
+   *
+   * After the arguments are stored in their `alloca`s, `fun` compares the
+   * specialized argument of each version with its value. If they are equal,
+   * and the version is enabled in the version table of `fun`, the version
+   * replaces the frame of `fun` (the call is a `musttail` call):
+   *
+   *   %matches = icmp eq i32 %n, 4
+   *   br i1 %matches, label %version.check, label %version.next
+   * version.check:
+   *   %enabled = load volatile i8, i8* getelementptr (@__versions_fun, 0, 0)
+   *   %use = icmp ne i8 %enabled, 0
+   *   br i1 %use, label %version.call, label %version.next
+   * version.call:
+   *   %r = musttail call i32 @__spec1_fun(i32 %a, i32 %n)
+   *   ret i32 %r
+   *
+   * The runtime disables a version when one of its guards fails, so that
+   * the later calls run the generic version (`fun`). The entry poll of
+   * `fun` (see `SafepointPass`) precedes the dispatch. `fun` and its versions
+   * are never inlined, so that the dispatch isn't duplicated into the callers
+   * (where the calls to the versions couldn't be `musttail` calls).
+   */
+  static void insertDispatch(
+      Function &fun,
+      const std::vector<std::pair<unsigned, ConstantInt *>> &versions,
+      const std::vector<Function *> &specFuns) {
+    LLVMContext &ctx = fun.getContext();
+    Type *i8 = Type::getInt8Ty(ctx);
+    ArrayType *tableType = ArrayType::get(i8, versions.size());
+    // Each version is enabled until one of its guards fails. The table is
+    // visible to the runtime, which finds it by name.
+    auto table = new GlobalVariable(
+        *fun.getParent(), tableType, false /* isConstant */,
+        GlobalValue::ExternalLinkage,
+        ConstantArray::get(tableType, std::vector<Constant *>(
+                                          versions.size(),
+                                          ConstantInt::get(i8, 1))),
+        VERSION_TABLE_PREFIX + fun.getName());
+    BasicBlock &entry = fun.getEntryBlock();
+    BasicBlock::iterator dispatchPoint = entry.begin();
+    while (isa<AllocaInst>(*dispatchPoint) ||
+           (isa<StoreInst>(*dispatchPoint) &&
+            isa<Argument>(
+                cast<StoreInst>(*dispatchPoint).getValueOperand()))) {
+      ++dispatchPoint;
+    }
+    BasicBlock *genericBB = entry.splitBasicBlock(dispatchPoint, "generic");
+    entry.getTerminator()->eraseFromParent();
+    std::vector<Value *> args;
+    for (auto &arg : fun.args()) {
+      args.push_back(&arg);
+    }
+    IRBuilder<> builder(&entry);
+    for (size_t i = 0; i < versions.size(); ++i) {
+      BasicBlock *checkBB =
+        BasicBlock::Create(ctx, "version.check", &fun, genericBB);
+      BasicBlock *callBB =
+        BasicBlock::Create(ctx, "version.call", &fun, genericBB);
+      BasicBlock *nextBB = i + 1 < versions.size()
+        ? BasicBlock::Create(ctx, "version.next", &fun, genericBB)
+        : genericBB;
+      Value *arg = &*std::next(fun.arg_begin(), versions[i].first);
+      builder.CreateCondBr(builder.CreateICmpEQ(arg, versions[i].second),
+                           checkBB, nextBB);
+      builder.SetInsertPoint(checkBB);
+      Value *enabled = builder.CreateLoad(
+          builder.CreateConstInBoundsGEP2_32(tableType, table, 0, i),
+          true /* isVolatile */);
+      builder.CreateCondBr(builder.CreateICmpNE(enabled, builder.getInt8(0)),
+                           callBB, nextBB);
+      builder.SetInsertPoint(callBB);
+      CallInst *call = builder.CreateCall(specFuns[i], args);
+      call->setCallingConv(fun.getCallingConv());
+      call->setTailCallKind(CallInst::TCK_MustTail);
+      if (fun.getReturnType()->isVoidTy()) {
+        builder.CreateRetVoid();
+      } else {
+        builder.CreateRet(call);
+      }
+      specFuns[i]->addFnAttr(Attribute::NoInline);
+      builder.SetInsertPoint(nextBB);
+    }
+    fun.addFnAttr(Attribute::NoInline);
+  }
+
+  /*
+   * Prepare the unoptimized function `fun` to be compiled as part of the
+   * baseline tier.
+   *
+   * The function is optimized, but the runtime must still be able to restore
+   * its frames: the recorded calls (the calls to the functions which may reach
+   * a deoptimization point) are never inlined, so each `stackmap` call still
+   * follows its call, and the frame pointer is kept. `LiveVariablesPass`
+   * keeps the values recorded by the `stackmap` calls in memory. Since the
+   * `stackmap` calls may read and write the recorded memory, the optimizer
+   * doesn't move the loads and stores of the recorded values across them.
+   * Other values may be kept in callee-saved registers, which the function
+   * saves in its prologue; the runtime fills these slots with the values of
+   * its caller when it restores a frame (see `restore_unopt_stack`).
+   */
+  static void makeBaseline(Function &fun,
+                           const DeoptReachability &reachability) {
+    fun.addFnAttr("no-frame-pointer-elim", "true");
+    for (auto &bb : fun) {
+      for (auto &inst : bb) {
+        if (!isa<CallInst>(inst)) {
+          continue;
+        }
+        CallInst &callInst = cast<CallInst>(inst);
+        Function *calledFun = callInst.getCalledFunction();
+        if (calledFun && !calledFun->isIntrinsic() &&
+            reachability.mayReachDeoptPoint(calledFun)) {
+          callInst.addAttribute(AttributeList::FunctionIndex,
+                                Attribute::NoInline);
+        }
+      }
+    }
+  }
+
+  /*
+   * The functions are cloned by `doInitialization`. The calls of the
+   * `__unopt_` functions are left unchanged.
+   */
+  virtual bool runOnFunction(Function &fun) {
+    outs() << "Running UnoptCopyPass on function: " << fun.getName() << '\n';
+    return false;
   }
 };
 
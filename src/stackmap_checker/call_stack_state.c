@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "call_stack_state.h"
 #include "utils.h"
 #include "stmap.h"
@@ -6,9 +7,23 @@
 #include <string.h>
 #include <err.h>
 #include <assert.h>
+#include <ucontext.h>
 
 #define MAX_BUF_SIZE 128
+#define UNOPT_PREFIX "__unopt_"
 
+const unw_regnum_t callee_saved_regs[NUM_CALLEE_SAVED] = {
+    UNW_X86_64_RBX, UNW_X86_64_R12, UNW_X86_64_R13, UNW_X86_64_R14,
+    UNW_X86_64_R15
+};
+
+/*
+ * Return the registers of the frame `cursor` points to.
+ *
+ * The XMM registers are caller-saved, so the frames of the callers of the
+ * first frame keep no values in them across their calls: only the registers
+ * of the first frame (saved by the entry stubs) include the XMM registers.
+ */
 unw_word_t* get_registers(unw_cursor_t cursor)
 {
     unw_word_t *registers = calloc(REGISTER_COUNT, sizeof(unw_word_t));
@@ -31,7 +46,65 @@ unw_word_t* get_registers(unw_cursor_t cursor)
     return registers;
 }
 
-call_stack_state_t* get_call_stack_state(unw_cursor_t cursor)
+bool get_callee_saved_slots(uint64_t ip, uint64_t sp, uint64_t bp,
+                            uint64_t slots[NUM_CALLEE_SAVED])
+{
+    // On x86-64, `unw_context_t` is a `ucontext_t`. Unwinding a context
+    // which describes the frame finds the slots using the call frame
+    // information of the function.
+    unw_context_t context;
+    unw_getcontext(&context);
+    ucontext_t *uc = (ucontext_t *)&context;
+    uc->uc_mcontext.gregs[REG_RIP] = ip;
+    uc->uc_mcontext.gregs[REG_RSP] = sp;
+    uc->uc_mcontext.gregs[REG_RBP] = bp;
+    unw_cursor_t cursor;
+    if (unw_init_local(&cursor, &context) || unw_step(&cursor) <= 0) {
+        return false;
+    }
+    for (size_t i = 0; i < NUM_CALLEE_SAVED; ++i) {
+        unw_save_loc_t loc;
+        slots[i] = 0;
+        if (!unw_get_save_loc(&cursor, callee_saved_regs[i], &loc) &&
+            loc.type == UNW_SLT_MEMORY) {
+            slots[i] = loc.u.addr;
+        }
+    }
+    return true;
+}
+
+/*
+ * Return true if the caller of the frame `cursor` points to is a function
+ * which has no stack size record in `sm`.
+ */
+static bool caller_is_uninstrumented(unw_cursor_t cursor, stack_map_t *sm)
+{
+    unw_proc_info_t proc_info;
+    if (unw_step(&cursor) <= 0 || unw_get_proc_info(&cursor, &proc_info)) {
+        return true;
+    }
+    return !stmap_get_size_record_in_func(sm, proc_info.start_ip);
+}
+
+/*
+ * Return true if the caller of the frame `cursor` points to is an `__unopt_`
+ * function. The unoptimized code calls the optimized versions of the
+ * functions, so the frames of a thread which was already deoptimized may be
+ * followed by optimized frames.
+ */
+static bool caller_is_unoptimized(unw_cursor_t cursor)
+{
+    char fun_name[MAX_BUF_SIZE];
+    unw_word_t off;
+    if (unw_step(&cursor) <= 0 ||
+        unw_get_proc_name(&cursor, fun_name, sizeof(fun_name), &off)) {
+        return false;
+    }
+    return !strncmp(fun_name, UNOPT_PREFIX, strlen(UNOPT_PREFIX));
+}
+
+call_stack_state_t* get_call_stack_state(unw_cursor_t cursor, stack_map_t *sm,
+                                         const uint64_t *top_registers)
 {
     call_stack_state_t *state = malloc(sizeof(call_stack_state_t));
     frame_t *frames = NULL;
@@ -43,7 +116,13 @@ call_stack_state_t* get_call_stack_state(unw_cursor_t cursor)
             break;
         }
         frames = realloc(frames, ++depth * sizeof(frame_t));
-        frames[depth - 1].registers = get_registers(cursor);
+        if (depth == 1 && top_registers) {
+            frames[0].registers = malloc(REGISTER_COUNT * sizeof(unw_word_t));
+            memcpy(frames[0].registers, top_registers,
+                   REGISTER_COUNT * sizeof(unw_word_t));
+        } else {
+            frames[depth - 1].registers = get_registers(cursor);
+        }
         // Store the address of the return address.
         frames[depth - 1].ret_addr =
             (uint64_t)(frames[depth - 1].registers[UNW_X86_64_RBP]
@@ -61,6 +140,16 @@ call_stack_state_t* get_call_stack_state(unw_cursor_t cursor)
         if (!strcmp(fun_name, "main")) {
             break;
         }
+        // Stop at the entry function of a thread other than the main thread
+        // (or at any other function called by uninstrumented code).
+        if (caller_is_uninstrumented(cursor, sm)) {
+            break;
+        }
+        // Stop at an optimized function called by an unoptimized one: the
+        // frames of the unoptimized functions don't need to be restored.
+        if (caller_is_unoptimized(cursor)) {
+            break;
+        }
     }
     state->frames = frames;
     state->depth  = depth;
@@ -77,25 +166,31 @@ void collect_map_records(call_stack_state_t *state, stack_map_t *sm)
         // function. This position is located in an `__unopt_` function.
         stack_map_pos_t *sm_pos =
             stmap_get_unopt_return_addr(sm, *(uint64_t *)state->frames[i].ret_addr);
-        uint64_t unopt_ret_addr =
-            sm->stk_size_records[sm_pos->stk_size_record_index].fun_addr +
-            sm->stk_map_records[sm_pos->stk_map_record_index].instr_offset +
-            PATCHPOINT_CALL_SIZE;
+        uint64_t unopt_ret_addr = stmap_get_call_ret_addr(
+            sm, sm->stk_size_records[sm_pos->stk_size_record_index].fun_addr +
+                sm->stk_map_records[sm_pos->stk_map_record_index].instr_offset);
         // The start address of the function in which this function returns.
         uint64_t fun_start_addr =
             get_sym_start(state->frames[i].stored_ret_addr);
-        // Extract the identifier of the record.
-        uint64_t ppid =
-            ~sm->stk_map_records[sm_pos->stk_map_record_index].patchpoint_id;
+        // Extract the identifier of the record. It is the ID of the record
+        // at the return address (rather than the negation of the ID of the
+        // unoptimized record), because the frame may belong to a specialized
+        // version of the function. In the optimized code, the `stackmap`
+        // call immediately follows the call it records.
+        uint64_t ret_addr = *(uint64_t *)state->frames[i].ret_addr;
+        stack_map_record_t *ret_rec =
+            stmap_get_map_record_at_addr(sm, ret_addr);
+        if (!ret_rec) {
+            errx(1, "No stack map record at return address %lx. Exiting.\n",
+                 ret_addr);
+        }
+        uint64_t ppid = ret_rec->patchpoint_id;
         // The stack map record associated with this frame. Records are
         // duplicated when they are inlined (there may be more than one record
         // with the same identifier)
         stack_map_record_t *real_opt_stk_map_rec =
             stmap_get_map_record_after_addr(sm, ppid, state->frames[i].stored_ret_addr);
-        stack_map_record_t *opt_stk_map_rec =
-            stmap_get_map_record(
-                sm,
-                ~sm->stk_map_records[sm_pos->stk_map_record_index].patchpoint_id);
+        stack_map_record_t *opt_stk_map_rec = stmap_get_map_record(sm, ppid);
         // Overwrite the old return address.
         *(uint64_t *)state->frames[i].ret_addr = unopt_ret_addr;
         // Store each record that corresponds to a frame on the call stack.
@@ -247,15 +342,15 @@ call_stack_state_t* get_restored_state(stack_map_t *sm,
             errx(1, "Size record not found\n");
         }
         stack_map_record_t *unopt_rec =
-            stmap_get_map_record(sm, ~rec->patchpoint_id);
+            stmap_get_map_record(sm, PATCHPOINT_UNOPT_ID(rec->patchpoint_id));
         stack_size_record_t *unopt_size_rec =
             stmap_get_size_record(sm, unopt_rec->index);
         ++state->depth;
         state->frames = realloc(state->frames, state->depth * sizeof(frame_t));
         // ret_addr does not hold the address of the return address
         // if inlined = 1 (it stores the return address instead).
-        state->frames[state->depth - 1].ret_addr =
-            unopt_rec->instr_offset + unopt_size_rec->fun_addr + 13;
+        state->frames[state->depth - 1].ret_addr = stmap_get_call_ret_addr(
+            sm, unopt_rec->instr_offset + unopt_size_rec->fun_addr);
         opt_ret_addr = rec->instr_offset + size_rec->fun_addr + 1;
         state->frames[state->depth - 1].size = unopt_size_rec->stack_size;
         state->frames[state->depth - 1].record = *rec;
@@ -305,35 +400,30 @@ size_t get_locations(stack_map_t *sm, call_stack_state_t *state,
     for (size_t i = 0; i + 1 < state->depth; ++i) {
         stack_map_record_t opt_rec = state->frames[i].real_record;
         stack_map_record_t *unopt_rec = stmap_get_map_record(
-                sm, ~opt_rec.patchpoint_id);
+                sm, PATCHPOINT_UNOPT_ID(opt_rec.patchpoint_id));
         assert(opt_rec.num_locations == unopt_rec->num_locations);
         uint64_t real_bp = state->frames[i + 1].real_bp;
         num_locations += unopt_rec->num_locations;
         *locs = (uint64_t *)realloc(*locs, num_locations * sizeof(uint64_t));
+        // The size of each location is stored in the location size table
+        // emitted by `LiveVariablesPass`.
+        uint32_t *loc_sizes =
+            stmap_get_location_sizes(sm, opt_rec.patchpoint_id);
+        if (!loc_sizes) {
+            errx(1, "Location sizes of %lu not found. Exiting.\n",
+                 opt_rec.patchpoint_id);
+        }
         // Populate the stack of the optimized function with the values the
         // unoptimized function expects
-        for (size_t j = 0; j + 1 < opt_rec.num_locations; j += 2) {
-            // First, retrieve the size of the location at index `j`. This will
-            // be stored in `loc_size`. The size of the location which
-            // represents the size of location `j` is a `uint64_t` value,
-            // because `LiveVariablesPass` records location sizes as 64-bit
-            // values.
-            uint64_t *loc_size =
-                stmap_get_location_value(sm, opt_rec.locations[j + 1],
-                                         state->frames[i].registers,
-                                         (void *)real_bp,
-                                         sizeof(uint64_t));
-            // Now, copy `loc_size` bytes starting at the address indicated by
+        for (size_t j = 0; j < opt_rec.num_locations; ++j) {
+            // Copy `loc_sizes[j]` bytes starting at the address indicated by
             // the location at position `j`.
             void *opt_location_value =
                 stmap_get_location_value(sm, opt_rec.locations[j],
                                          state->frames[i].registers,
                                          (void *)real_bp,
-                                         *loc_size);
-            uint64_t location_value_addr = (uint64_t) opt_location_value;
-            uint64_t loc_size_addr = (uint64_t) loc_size;
-            memcpy(*locs + loc_index++, &location_value_addr, sizeof(uint64_t));
-            memcpy(*locs + loc_index++, &loc_size_addr, sizeof(uint64_t));
+                                         loc_sizes[j]);
+            (*locs)[loc_index++] = (uint64_t)opt_location_value;
         }
     }
     return num_locations;
@@ -347,13 +437,121 @@ void free_locations(uint64_t *locations, size_t num_locations)
     free(locations);
 }
 
+/*
+ * Return the result of applying `recipe` to `base`.
+ */
+static uint64_t apply_remat_recipe(remat_recipe_t recipe, uint64_t base)
+{
+    switch (recipe.op) {
+        case REMAT_ADD:
+            return base + recipe.constant;
+        case REMAT_SUB:
+            return base - recipe.constant;
+        case REMAT_MUL:
+            return base * recipe.constant;
+        case REMAT_AND:
+            return base & recipe.constant;
+        case REMAT_OR:
+            return base | recipe.constant;
+        case REMAT_XOR:
+            return base ^ recipe.constant;
+        case REMAT_SHL:
+            return base << recipe.constant;
+        default:
+            errx(1, "Unknown rematerialization recipe - %u. Exiting\n",
+                 recipe.op);
+    }
+}
+
+/*
+ * Recompute the values of the locations of frame `i` which were not recorded
+ * in the optimized code, and store them in `locations`.
+ *
+ * `locations` contains the values of the locations of the frame, which are
+ * described by `opt_rec` in the optimized code, and by `unopt_rec` in the
+ * unoptimized code.
+ */
+static void rematerialize(stack_map_t *sm, frame_t *frame,
+                          stack_map_record_t *opt_rec,
+                          stack_map_record_t *unopt_rec,
+                          uint32_t *loc_sizes, uint64_t *locations)
+{
+    uint32_t num_recipes = 0;
+    remat_recipe_t *recipes =
+        stmap_get_remat_recipes(sm, opt_rec->patchpoint_id, &num_recipes);
+    for (size_t k = 0; k < num_recipes; ++k) {
+        remat_recipe_t recipe = recipes[k];
+        uint64_t base = 0;
+        if (opt_rec->locations[recipe.base].kind == DIRECT) {
+            // The base is an `alloca`: use its address in the restored frame.
+            if (unopt_rec->locations[recipe.base].kind != DIRECT) {
+                errx(1, "Invalid rematerialization base. Exiting.\n");
+            }
+            base = frame->bp + unopt_rec->locations[recipe.base].offset;
+        } else {
+            uint32_t base_size = loc_sizes[recipe.base];
+            memcpy(&base, (void *)locations[recipe.base],
+                   base_size < sizeof(base) ? base_size : sizeof(base));
+        }
+        uint64_t value = apply_remat_recipe(recipe, base);
+        uint32_t size = loc_sizes[recipe.location];
+        memcpy((void *)locations[recipe.location], &value,
+               size < sizeof(value) ? size : sizeof(value));
+    }
+}
+
+/*
+ * Fill the slots in which the restored frames save the callee-saved registers
+ * of their callers (see `restore_unopt_stack`).
+ *
+ * Starting from the last restored frame, `expected` holds the values the
+ * frame must restore when it returns. A frame which saves a register
+ * restores it from its slot, and expects the register to hold its own value
+ * when it is resumed. A frame which doesn't save a register doesn't modify
+ * it, so its callee must restore the value its caller expects.
+ */
+static void restore_callee_saved(stack_map_t *sm, call_stack_state_t *state)
+{
+    unw_word_t expected[NUM_CALLEE_SAVED];
+    for (size_t k = 0; k < NUM_CALLEE_SAVED; ++k) {
+        expected[k] =
+            state->frames[state->depth - 1].registers[callee_saved_regs[k]];
+    }
+    for (size_t i = state->depth - 1; i-- > 0;) {
+        frame_t *frame = &state->frames[i];
+        stack_map_record_t *unopt_rec = stmap_get_map_record(
+            sm, PATCHPOINT_UNOPT_ID(frame->record.patchpoint_id));
+        stack_size_record_t *unopt_size_rec =
+            stmap_get_size_record(sm, unopt_rec->index);
+        if (!unopt_size_rec) {
+            errx(1, "Size record not found. Exiting.\n");
+        }
+        // The frame is resumed at its `stackmap`/`patchpoint` call, where
+        // its stack pointer is `size - ADDR_SIZE` bytes below its base
+        // pointer (see `insert_real_addresses`).
+        uint64_t ip = unopt_size_rec->fun_addr + unopt_rec->instr_offset;
+        uint64_t sp = frame->bp + ADDR_SIZE - frame->size;
+        uint64_t slots[NUM_CALLEE_SAVED];
+        if (!get_callee_saved_slots(ip, sp, frame->bp, slots)) {
+            errx(1, "No call frame information for %lx. Exiting.\n", ip);
+        }
+        for (size_t k = 0; k < NUM_CALLEE_SAVED; ++k) {
+            if (slots[k]) {
+                *(uint64_t *)slots[k] = expected[k];
+                expected[k] = frame->registers[callee_saved_regs[k]];
+            } else if (!i) {
+                frame->registers[callee_saved_regs[k]] = expected[k];
+            }
+        }
+    }
+}
+
 void restore_unopt_stack(stack_map_t *sm, call_stack_state_t *state)
 {
     uint64_t *locations = NULL;
     // Get all the locations that are 'live' in the 'optimized' version of the
     // call stack. These need to be restored, so that execution can resume in
-    // the 'unoptimized' version. The 'unoptimized' version only contains calls
-    // to `__unopt_` functions.
+    // the 'unoptimized' version.
     size_t num_locations = get_locations(sm, state, &locations);
     // This is used to index `locations`.
     size_t loc_index = 0;
@@ -361,17 +559,23 @@ void restore_unopt_stack(stack_map_t *sm, call_stack_state_t *state)
     for (size_t i = 0; i + 1 < state->depth; ++i) {
         // Get the unoptimized stack map record associated with this frame.
         stack_map_record_t *unopt_rec =
-            stmap_get_map_record(sm, ~state->frames[i].record.patchpoint_id);
+            stmap_get_map_record(
+                sm, PATCHPOINT_UNOPT_ID(state->frames[i].record.patchpoint_id));
         uint64_t bp = state->frames[i].bp;
+        uint32_t *loc_sizes =
+            stmap_get_location_sizes(sm, unopt_rec->patchpoint_id);
+        if (!loc_sizes) {
+            errx(1, "Location sizes of %lu not found. Exiting.\n",
+                 unopt_rec->patchpoint_id);
+        }
+        rematerialize(sm, &state->frames[i], &state->frames[i].real_record,
+                      unopt_rec, loc_sizes, locations + loc_index);
         // Populate the stack of the optimized function with the values the
         // unoptimized function expects.
-        // Records are considered in pairs (the counter is incremented by 2),
-        // because each record at an odd index in the array represents the
-        // size of the previous record.
-        for (size_t j = 0; j + 1 < unopt_rec->num_locations; j += 2) {
+        for (size_t j = 0; j < unopt_rec->num_locations; ++j) {
             location_type type = unopt_rec->locations[j].kind;
             uint64_t opt_location_addr = locations[loc_index++];
-            uint64_t loc_size = *(uint64_t *)locations[loc_index++];
+            uint64_t loc_size = loc_sizes[j];
             if (type == DIRECT) {
                 uint64_t unopt_addr = bp + unopt_rec->locations[j].offset;
                 memcpy((void *)unopt_addr, (void *)opt_location_addr,
@@ -380,8 +584,12 @@ void restore_unopt_stack(stack_map_t *sm, call_stack_state_t *state)
                 uint16_t reg_num = unopt_rec->locations[j].dwarf_reg_num;
                 assert_valid_reg_num(reg_num);
                 // Save the new value of the register (it is restored later).
+                // A float only fills the low 32 bits of an XMM register.
+                state->frames[i].registers[reg_num] = 0;
                 memcpy(state->frames[i].registers + reg_num,
-                       (void *)opt_location_addr, sizeof(unw_word_t));
+                       (void *)opt_location_addr,
+                       loc_size < sizeof(unw_word_t) ? loc_size
+                                                     : sizeof(unw_word_t));
             } else if (type == INDIRECT) {
                 errx(1, "Not implemented - indirect.\n");
             } else if (type != CONSTANT && type != CONST_INDEX) {
@@ -390,6 +598,7 @@ void restore_unopt_stack(stack_map_t *sm, call_stack_state_t *state)
         }
     }
     free_locations(locations, num_locations);
+    restore_callee_saved(sm, state);
 }
 
 void restore_register_state(call_stack_state_t *state, uint64_t r[])
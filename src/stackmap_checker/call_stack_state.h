@@ -5,8 +5,22 @@
 #include <stdbool.h>
 
 #define MAX_CALL_STACK_DEPTH 256
-#define REGISTER_COUNT 16
+// The registers recorded for each frame are indexed by their DWARF register
+// number: the 16 general purpose registers (0-15), the return address (16,
+// unused), and the low 64 bits of the XMM registers (17-32), which hold the
+// scalar floating-point values.
+#define GP_REGISTER_COUNT 16
+#define XMM0_DWARF_REG_NUM 17
+#define XMM_REGISTER_COUNT 16
+#define REGISTER_COUNT (XMM0_DWARF_REG_NUM + XMM_REGISTER_COUNT)
 #define ADDR_SIZE sizeof(void *)
+// The callee-saved registers, other than rbp (see `callee_saved_regs`).
+#define NUM_CALLEE_SAVED 5
+
+// The callee-saved registers (other than rbp, which is restored separately),
+// as libunwind register numbers. The optimized code may keep recorded values
+// in them across calls and polls.
+extern const unw_regnum_t callee_saved_regs[NUM_CALLEE_SAVED];
 
 
 /*
@@ -32,7 +46,7 @@ typedef struct Frame {
     unw_word_t bp;
     // The 'real' base pointer. bp != real_bp for inlined functions.
     unw_word_t real_bp;
-    // The 16 registers recorded for each frame.
+    // The registers recorded for each frame (`REGISTER_COUNT` of them).
     unw_word_t *registers;
     // The stack map record which correspond to this call.
     stack_map_record_t record;
@@ -56,8 +70,17 @@ typedef struct RestoredStackSegment {
 
 /*
  * Return the state of the call stack.
+ *
+ * The walk stops at `main`, at the first function whose caller has no stack
+ * size record in `sm` (such as the entry function of a thread), or at the
+ * first function called by an `__unopt_` function. The last frame of the
+ * returned state is the frame of that function.
+ *
+ * If `top_registers` is not NULL, it contains the registers of the first frame
+ * (saved by the entry stubs in entry.s), so they are not read using libunwind.
  */
-call_stack_state_t* get_call_stack_state(unw_cursor_t cursor);
+call_stack_state_t* get_call_stack_state(unw_cursor_t cursor, stack_map_t *sm,
+                                         const uint64_t *top_registers);
 
 /*
  * Free `state` and all the frames it stores.
@@ -93,9 +116,27 @@ size_t get_locations(stack_map_t *sm, call_stack_state_t *state,
 
 /*
  * Restore the values in each of the stack frames stored in `state`.
+ *
+ * The `__unopt_` functions restore the callee-saved registers they save when
+ * they return, so the slots of these registers in each restored frame are
+ * filled with the values its caller expects: the values of the registers in
+ * the last frame of `state` (which isn't restored), and in the frames
+ * restored below it. The registers the first frame doesn't save are set in
+ * its registers.
  */
 void restore_unopt_stack(stack_map_t *sm, call_stack_state_t *state);
 
+/*
+ * Find where the function whose code contains `ip` saves the callee-saved
+ * registers of its caller, if its frame has base pointer `bp` and stack
+ * pointer `sp` at `ip`. The address of the slot of each register of
+ * `callee_saved_regs` is stored in `slots` (0 if the function doesn't save the
+ * register). Return false if the call frame information of the function
+ * can't be found.
+ */
+bool get_callee_saved_slots(uint64_t ip, uint64_t sp, uint64_t bp,
+                            uint64_t slots[NUM_CALLEE_SAVED]);
+
 /*
  * Attempts to restore the register state of the last frame, using the
  * information in `state`.
@@ -0,0 +1,78 @@
+.global __guard_failure_entry
+.global __guard_failure_compact_entry
+.global __invalidated_guard_entry
+.global __safepoint_poll_entry
+.type   __guard_failure_entry,  @function
+.type   __guard_failure_compact_entry,  @function
+.type   __invalidated_guard_entry,  @function
+.type   __safepoint_poll_entry, @function
+
+# The entry stubs the patchpoints call. Each stub saves the general purpose
+# registers and the low 64 bits of the XMM registers of the optimized function
+# into the thread-local `guard_regs` block (defined in guard.c), indexed by
+# DWARF register number (see call_stack_state.h), and then tail-calls the C
+# handler. The return address of the patchpoint call is left on the stack, so
+# the handler appears to have been called directly by the optimized function.
+# rdi (the ID of a safepoint poll) is preserved.
+#
+# The guard patchpoints use the `anyregcc` calling convention (the invalidated
+# guards call their stub from the shadow of such a patchpoint), and the compact
+# guards (see `CheckPointPass`) call their stub with `preserve_allcc`: the
+# optimized code expects all the registers to be preserved, and passes no
+# arguments. The guard handlers never return, so saving the registers is
+# enough.
+.macro SAVE_REGISTERS
+    mov    %rax,   %fs:guard_regs@tpoff
+    mov    %rdx,   %fs:guard_regs@tpoff+0x8
+    mov    %rcx,   %fs:guard_regs@tpoff+0x10
+    mov    %rbx,   %fs:guard_regs@tpoff+0x18
+    mov    %rsi,   %fs:guard_regs@tpoff+0x20
+    mov    %rdi,   %fs:guard_regs@tpoff+0x28
+    mov    %rbp,   %fs:guard_regs@tpoff+0x30
+    lea    0x8(%rsp), %rax # the rsp of the optimized function
+    mov    %rax,   %fs:guard_regs@tpoff+0x38
+    mov    %r8,    %fs:guard_regs@tpoff+0x40
+    mov    %r9,    %fs:guard_regs@tpoff+0x48
+    mov    %r10,   %fs:guard_regs@tpoff+0x50
+    mov    %r11,   %fs:guard_regs@tpoff+0x58
+    mov    %r12,   %fs:guard_regs@tpoff+0x60
+    mov    %r13,   %fs:guard_regs@tpoff+0x68
+    mov    %r14,   %fs:guard_regs@tpoff+0x70
+    mov    %r15,   %fs:guard_regs@tpoff+0x78
+    movq   %xmm0,  %fs:guard_regs@tpoff+0x88
+    movq   %xmm1,  %fs:guard_regs@tpoff+0x90
+    movq   %xmm2,  %fs:guard_regs@tpoff+0x98
+    movq   %xmm3,  %fs:guard_regs@tpoff+0xa0
+    movq   %xmm4,  %fs:guard_regs@tpoff+0xa8
+    movq   %xmm5,  %fs:guard_regs@tpoff+0xb0
+    movq   %xmm6,  %fs:guard_regs@tpoff+0xb8
+    movq   %xmm7,  %fs:guard_regs@tpoff+0xc0
+    movq   %xmm8,  %fs:guard_regs@tpoff+0xc8
+    movq   %xmm9,  %fs:guard_regs@tpoff+0xd0
+    movq   %xmm10, %fs:guard_regs@tpoff+0xd8
+    movq   %xmm11, %fs:guard_regs@tpoff+0xe0
+    movq   %xmm12, %fs:guard_regs@tpoff+0xe8
+    movq   %xmm13, %fs:guard_regs@tpoff+0xf0
+    movq   %xmm14, %fs:guard_regs@tpoff+0xf8
+    movq   %xmm15, %fs:guard_regs@tpoff+0x100
+.endm
+
+__guard_failure_entry:
+    SAVE_REGISTERS
+    jmp    __guard_failure
+.size   __guard_failure_entry, .-__guard_failure_entry
+
+__guard_failure_compact_entry:
+    SAVE_REGISTERS
+    jmp    __guard_failure_compact
+.size   __guard_failure_compact_entry, .-__guard_failure_compact_entry
+
+__invalidated_guard_entry:
+    SAVE_REGISTERS
+    jmp    __invalidated_guard
+.size   __invalidated_guard_entry, .-__invalidated_guard_entry
+
+__safepoint_poll_entry:
+    SAVE_REGISTERS
+    jmp    __safepoint_poll
+.size   __safepoint_poll_entry, .-__safepoint_poll_entry
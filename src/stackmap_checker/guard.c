@@ -1,6 +1,11 @@
 #include "stmap.h"
 #include "call_stack_state.h"
 #include "utils.h"
+#include "probes.h"
+#include "tierup.h"
+#include "safepoint.h"
+#include "osr.h"
+#include "patch.h"
 #include <stdint.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -8,22 +13,39 @@
 #include <string.h>
 #include <err.h>
 #include <signal.h>
+#include <time.h>
 #define UNW_LOCAL_ONLY
 #include <libunwind.h>
 
 
-// These need to be global, since they need to be visible to jump.s
-uint64_t addr = 0;
-uint64_t r[REGISTER_COUNT];
-uint64_t restored_bp = 0;
-uint64_t restored_stack_size = 0;
+// These need to be global, since they need to be visible to jump.s. They are
+// thread-local, because several threads can be deoptimized at the same time
+// (see safepoint.h).
+__thread uint64_t addr = 0;
+__thread uint64_t r[REGISTER_COUNT];
+__thread uint64_t restored_bp = 0;
+__thread uint64_t restored_stack_size = 0;
+// The registers of the optimized function, saved by the entry stubs in
+// entry.s before they call `__guard_failure` or `__safepoint_poll`.
+__thread uint64_t guard_regs[REGISTER_COUNT];
 
 // The stack of jump_inlined will be overwritten, but
 // restored_start_addr must be freed.
-uint64_t restored_start_addr = 0;
+__thread uint64_t restored_start_addr = 0;
 // restored_total_size is needed to memset the old stack to 0,
 // after the stack of jump_inlined is overwritten.
-uint64_t restored_total_size = 0;
+__thread uint64_t restored_total_size = 0;
+
+/*
+ * Return the number of nanoseconds elapsed since `start`.
+ */
+static uint64_t elapsed_ns(struct timespec start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) * 1000000000ull
+        + now.tv_nsec - start.tv_nsec;
+}
 
 /*
  * If necessary, increase the size of the stack according to `seg`, and then
@@ -60,30 +82,32 @@ void jump_inlined(call_stack_state_t *state, restored_segment_t seg)
 }
 
 /*
- * The guard failure handler. This is the callback passed to the `patchpoint`
- * call which represents a guard failure. When the `patchpoint` instruction is
- * executed, the callback is called.
+ * Deoptimize the call stack of the current thread, and resume execution at the
+ * `patchpoint` with ID `PATCHPOINT_UNOPT_ID(sm_id)` (in the `__unopt_` version
+ * of the function which called the callback). `sm` is freed.
+ *
+ * This must be inlined into the `patchpoint` callbacks: the return address and
+ * the frame of the callback are used to find the frame of the optimized
+ * function, and the frame of the callback is popped by `jmp_to_addr` and
+ * `restore_inlined`. This function does not return.
+ *
+ * If `guard_failed` is true, the failure is recorded by the tier-up policy
+ * and reported through the `guard:failure_exit` probe.
  */
-void __guard_failure(int64_t sm_id)
+static inline __attribute__((always_inline))
+void deoptimize(stack_map_t *sm, int64_t sm_id, bool guard_failed,
+                struct timespec start_time)
 {
-    fprintf(stderr, "Guard %ld failed!\n", sm_id);
-    char *binary_path = get_binary_path();
     unw_cursor_t cursor;
     unw_context_t context;
     unw_getcontext(&context);
     unw_init_local(&cursor, &context);
     unw_cursor_t saved_cursor = cursor;
-    // Read the stack map section.
-    void *stack_map_addr = get_addr(binary_path, ".llvm_stackmaps");
-    free(binary_path);
-    if (!stack_map_addr) {
-        errx(1, ".llvm_stackmaps section not found. Exiting.\n");
-    }
-    stack_map_t *sm = stmap_create(stack_map_addr);
     // The stack map records which correspond to the optimized/unoptimized
     // versions of the function in which the guard failed.
     stack_map_record_t *opt_rec = stmap_get_map_record(sm, sm_id);
-    stack_map_record_t *unopt_rec = stmap_get_map_record(sm, ~sm_id);
+    stack_map_record_t *unopt_rec =
+        stmap_get_map_record(sm, PATCHPOINT_UNOPT_ID(sm_id));
     if (!unopt_rec || !opt_rec) {
         errx(1, "Stack map record not found. Exiting.\n");
     }
@@ -97,13 +121,16 @@ void __guard_failure(int64_t sm_id)
         errx(1, "Record not found.");
     }
     // Get the call stack state.
-    call_stack_state_t *state = get_call_stack_state(cursor);
+    call_stack_state_t *state = get_call_stack_state(cursor, sm, guard_regs);
     collect_map_records(state, sm);
     // Are there any inlined functions?
     bool inlined  = collect_inlined_frames(state, sm);
     // Get the end address of the function in which a guard failed.
     void *end_addr = (void *)get_sym_end(opt_size_rec->fun_addr);
     uint64_t callback_ret_addr = (uint64_t) __builtin_return_address(0);
+    if (guard_failed) {
+        tierup_record_failure(sm, sm_id, callback_ret_addr);
+    }
     // If any inlining happened, it is necessary to reconstruct the entire
     // stack. If that is the case, `seg` will contain all the information
     // necessary to point the rsp and the rbp to the correct addresses.
@@ -184,6 +211,13 @@ void __guard_failure(int64_t sm_id)
     // The address to jump to
     addr = unopt_size_rec->fun_addr + unopt_rec->instr_offset;
     stmap_free(sm);
+    // The number of frames which were restored (the frame of `main` is not
+    // restored).
+    uint64_t frame_count = state->depth - 1;
+    if (guard_failed) {
+        GUARD_PROBE3(failure_exit, sm_id, frame_count,
+                     elapsed_ns(start_time));
+    }
     if (inlined) {
         jump_inlined(state, seg);
     } else {
@@ -191,3 +225,113 @@ void __guard_failure(int64_t sm_id)
         asm volatile("jmp jmp_to_addr");
     }
 }
+
+/*
+ * Deoptimize the call stack after the failure of the guard whose stack map
+ * record is at `guard_addr`. This must be inlined into the guard failure
+ * handlers (see `deoptimize`).
+ */
+static inline __attribute__((always_inline))
+void guard_failure(uint64_t guard_addr, struct timespec start_time)
+{
+    stack_map_t *sm = stmap_load();
+    stack_map_record_t *guard_rec = stmap_get_map_record_at_addr(sm,
+                                                                 guard_addr);
+    if (!guard_rec) {
+        errx(1, "No guard at address %lx. Exiting.\n", guard_addr);
+    }
+    int64_t sm_id = guard_rec->patchpoint_id;
+    GUARD_PROBE1(failure_entry, sm_id);
+    fprintf(stderr, "Guard %ld failed!\n", sm_id);
+    deoptimize(sm, sm_id, true, start_time);
+}
+
+/*
+ * The guard failure handler. This is the callback passed to the `patchpoint`
+ * call which represents a guard failure. When the `patchpoint` instruction is
+ * executed, the callback is called (through `__guard_failure_entry`, which
+ * saves all the registers, as required by the `anyregcc` calling convention).
+ */
+void __guard_failure(void)
+{
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    // The guard patchpoints use the `anyregcc` calling convention, so they
+    // don't pass the ID of the guard in a known register. The guard is the
+    // patchpoint whose shadow contains the call to the entry stub.
+    guard_failure((uint64_t)__builtin_return_address(0) - PATCHPOINT_CALL_SIZE,
+                  start_time);
+}
+
+/*
+ * The handler of the invalidated guards. The runtime invalidates a guard by
+ * replacing the `nop` which is the shadow of its `patchpoint` with a call to
+ * `__invalidated_guard_entry` (see guard_control.h), so the guard is the
+ * patchpoint whose shadow ends at the return address.
+ */
+void __invalidated_guard(void)
+{
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    guard_failure((uint64_t)__builtin_return_address(0) - CALL_REL32_SIZE,
+                  start_time);
+}
+
+/*
+ * The failure handler of the compact guards, which call
+ * `__guard_failure_compact_entry` directly. The `stackmap` call which records
+ * the state of the guard immediately follows the call, so its address is the
+ * return address.
+ */
+void __guard_failure_compact(void)
+{
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    guard_failure((uint64_t)__builtin_return_address(0), start_time);
+}
+
+/*
+ * The safepoint poll handler. This is the callback passed to the `patchpoint`
+ * call of a safepoint poll. It is only called if a safepoint was requested.
+ *
+ * The thread is parked until the safepoint ends. If the thread which requested
+ * the safepoint asked for the optimized code to be invalidated, the call stack
+ * of this thread is then deoptimized.
+ */
+void __safepoint_poll(int64_t sm_id)
+{
+    if (!safepoint_park()) {
+        return;
+    }
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    fprintf(stderr, "Deoptimizing at safepoint %ld\n", sm_id);
+    deoptimize(stmap_load(), sm_id, false, start_time);
+}
+
+/*
+ * The OSR handler, called by the back-edge polls of the `__unopt_` functions
+ * after `__osr_threshold` iterations (see osr.h).
+ *
+ * If the frame of the `__unopt_` function is moved to the optimized function,
+ * execution is resumed after the poll with ID `~unopt_id`, and this function
+ * does not return.
+ */
+void __osr_enter(int64_t unopt_id)
+{
+    if (!osr_enabled(unopt_id)) {
+        return;
+    }
+    unw_cursor_t cursor;
+    unw_context_t context;
+    unw_getcontext(&context);
+    unw_init_local(&cursor, &context);
+    stack_map_t *sm = stmap_load();
+    uint64_t resume_addr = osr_transfer(sm, unopt_id, cursor, r);
+    stmap_free(sm);
+    if (!resume_addr) {
+        return;
+    }
+    addr = resume_addr;
+    asm volatile("jmp jmp_to_addr");
+}
@@ -0,0 +1,125 @@
+#include "guard_control.h"
+#include "stmap.h"
+#include "patch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <err.h>
+
+// The entry stub of the handler of the invalidated guards (see entry.s).
+void __invalidated_guard_entry(void);
+
+// nopl 0x0(%rax,%rax,1): the shadow of a valid guard, emitted by LLVM for a
+// `patchpoint` without a target.
+static const uint8_t nop5[CALL_REL32_SIZE] = { 0x0f, 0x1f, 0x44, 0x00, 0x00 };
+
+/*
+ * Store in `insn` a `call rel32` instruction at `addr` which calls
+ * `__invalidated_guard_entry`.
+ */
+static void make_handler_call(uint8_t *addr, uint8_t insn[CALL_REL32_SIZE])
+{
+    int64_t rel = (int64_t)__invalidated_guard_entry -
+        (int64_t)(addr + CALL_REL32_SIZE);
+    if (rel != (int32_t)rel) {
+        errx(1, "The guard handler is out of range of %p. Exiting.\n", addr);
+    }
+    int32_t rel32 = rel;
+    insn[0] = CALL_REL32_OPCODE;
+    memcpy(insn + 1, &rel32, sizeof(rel32));
+}
+
+/*
+ * Make each copy of the invalidatable guard with ID `sm_id` call the handler
+ * (if `invalidate` is set) or execute its `nop` (otherwise), and add the
+ * number of copies to `num_patched`.
+ *
+ * The shadow of the guard is a single instruction in both states, so no thread
+ * can be in the middle of it.
+ */
+static void patch_copies(stack_map_t *sm, int64_t sm_id, bool invalidate,
+                         size_t *num_patched)
+{
+    uint64_t probe = 0;
+    stack_map_record_t *rec = NULL;
+    while ((rec = stmap_next_record_with_id(sm, sm_id, &probe))) {
+        if (stmap_get_record_kind(sm, rec->patchpoint_id) !=
+            RECORD_INVALIDATABLE_GUARD) {
+            errx(1, "%ld is not the ID of an invalidatable guard. Exiting.\n",
+                 sm_id);
+        }
+        stack_size_record_t *size_rec = stmap_get_size_record(sm, rec->index);
+        if (!size_rec) {
+            errx(1, "Size record not found. Exiting.\n");
+        }
+        uint8_t *guard_addr = (uint8_t *)(size_rec->fun_addr + rec->instr_offset);
+        uint8_t call[CALL_REL32_SIZE];
+        make_handler_call(guard_addr, call);
+        if (memcmp(guard_addr, nop5, CALL_REL32_SIZE) &&
+            memcmp(guard_addr, call, CALL_REL32_SIZE)) {
+            errx(1, "Unexpected code at guard %ld. Exiting.\n", sm_id);
+        }
+        const uint8_t *insn = invalidate ? call : nop5;
+        if (memcmp(guard_addr, insn, CALL_REL32_SIZE)) {
+            patch_code((uint64_t)guard_addr, insn, CALL_REL32_SIZE);
+        }
+        ++*num_patched;
+    }
+}
+
+/*
+ * Patch each copy of the guard, including its copies in the specialized
+ * versions of its function.
+ */
+static void patch_guard(int64_t sm_id, bool invalidate)
+{
+    stack_map_t *sm = stmap_load();
+    size_t num_patched = 0;
+    for (uint32_t version = 0; version <= PATCHPOINT_MAX_VERSION; ++version) {
+        patch_copies(sm, PATCHPOINT_WITH_VERSION(sm_id, version), invalidate,
+                     &num_patched);
+    }
+    stmap_free(sm);
+    if (!num_patched) {
+        errx(1, "Guard %ld not found. Exiting.\n", sm_id);
+    }
+}
+
+int64_t guard_get_id(void *fun, uint32_t n)
+{
+    stack_map_t *sm = stmap_load();
+    // The IDs of the guards of a function increase in the order in which the
+    // guards appear in the source. Find the n-th smallest one.
+    uint64_t id = 0;
+    for (uint32_t i = 0; i <= n; ++i) {
+        uint64_t next = UINT64_MAX;
+        for (uint32_t j = 0; j < sm->num_rec; ++j) {
+            stack_map_record_t *rec = &sm->stk_map_records[j];
+            stack_size_record_t *size_rec =
+                stmap_get_size_record(sm, rec->index);
+            if (size_rec && size_rec->fun_addr == (uint64_t)fun &&
+                rec->patchpoint_id > id && rec->patchpoint_id < next &&
+                stmap_get_record_kind(sm, rec->patchpoint_id) ==
+                RECORD_INVALIDATABLE_GUARD) {
+                next = rec->patchpoint_id;
+            }
+        }
+        if (next == UINT64_MAX) {
+            errx(1, "Invalidatable guard %u of %p not found. Exiting.\n", n,
+                 fun);
+        }
+        id = next;
+    }
+    stmap_free(sm);
+    return id;
+}
+
+void guard_invalidate(int64_t sm_id)
+{
+    patch_guard(sm_id, true);
+}
+
+void guard_reset(int64_t sm_id)
+{
+    patch_guard(sm_id, false);
+}
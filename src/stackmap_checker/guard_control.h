@@ -0,0 +1,41 @@
+#ifndef GUARD_CONTROL_H
+#define GUARD_CONTROL_H
+
+#include <stdint.h>
+
+/**
+ * This module allows the program to invalidate guards at run time.
+ *
+ * Only the invalidatable guards (`__speculate_invalidatable`, see speculate.h)
+ * can be patched. Each one is a `patchpoint` on the fast path whose shadow is
+ * a single 5-byte `nop` while the guard is valid. Invalidating the guard
+ * replaces the `nop` with a `call rel32` to `__invalidated_guard_entry`, so
+ * the next thread which reaches it deoptimizes. Both states are a single
+ * instruction, so each switch is atomic. All the copies of a guard (e.g. the
+ * copies created by inlining, and the copies in the specialized versions of
+ * its function) are patched.
+ *
+ * The conditional guards (`__speculate`) check their condition, and always
+ * deoptimize when it doesn't hold: they can't be patched.
+ */
+
+/*
+ * Return the ID of the n-th (from 0) invalidatable guard of the function
+ * which starts at `fun`, in the order in which the guards appear in the
+ * source of the function.
+ */
+int64_t guard_get_id(void *fun, uint32_t n);
+
+/*
+ * Invalidate the guard with the specified ID: the guard calls the guard
+ * failure handler when it is reached.
+ */
+void guard_invalidate(int64_t sm_id);
+
+/*
+ * Make the guard with the specified ID valid again: the guard does nothing
+ * when it is reached.
+ */
+void guard_reset(int64_t sm_id);
+
+#endif // GUARD_CONTROL_H
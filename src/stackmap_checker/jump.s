@@ -1,48 +1,65 @@
 .global jmp_to_addr
 .global restore_inlined
+.type   jmp_to_addr,     @function
+.type   restore_inlined, @function
+
+# The variables defined in guard.c are thread-local, so they are accessed
+# relative to %fs (using the local-exec TLS model).
+
+# Load the registers of the unoptimized function from the `r` block, which is
+# indexed by DWARF register number (see call_stack_state.h). rbp and rsp are
+# set by the caller. Only the low 64 bits of the XMM registers are recorded.
+.macro LOAD_REGISTERS
+    mov    %fs:r@tpoff,      %rax
+    mov    %fs:r@tpoff+0x8,  %rdx
+    mov    %fs:r@tpoff+0x10, %rcx
+    mov    %fs:r@tpoff+0x18, %rbx
+    mov    %fs:r@tpoff+0x20, %rsi
+    mov    %fs:r@tpoff+0x28, %rdi
+    mov    %fs:r@tpoff+0x40, %r8
+    mov    %fs:r@tpoff+0x48, %r9
+    mov    %fs:r@tpoff+0x50, %r10
+    mov    %fs:r@tpoff+0x58, %r11
+    mov    %fs:r@tpoff+0x60, %r12
+    mov    %fs:r@tpoff+0x68, %r13
+    mov    %fs:r@tpoff+0x70, %r14
+    mov    %fs:r@tpoff+0x78, %r15
+    movq   %fs:r@tpoff+0x88, %xmm0
+    movq   %fs:r@tpoff+0x90, %xmm1
+    movq   %fs:r@tpoff+0x98, %xmm2
+    movq   %fs:r@tpoff+0xa0, %xmm3
+    movq   %fs:r@tpoff+0xa8, %xmm4
+    movq   %fs:r@tpoff+0xb0, %xmm5
+    movq   %fs:r@tpoff+0xb8, %xmm6
+    movq   %fs:r@tpoff+0xc0, %xmm7
+    movq   %fs:r@tpoff+0xc8, %xmm8
+    movq   %fs:r@tpoff+0xd0, %xmm9
+    movq   %fs:r@tpoff+0xd8, %xmm10
+    movq   %fs:r@tpoff+0xe0, %xmm11
+    movq   %fs:r@tpoff+0xe8, %xmm12
+    movq   %fs:r@tpoff+0xf0, %xmm13
+    movq   %fs:r@tpoff+0xf8, %xmm14
+    movq   %fs:r@tpoff+0x100, %xmm15
+.endm
 
 # Jumps to addr, cleaning up after __guard_failure
 jmp_to_addr:
-    mov    r,      %rax
-    mov    r+0x8,  %rcx
-    mov    r+0x10, %rdx
-    mov    r+0x18, %rbx
-    mov    r+0x30, %rsi
-    mov    r+0x38, %rdi
-    mov    r+0x40, %r8
-    mov    r+0x48, %r9
-    mov    r+0x50, %r10
-    mov    r+0x58, %r11
-    mov    r+0x60, %r12
-    mov    r+0x68, %r13
-    mov    r+0x70, %r14
-    mov    r+0x78, %r15
+    LOAD_REGISTERS
     mov    %rbp,   %rsp
     pop    %rbp
-    add    $0x8,   %rsp # pop the return address of __guard_failure
-    jmp    *addr
+    add    $0x8,   %rsp # pop the return address of the callback
+    jmp    *%fs:addr@tpoff
+.size   jmp_to_addr, .-jmp_to_addr
 
 restore_inlined:
-    mov    restored_stack_size, %rsi
-    mov    restored_bp,         %rdi
+    mov    %fs:restored_stack_size@tpoff, %rsi
+    mov    %fs:restored_bp@tpoff,         %rdi
     mov    %rbp,   %rsp
     pop    %rbp
-    add    $0x8,   %rsp # pop the return address of __guard_failure
+    add    $0x8,   %rsp # pop the return address of the callback
     mov    %rdi,   %rbp
     mov    %rbp,   %rsp
     sub    %rsi,   %rsp
-    mov    r,      %rax
-    mov    r+0x8,  %rcx
-    mov    r+0x10, %rdx
-    mov    r+0x18, %rbx
-    mov    r+0x30, %rsi
-    mov    r+0x38, %rdi
-    mov    r+0x40, %r8
-    mov    r+0x48, %r9
-    mov    r+0x50, %r10
-    mov    r+0x58, %r11
-    mov    r+0x60, %r12
-    mov    r+0x68, %r13
-    mov    r+0x70, %r14
-    mov    r+0x78, %r15
-    jmp    *addr
+    LOAD_REGISTERS
+    jmp    *%fs:addr@tpoff
+.size   restore_inlined, .-restore_inlined
@@ -0,0 +1,219 @@
+#include "osr.h"
+#include "call_stack_state.h"
+#include "tierup.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+
+#define UNOPT_PREFIX "__unopt_"
+
+uint32_t __osr_threshold = OSR_DEFAULT_THRESHOLD;
+
+// The polls at which OSR failed. It is not attempted again at these polls.
+static int64_t *declined = NULL;
+static size_t num_declined = 0;
+// Loops may reach the threshold in several threads at once.
+static int osr_lock = 0;
+// The number of frames moved to optimized code.
+static uint64_t num_transfers = 0;
+
+static void lock()
+{
+    while (__atomic_exchange_n(&osr_lock, 1, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+}
+
+static void unlock()
+{
+    __atomic_store_n(&osr_lock, 0, __ATOMIC_RELEASE);
+}
+
+__attribute__((constructor))
+static void init_threshold()
+{
+    char *value = getenv("OSR_THRESHOLD");
+    if (value) {
+        uint64_t threshold = strtoull(value, NULL, 10);
+        __osr_threshold =
+            threshold && threshold < UINT32_MAX ? threshold : UINT32_MAX;
+    }
+}
+
+bool osr_enabled(int64_t unopt_id)
+{
+    bool enabled = true;
+    lock();
+    for (size_t i = 0; i < num_declined && enabled; ++i) {
+        enabled = declined[i] != unopt_id;
+    }
+    unlock();
+    return enabled;
+}
+
+uint64_t osr_get_num_transfers()
+{
+    return __atomic_load_n(&num_transfers, __ATOMIC_RELAXED);
+}
+
+/*
+ * Never attempt OSR at the poll with ID `unopt_id` again. Return 0.
+ */
+static uint64_t decline(int64_t unopt_id, const char *reason)
+{
+    fprintf(stderr, "OSR at %ld declined: %s\n", unopt_id, reason);
+    lock();
+    declined = realloc(declined, ++num_declined * sizeof(int64_t));
+    declined[num_declined - 1] = unopt_id;
+    unlock();
+    return 0;
+}
+
+static bool is_callee_saved(uint16_t reg)
+{
+    for (size_t i = 0; i < NUM_CALLEE_SAVED; ++i) {
+        if (callee_saved_regs[i] == reg) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Return the address of the optimized twin of the `__unopt_` function which
+ * starts at `unopt_addr`, or 0 if there is no such function.
+ */
+static uint64_t get_opt_twin(uint64_t unopt_addr)
+{
+    char *name = get_sym_name(unopt_addr);
+    if (!name) {
+        return 0;
+    }
+    uint64_t opt_addr = 0;
+    if (!strncmp(name, UNOPT_PREFIX, strlen(UNOPT_PREFIX))) {
+        opt_addr = get_sym_addr(name + strlen(UNOPT_PREFIX));
+    }
+    free(name);
+    return opt_addr;
+}
+
+/*
+ * Return true if each value recorded in `unopt_rec` can be moved to the
+ * location recorded for it in `opt_rec`.
+ */
+static bool can_transfer(stack_map_t *sm, stack_map_record_t *unopt_rec,
+                         stack_map_record_t *opt_rec)
+{
+    uint32_t num_recipes = 0;
+    stmap_get_remat_recipes(sm, opt_rec->patchpoint_id, &num_recipes);
+    if (num_recipes || unopt_rec->num_locations != opt_rec->num_locations) {
+        return false;
+    }
+    for (size_t i = 0; i < unopt_rec->num_locations; ++i) {
+        location_t unopt_loc = unopt_rec->locations[i];
+        location_t opt_loc = opt_rec->locations[i];
+        if (unopt_loc.kind != DIRECT && unopt_loc.kind != CONSTANT &&
+            unopt_loc.kind != CONST_INDEX) {
+            return false;
+        }
+        if (opt_loc.kind == INDIRECT ||
+            (opt_loc.kind == REGISTER &&
+             !is_callee_saved(opt_loc.dwarf_reg_num))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint64_t osr_transfer(stack_map_t *sm, int64_t unopt_id, unw_cursor_t cursor,
+                      uint64_t *regs)
+{
+    stack_map_record_t *unopt_rec = stmap_get_map_record(sm, unopt_id);
+    if (!unopt_rec) {
+        return decline(unopt_id, "no stack map record");
+    }
+    stack_size_record_t *unopt_size_rec =
+        stmap_get_size_record(sm, unopt_rec->index);
+    uint64_t opt_fun_addr = get_opt_twin(unopt_size_rec->fun_addr);
+    if (!opt_fun_addr || tierup_is_redirected(opt_fun_addr)) {
+        return decline(unopt_id, "no optimized function");
+    }
+    // The optimized function may also have been inlined into other
+    // functions, so its own record must be used.
+    stack_map_record_t *opt_rec =
+        stmap_get_map_record_in_func(sm, ~unopt_id, opt_fun_addr);
+    stack_size_record_t *opt_size_rec =
+        stmap_get_size_record_in_func(sm, opt_fun_addr);
+    if (!opt_rec || !opt_size_rec) {
+        return decline(unopt_id, "no optimized poll");
+    }
+    // The frame is moved in place.
+    if (opt_size_rec->stack_size != unopt_size_rec->stack_size) {
+        return decline(unopt_id, "the frames have different sizes");
+    }
+    if (!can_transfer(sm, unopt_rec, opt_rec)) {
+        return decline(unopt_id, "unsupported locations");
+    }
+    uint32_t *loc_sizes = stmap_get_location_sizes(sm, unopt_id);
+    if (!loc_sizes) {
+        return decline(unopt_id, "no location sizes");
+    }
+    // Step to the frame of the `__unopt_` function, and then to the frame of
+    // its caller, which holds the values of the callee-saved registers the
+    // caller expects to be restored.
+    unw_word_t bp, sp;
+    unw_cursor_t caller = cursor;
+    if (unw_step(&cursor) <= 0 || unw_step(&caller) <= 0 ||
+        unw_step(&caller) <= 0) {
+        return decline(unopt_id, "the stack can't be unwound");
+    }
+    unw_get_reg(&cursor, UNW_X86_64_RBP, &bp);
+    unw_get_reg(&cursor, UNW_X86_64_RSP, &sp);
+    uint64_t resume_addr =
+        opt_size_rec->fun_addr + opt_rec->instr_offset + PATCHPOINT_CALL_SIZE;
+    uint64_t slots[NUM_CALLEE_SAVED];
+    if (!get_callee_saved_slots(resume_addr, sp, bp, slots)) {
+        return decline(unopt_id, "no call frame information");
+    }
+    uint64_t caller_regs[NUM_CALLEE_SAVED];
+    for (size_t i = 0; i < NUM_CALLEE_SAVED; ++i) {
+        unw_word_t value;
+        unw_get_reg(&caller, callee_saved_regs[i], &value);
+        caller_regs[i] = value;
+    }
+    // Read all the values before the frame is overwritten.
+    void **values = malloc(unopt_rec->num_locations * sizeof(void *));
+    for (size_t i = 0; i < unopt_rec->num_locations; ++i) {
+        values[i] = stmap_get_location_value(sm, unopt_rec->locations[i],
+                                             NULL, (void *)bp, loc_sizes[i]);
+    }
+    // The optimized function restores the registers it saved from its frame
+    // when it returns, and doesn't modify the others.
+    memset(regs, 0, REGISTER_COUNT * sizeof(uint64_t));
+    for (size_t i = 0; i < NUM_CALLEE_SAVED; ++i) {
+        if (slots[i]) {
+            *(uint64_t *)slots[i] = caller_regs[i];
+        } else {
+            regs[callee_saved_regs[i]] = caller_regs[i];
+        }
+    }
+    // Populate the frame of the optimized function.
+    for (size_t i = 0; i < opt_rec->num_locations; ++i) {
+        location_t loc = opt_rec->locations[i];
+        uint32_t size = loc_sizes[i];
+        if (loc.kind == REGISTER) {
+            regs[loc.dwarf_reg_num] = 0;
+            memcpy(&regs[loc.dwarf_reg_num], values[i],
+                   size < sizeof(uint64_t) ? size : sizeof(uint64_t));
+        } else if (loc.kind == DIRECT) {
+            memcpy((void *)(bp + loc.offset), values[i], size);
+        }
+        free(values[i]);
+    }
+    free(values);
+    fprintf(stderr, "OSR at %ld\n", unopt_id);
+    __atomic_add_fetch(&num_transfers, 1, __ATOMIC_RELAXED);
+    return resume_addr;
+}
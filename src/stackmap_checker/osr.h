@@ -0,0 +1,62 @@
+#ifndef OSR_H
+#define OSR_H
+
+#include "stmap.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+#define OSR_DEFAULT_THRESHOLD 10000
+
+/**
+ * On-stack replacement (OSR) of the frames of `__unopt_` functions.
+ *
+ * A deoptimized loop would otherwise run in the `__unopt_` function until the
+ * function returns. When the passes are run with `-mllvm -osr-entries`, each
+ * safepoint poll on a loop back-edge of an `__unopt_` function counts the
+ * iterations of its loop. After `__osr_threshold` iterations (the
+ * `OSR_THRESHOLD` environment variable, 10000 by default, 0 disables OSR), the
+ * poll calls `__osr_enter`, which moves the frame to the optimized version of
+ * the function, and resumes execution after the corresponding poll of the
+ * optimized function. This is the inverse of `restore_unopt_stack`.
+ *
+ * The frame is only moved if each value recorded at the poll of the
+ * `__unopt_` function is stored on the stack, if the optimized function
+ * records a location for each of them (and rematerializes none), if both
+ * functions have frames of the same size, and if the tier-up policy didn't
+ * redirect the calls to the optimized function. Otherwise, `__osr_enter`
+ * returns, and OSR is never attempted again at that poll.
+ */
+
+// The number of iterations after which a loop is moved to optimized code.
+extern uint32_t __osr_threshold;
+
+/*
+ * Return true if OSR may be attempted at the poll with ID `unopt_id` (in an
+ * `__unopt_` function).
+ */
+bool osr_enabled(int64_t unopt_id);
+
+/*
+ * Return the number of frames which were moved to optimized code.
+ */
+uint64_t osr_get_num_transfers();
+
+/*
+ * Move the frame of the `__unopt_` function which contains the poll with ID
+ * `unopt_id` to its optimized version. `cursor` points to the frame of the
+ * OSR handler, which was called by the poll.
+ *
+ * On success, return the address execution must be resumed at, and store
+ * the registers of the optimized function in `regs`. Otherwise, return 0: the
+ * frame is left unchanged.
+ */
+uint64_t osr_transfer(stack_map_t *sm, int64_t unopt_id, unw_cursor_t cursor,
+                      uint64_t *regs);
+
+/*
+ * The OSR handler (defined in guard.c). It doesn't return if the frame of
+ * its caller is moved to the optimized function.
+ */
+void __osr_enter(int64_t unopt_id);
+
+#endif // OSR_H
@@ -0,0 +1,152 @@
+#define _GNU_SOURCE
+#include "patch.h"
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+#include <err.h>
+
+#define INT3_OPCODE 0xcc
+
+// The address of the instruction which is being patched, or 0 if no patching
+// is in progress.
+static uint64_t patch_in_progress = 0;
+// Only one thread can patch code at a time.
+static int patch_lock = 0;
+static bool initialized = false;
+// Whether the kernel can serialize the instruction streams of all the threads
+// of this process.
+static bool can_sync_cores = false;
+static struct sigaction old_trap_action;
+
+/*
+ * Make sure all the threads of this process fetch the current version of the
+ * code before they execute anything else.
+ */
+static void sync_cores()
+{
+    if (can_sync_cores) {
+        syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE, 0);
+    }
+}
+
+/*
+ * The SIGTRAP handler. A thread which executes an instruction while it is
+ * being patched traps on the `int3` temporarily written over its first byte.
+ * The thread waits until the patching is done, and then executes the
+ * instruction again.
+ */
+static void trap_handler(int sig, siginfo_t *info, void *ctx_ptr)
+{
+    ucontext_t *ctx = (ucontext_t *)ctx_ptr;
+    uint64_t trap_addr = ctx->uc_mcontext.gregs[REG_RIP] - 1;
+    while (__atomic_load_n(&patch_in_progress, __ATOMIC_ACQUIRE) == trap_addr) {
+        __builtin_ia32_pause();
+    }
+    if (*(volatile uint8_t *)trap_addr != INT3_OPCODE) {
+        // The `int3` was removed, so it was written by `patch_code`.
+        ctx->uc_mcontext.gregs[REG_RIP] = trap_addr;
+        return;
+    }
+    // This is not one of our traps.
+    if (old_trap_action.sa_flags & SA_SIGINFO) {
+        old_trap_action.sa_sigaction(sig, info, ctx_ptr);
+    } else if (old_trap_action.sa_handler == SIG_IGN) {
+        return;
+    } else if (old_trap_action.sa_handler != SIG_DFL) {
+        old_trap_action.sa_handler(sig);
+    } else {
+        signal(SIGTRAP, SIG_DFL);
+        raise(SIGTRAP);
+    }
+}
+
+static void init_patching()
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = trap_handler;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGTRAP, &action, &old_trap_action)) {
+        err(1, "Could not install the SIGTRAP handler");
+    }
+    can_sync_cores = !syscall(
+        __NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE, 0);
+    initialized = true;
+}
+
+/*
+ * Change the protection of the pages which contain [addr, addr + size).
+ */
+static void set_protection(uint64_t addr, size_t size, int prot)
+{
+    uint64_t page_size = sysconf(_SC_PAGESIZE);
+    uint64_t start = addr & ~(page_size - 1);
+    uint64_t end = (addr + size + page_size - 1) & ~(page_size - 1);
+    if (mprotect((void *)start, end - start, prot)) {
+        err(1, "Could not change the protection of %lx", addr);
+    }
+}
+
+void patch_code(uint64_t addr, const uint8_t *bytes, size_t size)
+{
+    if (!size) {
+        return;
+    }
+    while (__atomic_exchange_n(&patch_lock, 1, __ATOMIC_ACQUIRE)) {
+        __builtin_ia32_pause();
+    }
+    if (!initialized) {
+        init_patching();
+    }
+    volatile uint8_t *code = (volatile uint8_t *)addr;
+    set_protection(addr, size, PROT_READ | PROT_WRITE | PROT_EXEC);
+    // Cross-modifying code: another thread might be executing the instruction
+    // at `addr`. First, replace its first byte with an `int3`, so that no
+    // thread can execute a partially written instruction. Then, write the
+    // rest of the instruction, and finally its first byte.
+    __atomic_store_n(&patch_in_progress, addr, __ATOMIC_RELEASE);
+    code[0] = INT3_OPCODE;
+    sync_cores();
+    for (size_t i = 1; i < size; ++i) {
+        code[i] = bytes[i];
+    }
+    sync_cores();
+    code[0] = bytes[0];
+    sync_cores();
+    __atomic_store_n(&patch_in_progress, 0, __ATOMIC_RELEASE);
+    set_protection(addr, size, PROT_READ | PROT_EXEC);
+    __builtin___clear_cache((char *)addr, (char *)addr + size);
+    __atomic_store_n(&patch_lock, 0, __ATOMIC_RELEASE);
+}
+
+uint64_t find_call_to(uint64_t ret_addr, uint64_t target, size_t max_dist)
+{
+    for (size_t dist = 0; dist <= max_dist; ++dist) {
+        uint8_t *call = (uint8_t *)(ret_addr - dist - CALL_REL32_SIZE);
+        int32_t rel;
+        memcpy(&rel, call + 1, sizeof(rel));
+        uint64_t call_ret_addr = (uint64_t)call + CALL_REL32_SIZE;
+        if (*call == CALL_REL32_OPCODE && call_ret_addr + rel == target) {
+            return (uint64_t)call;
+        }
+    }
+    return 0;
+}
+
+void patch_call_target(uint64_t call_addr, uint64_t new_target)
+{
+    int64_t rel = new_target - (call_addr + CALL_REL32_SIZE);
+    if (rel != (int32_t)rel) {
+        errx(1, "Call target %lx is out of range. Exiting.\n", new_target);
+    }
+    int32_t rel32 = rel;
+    uint8_t call[CALL_REL32_SIZE] = { CALL_REL32_OPCODE };
+    memcpy(call + 1, &rel32, sizeof(rel32));
+    patch_code(call_addr, call, CALL_REL32_SIZE);
+}
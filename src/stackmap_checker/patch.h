@@ -0,0 +1,38 @@
+#ifndef PATCH_H
+#define PATCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CALL_REL32_OPCODE 0xe8
+#define CALL_REL32_SIZE 5
+
+/**
+ * This module is used to rewrite the code of the running program.
+ */
+
+/*
+ * Overwrite the instruction of `size` bytes at `addr` with `bytes`.
+ *
+ * `bytes` must be a single instruction. The first byte is replaced with an
+ * `int3` while the rest is written (see patch.c), which only protects the
+ * threads about to execute the instruction at `addr`: the caller must ensure
+ * no thread can be executing an instruction which starts in
+ * (addr, addr + size).
+ */
+void patch_code(uint64_t addr, const uint8_t *bytes, size_t size);
+
+/*
+ * Return the address of the `call rel32` instruction which returns in
+ * `ret_addr` or just before it, and which calls the function at `target`. At
+ * most `max_dist` bytes before `ret_addr` are searched. Return 0 if no such
+ * call is found.
+ */
+uint64_t find_call_to(uint64_t ret_addr, uint64_t target, size_t max_dist);
+
+/*
+ * Make the `call rel32` instruction at `call_addr` call `new_target`.
+ */
+void patch_call_target(uint64_t call_addr, uint64_t new_target);
+
+#endif // PATCH_H
@@ -0,0 +1,31 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/**
+ * Static tracepoints for the guard failure handler.
+ *
+ * If `<sys/sdt.h>` is available (the Makefile defines HAVE_SYS_SDT_H), each
+ * probe is a USDT probe of the `guard` provider, which can be attached to
+ * using `perf probe` or `bpftrace`. For example:
+ *
+ *     perf probe -x ./trace sdt_guard:failure_exit
+ *     bpftrace -e 'usdt:./trace:guard:failure_exit { @[arg0] = hist(arg2); }'
+ *
+ * Otherwise, the probes compile to nothing.
+ *
+ * Probes:
+ *  - guard:failure_entry(guard_id)
+ *  - guard:failure_exit(guard_id, frame_count, latency_ns)
+ */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define GUARD_PROBE1(name, a1) STAP_PROBE1(guard, name, a1)
+#define GUARD_PROBE3(name, a1, a2, a3) STAP_PROBE3(guard, name, a1, a2, a3)
+#else
+#define GUARD_PROBE1(name, a1) do { (void)(a1); } while (0)
+#define GUARD_PROBE3(name, a1, a2, a3) \
+    do { (void)(a1); (void)(a2); (void)(a3); } while (0)
+#endif // HAVE_SYS_SDT_H
+
+#endif // PROBES_H
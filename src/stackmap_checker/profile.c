@@ -0,0 +1,172 @@
+#include "profile.h"
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <err.h>
+
+#define INITIAL_CAPACITY 1024
+
+typedef enum {
+    PROFILE_ARG,
+    PROFILE_BRANCH
+} profile_kind_t;
+
+// The profile of an argument or of a branch.
+typedef struct ProfileEntry {
+    const char *fun;
+    uint32_t index;
+    profile_kind_t kind;
+    // The number of times the entry was recorded.
+    uint64_t count;
+    // For arguments: the first `PROFILE_NUM_VALUES` distinct values, how often
+    // each of them was seen, and how often other values were seen. For
+    // branches, `counts[0]` is the number of times the condition held.
+    int64_t values[PROFILE_NUM_VALUES];
+    uint64_t counts[PROFILE_NUM_VALUES];
+    uint32_t num_values;
+    uint64_t other;
+} profile_entry_t;
+
+// The entries, in an open-addressing hash table indexed by function, kind
+// and index.
+static profile_entry_t *entries = NULL;
+static size_t capacity = 0;
+static size_t num_entries = 0;
+// The profile may be recorded by several threads.
+static int profile_lock = 0;
+
+static uint64_t hash_key(const char *fun, uint32_t index, profile_kind_t kind)
+{
+    uint64_t key = (uint64_t)fun ^ ((uint64_t)index << 1 | kind);
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    return key;
+}
+
+static void lock()
+{
+    while (__atomic_exchange_n(&profile_lock, 1, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+}
+
+static void unlock()
+{
+    __atomic_store_n(&profile_lock, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Write the profile to the file named by `GUARD_PROFILE`. Other threads may
+ * still be recording entries (and resizing the table) when the program exits,
+ * so the table is locked while it is written.
+ */
+static void write_profile()
+{
+    char *path = getenv("GUARD_PROFILE");
+    FILE *file = fopen(path ? path : PROFILE_DEFAULT_PATH, "w");
+    if (!file) {
+        warn("Can't write the profile");
+        return;
+    }
+    lock();
+    for (size_t i = 0; i < capacity; ++i) {
+        profile_entry_t *entry = &entries[i];
+        if (!entry->fun) {
+            continue;
+        }
+        if (entry->kind == PROFILE_BRANCH) {
+            fprintf(file, "branch %s %u %lu %lu\n", entry->fun, entry->index,
+                    entry->counts[0], entry->count - entry->counts[0]);
+            continue;
+        }
+        fprintf(file, "arg %s %u %lu", entry->fun, entry->index, entry->count);
+        for (size_t j = 0; j < entry->num_values; ++j) {
+            fprintf(file, " %ld:%lu", entry->values[j], entry->counts[j]);
+        }
+        fprintf(file, " other:%lu\n", entry->other);
+    }
+    unlock();
+    fclose(file);
+}
+
+static profile_entry_t* find_entry(profile_entry_t *table, size_t size,
+                                   const char *fun, uint32_t index,
+                                   profile_kind_t kind)
+{
+    size_t slot = hash_key(fun, index, kind) & (size - 1);
+    while (table[slot].fun && (table[slot].fun != fun ||
+                               table[slot].index != index ||
+                               table[slot].kind != kind)) {
+        slot = (slot + 1) & (size - 1);
+    }
+    return &table[slot];
+}
+
+/*
+ * Return the entry of the argument or branch, and create it if it doesn't
+ * exist. `profile_lock` must be held.
+ */
+static profile_entry_t* get_entry(const char *fun, uint32_t index,
+                                  profile_kind_t kind)
+{
+    if (!entries) {
+        atexit(write_profile);
+    }
+    // Keep the table at most half full.
+    if (2 * (num_entries + 1) > capacity) {
+        size_t new_capacity = capacity ? 2 * capacity : INITIAL_CAPACITY;
+        profile_entry_t *table = calloc(new_capacity, sizeof(profile_entry_t));
+        if (!table) {
+            errx(1, "Can't allocate the profile. Exiting.\n");
+        }
+        for (size_t i = 0; i < capacity; ++i) {
+            if (entries[i].fun) {
+                *find_entry(table, new_capacity, entries[i].fun,
+                            entries[i].index, entries[i].kind) = entries[i];
+            }
+        }
+        free(entries);
+        entries = table;
+        capacity = new_capacity;
+    }
+    profile_entry_t *entry = find_entry(entries, capacity, fun, index, kind);
+    if (!entry->fun) {
+        entry->fun = fun;
+        entry->index = index;
+        entry->kind = kind;
+        ++num_entries;
+    }
+    return entry;
+}
+
+void __profile_arg(const char *fun, uint32_t index, int64_t value)
+{
+    lock();
+    profile_entry_t *entry = get_entry(fun, index, PROFILE_ARG);
+    ++entry->count;
+    bool found = false;
+    for (size_t i = 0; i < entry->num_values && !found; ++i) {
+        if (entry->values[i] == value) {
+            ++entry->counts[i];
+            found = true;
+        }
+    }
+    if (!found && entry->num_values < PROFILE_NUM_VALUES) {
+        entry->values[entry->num_values] = value;
+        entry->counts[entry->num_values++] = 1;
+    } else if (!found) {
+        ++entry->other;
+    }
+    unlock();
+}
+
+void __profile_branch(const char *fun, uint32_t index, int32_t taken)
+{
+    lock();
+    profile_entry_t *entry = get_entry(fun, index, PROFILE_BRANCH);
+    ++entry->count;
+    entry->counts[0] += taken != 0;
+    unlock();
+}
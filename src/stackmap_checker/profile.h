@@ -0,0 +1,43 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+
+#define PROFILE_DEFAULT_PATH "guard.profile"
+// The number of distinct values recorded for each argument. The other values
+// are only counted.
+#define PROFILE_NUM_VALUES 4
+
+/**
+ * The value and branch profiles of the `__unopt_` functions.
+ *
+ * When the passes are run with `-mllvm -profile-values`, the calls to the
+ * optimized functions call their `__unopt_` twins instead (`main` still runs
+ * its optimized version), and the twins call `__profile_arg` with the value of
+ * each integer argument at their entry (the first stackmap site of the
+ * function), and `__profile_branch` with the condition of each conditional
+ * branch. When the program exits, the profile is written to the file named by
+ * the `GUARD_PROFILE` environment variable (`guard.profile` by default), one
+ * line per argument or branch:
+ *
+ *   arg <function> <index> <count> <value>:<count>... other:<count>
+ *   branch <function> <index> <true count> <false count>
+ *
+ * The branches of a function are numbered in the order they appear in the
+ * function before the passes instrument it. `SpeculationPass` reads the
+ * profile when the program is recompiled with
+ * `-mllvm -speculation-profile=<file>`.
+ */
+
+/*
+ * Record the value of the argument with index `index` of the function `fun`.
+ */
+void __profile_arg(const char *fun, uint32_t index, int64_t value);
+
+/*
+ * Record whether the condition of the branch with index `index` of the
+ * function `fun` held.
+ */
+void __profile_branch(const char *fun, uint32_t index, int32_t taken);
+
+#endif // PROFILE_H
@@ -0,0 +1,93 @@
+#include "safepoint.h"
+#include <sched.h>
+
+volatile uint8_t __safepoint_requested = 0;
+
+// The number of registered threads (the main thread is always registered).
+static int registered_threads = 1;
+// The number of threads parked at a poll.
+static int parked_threads = 0;
+// Incremented when a safepoint ends, to release the parked threads.
+static uint64_t safepoint_epoch = 0;
+// Whether the parked threads must deoptimize when the current safepoint ends.
+static bool deopt_requested = false;
+// Only one thread can request a safepoint at a time.
+static int safepoint_lock = 0;
+// Held while `__safepoint_requested`, `safepoint_epoch` and `deopt_requested`
+// are updated, and while a thread which reached a poll checks whether it must
+// park: a thread is only counted as parked if it reads the epoch of the
+// safepoint that is in progress.
+static int state_lock = 0;
+
+static void lock_state()
+{
+    while (__atomic_exchange_n(&state_lock, 1, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+}
+
+static void unlock_state()
+{
+    __atomic_store_n(&state_lock, 0, __ATOMIC_RELEASE);
+}
+
+void safepoint_register_thread()
+{
+    __atomic_add_fetch(&registered_threads, 1, __ATOMIC_SEQ_CST);
+}
+
+void safepoint_unregister_thread()
+{
+    __atomic_sub_fetch(&registered_threads, 1, __ATOMIC_SEQ_CST);
+}
+
+void safepoint_begin(bool deopt)
+{
+    while (__atomic_exchange_n(&safepoint_lock, 1, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+    lock_state();
+    __atomic_store_n(&deopt_requested, deopt, __ATOMIC_RELAXED);
+    __atomic_store_n(&__safepoint_requested, 1, __ATOMIC_SEQ_CST);
+    unlock_state();
+    // Wait for all the registered threads, except for the calling one.
+    while (__atomic_load_n(&parked_threads, __ATOMIC_SEQ_CST) <
+           __atomic_load_n(&registered_threads, __ATOMIC_SEQ_CST) - 1) {
+        sched_yield();
+    }
+}
+
+void safepoint_end()
+{
+    lock_state();
+    __atomic_store_n(&__safepoint_requested, 0, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&safepoint_epoch, 1, __ATOMIC_RELEASE);
+    unlock_state();
+    // The next safepoint must not count the threads which are still leaving
+    // this one.
+    while (__atomic_load_n(&parked_threads, __ATOMIC_SEQ_CST)) {
+        sched_yield();
+    }
+    __atomic_store_n(&safepoint_lock, 0, __ATOMIC_RELEASE);
+}
+
+bool safepoint_park()
+{
+    // The check, the epoch and the count are consistent: the safepoint can't
+    // end (and the next one can't begin) in between.
+    lock_state();
+    // The safepoint might have ended before this thread reached the poll.
+    if (!__atomic_load_n(&__safepoint_requested, __ATOMIC_SEQ_CST)) {
+        unlock_state();
+        return false;
+    }
+    uint64_t epoch = __atomic_load_n(&safepoint_epoch, __ATOMIC_ACQUIRE);
+    bool deopt = __atomic_load_n(&deopt_requested, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&parked_threads, 1, __ATOMIC_SEQ_CST);
+    unlock_state();
+    while (__atomic_load_n(&safepoint_epoch, __ATOMIC_ACQUIRE) == epoch) {
+        sched_yield();
+    }
+    __atomic_sub_fetch(&parked_threads, 1, __ATOMIC_SEQ_CST);
+    return deopt;
+}
@@ -0,0 +1,68 @@
+#ifndef SAFEPOINT_H
+#define SAFEPOINT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Stop-the-world safepoints.
+ *
+ * `SafepointPass` inserts a poll at the entry of each function and on each
+ * loop back-edge. In optimized code, a poll is a load of
+ * `__safepoint_requested`, followed by a `patchpoint` which calls
+ * `__safepoint_poll` if the flag is set. When a safepoint is requested, each
+ * registered thread parks at its next poll, until the safepoint ends. If the
+ * safepoint was requested with `deopt` set, each parked thread then
+ * deoptimizes its call stack, and resumes execution at the corresponding poll
+ * of the `__unopt_` version of the function.
+ *
+ * This is meant for assumptions which are invalidated by another thread: the
+ * thread which invalidates the assumption calls `safepoint_begin(true)`,
+ * updates the state the optimized code depends on, and then calls
+ * `safepoint_end()`.
+ *
+ * The main thread is registered implicitly. Each other thread which runs
+ * instrumented code must call `safepoint_register_thread` when it starts, and
+ * `safepoint_unregister_thread` before it exits (or before it blocks for an
+ * arbitrary amount of time outside the instrumented code, since
+ * `safepoint_begin` waits until all the other registered threads are parked).
+ */
+
+// Set while a safepoint is requested. This is read by each poll.
+extern volatile uint8_t __safepoint_requested;
+
+/*
+ * Register the calling thread. Safepoints wait for registered threads.
+ */
+void safepoint_register_thread();
+
+/*
+ * Unregister the calling thread.
+ */
+void safepoint_unregister_thread();
+
+/*
+ * Request a safepoint, and wait until all the other registered threads are
+ * parked at a poll. If `deopt` is true, the parked threads deoptimize when the
+ * safepoint ends.
+ *
+ * Only one safepoint can be in progress at a time: if another thread already
+ * requested one, this waits until it ends.
+ */
+void safepoint_begin(bool deopt);
+
+/*
+ * End the safepoint requested by the calling thread, and resume the parked
+ * threads.
+ */
+void safepoint_end();
+
+/*
+ * Park the calling thread until the current safepoint ends. Return true if the
+ * thread must deoptimize.
+ *
+ * This is called by `__safepoint_poll`.
+ */
+bool safepoint_park();
+
+#endif // SAFEPOINT_H
@@ -0,0 +1,45 @@
+#ifndef SPECULATE_H
+#define SPECULATE_H
+
+/**
+ * The guard API.
+ *
+ * The code which follows a call to `__speculate(cond)` may only be executed if
+ * `cond` is true. If it is false, the guard fails: the optimized version of the
+ * call stack is discarded, and execution is resumed after the guard, in the
+ * unoptimized (`__unopt_`) versions of the functions on the call stack.
+ *
+ * `CheckPointPass` replaces each call with a check of the condition, a branch
+ * which is expected not to be taken, and a `patchpoint` call to the guard
+ * failure handler, placed at the end of the function. In the unoptimized
+ * version of a function, the guards never fail.
+ *
+ * If the program is compiled without the passes, `__speculate` does nothing.
+ * The definition is `static inline`, so that each translation unit which
+ * includes this header gets its own copy, which the optimizer discards once
+ * the passes have replaced the calls to it.
+ */
+static inline void __speculate(int cond)
+{
+}
+
+/**
+ * An invalidatable guard.
+ *
+ * The code which follows a call to `__speculate_invalidatable(cond)` assumes
+ * that `cond` is true, but the condition is never evaluated: the program
+ * promises that it holds until the guard is invalidated with
+ * `guard_invalidate` (see guard_control.h). Once the guard is invalidated,
+ * each thread which reaches it deoptimizes, like after the failure of a
+ * conditional guard, until the guard is made valid again with `guard_reset`.
+ *
+ * `CheckPointPass` replaces each call with a `patchpoint` whose shadow is a
+ * single `nop`, followed by an `llvm.assume(cond)` which lets the optimizer
+ * use the condition. The guard doesn't add a check or a branch to the fast
+ * path.
+ */
+static inline void __speculate_invalidatable(int cond)
+{
+}
+
+#endif // SPECULATE_H
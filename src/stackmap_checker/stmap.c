@@ -4,36 +4,108 @@
 #include <string.h>
 #include <err.h>
 #include "stmap.h"
+#include "call_stack_state.h"
 #include "utils.h"
+#include "patch.h"
 
-stack_map_t* stmap_create(uint8_t *start_addr)
+// The maximum number of bytes between the end of a recorded call in an
+// `__unopt_` function and its `stackmap` call.
+#define MAX_UNOPT_CALL_DIST 32
+
+#define NO_SIZE_RECORD UINT32_MAX
+
+static uint64_t hash_id(uint64_t id)
+{
+    // The IDs differ mostly in their upper and lower bits (see
+    // `PATCHPOINT_FUN_INDEX`), so mix them before using them as an index.
+    id ^= id >> 33;
+    id *= 0xff51afd7ed558ccdULL;
+    id ^= id >> 33;
+    return id;
+}
+
+/*
+ * Return the size of a hash table with `num_entries` entries: a power of two,
+ * at least twice as large as `num_entries`.
+ */
+static uint64_t get_table_size(uint64_t num_entries)
+{
+    uint64_t size = 1;
+    while (size < 2 * num_entries) {
+        size <<= 1;
+    }
+    return size;
+}
+
+/*
+ * Build the indices which map the stack map records to their stack size
+ * records, and the patchpoint IDs to their records, so that looking up a
+ * record does not require a scan of the stack map.
+ */
+static void index_records(stack_map_t *sm)
 {
-    stack_map_t *sm = (stack_map_t *)malloc(sizeof(stack_map_t));
-    char *addr = (char *)start_addr;
-    size_t header_size =
-            sizeof(uint8_t) * 2 + sizeof(uint16_t) + 3 * sizeof(uint32_t);
-    memcpy(sm, (void *)addr, header_size);
-    addr += header_size;
-    sm->stk_size_records = (stack_size_record_t *)calloc(
-            sm->num_func,
-            sizeof(stack_size_record_t));
+    // LLVM preserves the order of the functions and of the records: the first
+    // `record_count` records belong to the first function, and so on.
+    sm->size_rec_indices = malloc(sm->num_rec * sizeof(uint32_t));
+    size_t rec_idx = 0;
     for (size_t i = 0; i < sm->num_func; ++i) {
-        memcpy(sm->stk_size_records + i, addr,
-               sizeof(stack_size_record_t) - sizeof(uint64_t));
+        for (size_t j = 0; j < sm->stk_size_records[i].record_count &&
+             rec_idx < sm->num_rec; ++j) {
+            sm->size_rec_indices[rec_idx++] = i;
+        }
+    }
+    for (; rec_idx < sm->num_rec; ++rec_idx) {
+        sm->size_rec_indices[rec_idx] = NO_SIZE_RECORD;
+    }
+    sm->id_table_size = get_table_size(sm->num_rec);
+    sm->id_table = calloc(sm->id_table_size, sizeof(uint32_t));
+    uint64_t mask = sm->id_table_size - 1;
+    for (size_t i = 0; i < sm->num_rec; ++i) {
+        uint64_t slot = hash_id(sm->stk_map_records[i].patchpoint_id) & mask;
+        while (sm->id_table[slot]) {
+            slot = (slot + 1) & mask;
+        }
+        sm->id_table[slot] = i + 1;
+    }
+}
+
+#define STACK_MAP_HEADER_SIZE \
+    (sizeof(uint8_t) * 2 + sizeof(uint16_t) + 3 * sizeof(uint32_t))
+
+/*
+ * Append the records of the stack map at `addr` to `sm`, and return the
+ * address of the end of the stack map.
+ */
+static uint8_t* parse_stack_map(stack_map_t *sm, uint8_t *addr)
+{
+    stack_map_t header;
+    memcpy(&header, addr, STACK_MAP_HEADER_SIZE);
+    addr += STACK_MAP_HEADER_SIZE;
+    sm->version = header.version;
+    sm->stk_size_records = (stack_size_record_t *)realloc(
+            sm->stk_size_records,
+            (sm->num_func + header.num_func) * sizeof(stack_size_record_t));
+    for (size_t i = 0; i < header.num_func; ++i) {
+        stack_size_record_t *size_rec = sm->stk_size_records + sm->num_func + i;
+        memcpy(size_rec, addr, sizeof(stack_size_record_t) - sizeof(uint64_t));
         // Also store the index of each record.
-        sm->stk_size_records[i].index = i;
+        size_rec->index = sm->num_func + i;
         // Need to subtract the size of index (it is not part of the actual SM)
         addr += sizeof(stack_size_record_t) - sizeof(uint64_t);
     }
-    sm->constants = (uint64_t *)malloc(sizeof(uint64_t) * sm->num_const);
-    memcpy(sm->constants, addr, sm->num_const * sizeof(uint64_t));
-    addr += sizeof(uint64_t) * sm->num_const;
-    sm->stk_map_records = (stack_map_record_t *)calloc(
-            sm->num_rec, sizeof(stack_map_record_t));
+    sm->constants = (uint64_t *)realloc(
+            sm->constants,
+            (sm->num_const + header.num_const) * sizeof(uint64_t));
+    memcpy(sm->constants + sm->num_const, addr,
+           header.num_const * sizeof(uint64_t));
+    addr += sizeof(uint64_t) * header.num_const;
+    sm->stk_map_records = (stack_map_record_t *)realloc(
+            sm->stk_map_records,
+            (sm->num_rec + header.num_rec) * sizeof(stack_map_record_t));
     size_t rec_header_size = sizeof(uint64_t) + sizeof(uint32_t)
         + 2 * sizeof(uint16_t);
-    for (size_t i = 0; i < sm->num_rec; ++i) {
-        stack_map_record_t *rec = sm->stk_map_records + i;
+    for (size_t i = 0; i < header.num_rec; ++i) {
+        stack_map_record_t *rec = sm->stk_map_records + sm->num_rec + i;
         // copy the first 4 fields
         memcpy(rec, addr, rec_header_size);
         addr += rec_header_size;
@@ -41,6 +113,12 @@ stack_map_t* stmap_create(uint8_t *start_addr)
             (location_t *)calloc(rec->num_locations, sizeof(location_t));
         memcpy(rec->locations, addr, rec->num_locations * sizeof(location_t));
         addr += rec->num_locations * sizeof(location_t);
+        // Constants are indexed relative to the constants of this stack map.
+        for (size_t j = 0; j < rec->num_locations; ++j) {
+            if (rec->locations[j].kind == CONST_INDEX) {
+                rec->locations[j].offset += sm->num_const;
+            }
+        }
         // padding to align on 8-byte boundary
         if ((rec->num_locations * sizeof(location_t)) % 8) {
             addr += sizeof(uint32_t);
@@ -57,37 +135,215 @@ stack_map_t* stmap_create(uint8_t *start_addr)
             addr += sizeof(uint32_t);
         }
         // Also store the index of each record.
-        rec->index = i;
+        rec->index = sm->num_rec + i;
+    }
+    sm->num_func += header.num_func;
+    sm->num_const += header.num_const;
+    sm->num_rec += header.num_rec;
+    return addr;
+}
+
+stack_map_t* stmap_create(uint8_t *start_addr, uint64_t size)
+{
+    stack_map_t *sm = (stack_map_t *)calloc(1, sizeof(stack_map_t));
+    uint8_t *addr = start_addr;
+    uint8_t *end_addr = start_addr + size;
+    // If several translation units were linked together, the section contains
+    // the stack map of each of them, one after the other.
+    while (addr + STACK_MAP_HEADER_SIZE <= end_addr) {
+        if (!*addr) {
+            // Skip the padding the linker might insert between stack maps (a
+            // stack map starts with its version, which is never 0).
+            addr += sizeof(uint64_t);
+            continue;
+        }
+        addr = parse_stack_map(sm, addr);
     }
+    sm->loc_sizes = NULL;
+    sm->loc_sizes_size = 0;
+    sm->loc_sizes_table = NULL;
+    index_records(sm);
     return sm;
 }
 
-stack_map_record_t* stmap_get_map_record(stack_map_t *sm, uint64_t patchpoint_id)
+stack_map_t* stmap_load()
 {
-    for (size_t i = 0; i < sm->num_rec; ++i) {
-        if (sm->stk_map_records[i].patchpoint_id == patchpoint_id) {
-            return &sm->stk_map_records[i];
+    char *binary_path = get_binary_path();
+    // Read the stack map section.
+    void *stack_map_addr = get_addr(binary_path, ".llvm_stackmaps");
+    if (!stack_map_addr) {
+        errx(1, ".llvm_stackmaps section not found. Exiting.\n");
+    }
+    stack_map_t *sm = stmap_create(stack_map_addr,
+                                   get_section_size(binary_path,
+                                                    ".llvm_stackmaps"));
+    // The sizes of the recorded locations.
+    void *loc_sizes_addr = get_addr(binary_path, ".llvm_stackmap_sizes");
+    if (!loc_sizes_addr) {
+        errx(1, ".llvm_stackmap_sizes section not found. Exiting.\n");
+    }
+    stmap_set_location_sizes(sm, loc_sizes_addr,
+                             get_section_size(binary_path,
+                                              ".llvm_stackmap_sizes"));
+    free(binary_path);
+    return sm;
+}
+
+#define LOC_SIZES_HEADER_SIZE (sizeof(uint64_t) + 3 * sizeof(uint32_t))
+#define ALIGN_8(size) (((size) + 7) & ~(size_t)7)
+
+/*
+ * Return the size of the entry of the location size table at `addr`, including
+ * the padding after its sizes and its recipes.
+ */
+static uint64_t get_loc_sizes_entry_size(uint8_t *addr)
+{
+    uint32_t counts[2];
+    memcpy(counts, addr + sizeof(uint64_t), sizeof(counts));
+    return ALIGN_8(LOC_SIZES_HEADER_SIZE + counts[0] * sizeof(uint32_t))
+        + counts[1] * sizeof(remat_recipe_t);
+}
+
+/*
+ * Build the hash table which maps the patchpoint IDs to their entries in the
+ * location size table, so that looking up an entry does not require a scan of
+ * the table.
+ */
+static void index_location_sizes(stack_map_t *sm)
+{
+    uint8_t *end_addr = sm->loc_sizes + sm->loc_sizes_size;
+    uint64_t num_entries = 0;
+    for (uint8_t *addr = sm->loc_sizes;
+         addr + LOC_SIZES_HEADER_SIZE <= end_addr;
+         addr += get_loc_sizes_entry_size(addr)) {
+        ++num_entries;
+    }
+    free(sm->loc_sizes_table);
+    sm->loc_sizes_table_size = get_table_size(num_entries);
+    sm->loc_sizes_table = calloc(sm->loc_sizes_table_size, sizeof(uint8_t *));
+    uint64_t mask = sm->loc_sizes_table_size - 1;
+    for (uint8_t *addr = sm->loc_sizes;
+         addr + LOC_SIZES_HEADER_SIZE <= end_addr;
+         addr += get_loc_sizes_entry_size(addr)) {
+        uint64_t id;
+        memcpy(&id, addr, sizeof(uint64_t));
+        uint64_t slot = hash_id(id) & mask;
+        // If several entries have the same ID, keep the first one.
+        while (sm->loc_sizes_table[slot] &&
+               memcmp(sm->loc_sizes_table[slot], &id, sizeof(uint64_t))) {
+            slot = (slot + 1) & mask;
+        }
+        if (!sm->loc_sizes_table[slot]) {
+            sm->loc_sizes_table[slot] = addr;
+        }
+    }
+}
+
+void stmap_set_location_sizes(stack_map_t *sm, uint8_t *start_addr,
+                              uint64_t size)
+{
+    sm->loc_sizes = start_addr;
+    sm->loc_sizes_size = size;
+    index_location_sizes(sm);
+}
+
+/*
+ * Return the entry of the location size table which corresponds to the
+ * specified patchpoint, or NULL if there is no such entry.
+ */
+static uint8_t* get_loc_sizes_entry(stack_map_t *sm, uint64_t patchpoint_id)
+{
+    if (!sm->loc_sizes_table) {
+        return NULL;
+    }
+    uint64_t mask = sm->loc_sizes_table_size - 1;
+    for (uint64_t slot = hash_id(patchpoint_id) & mask;
+         sm->loc_sizes_table[slot]; slot = (slot + 1) & mask) {
+        if (!memcmp(sm->loc_sizes_table[slot], &patchpoint_id,
+                    sizeof(uint64_t))) {
+            return sm->loc_sizes_table[slot];
+        }
+    }
+    return NULL;
+}
+
+uint32_t* stmap_get_location_sizes(stack_map_t *sm, uint64_t patchpoint_id)
+{
+    uint8_t *entry = get_loc_sizes_entry(sm, patchpoint_id);
+    return entry ? (uint32_t *)(entry + LOC_SIZES_HEADER_SIZE) : NULL;
+}
+
+int stmap_get_record_kind(stack_map_t *sm, uint64_t patchpoint_id)
+{
+    uint8_t *entry = get_loc_sizes_entry(sm, patchpoint_id);
+    if (!entry) {
+        return -1;
+    }
+    uint32_t kind;
+    memcpy(&kind, entry + sizeof(uint64_t) + 2 * sizeof(uint32_t),
+           sizeof(uint32_t));
+    return kind;
+}
+
+remat_recipe_t* stmap_get_remat_recipes(stack_map_t *sm, uint64_t patchpoint_id,
+                                        uint32_t *num_recipes)
+{
+    uint8_t *entry = get_loc_sizes_entry(sm, patchpoint_id);
+    *num_recipes = 0;
+    if (!entry) {
+        return NULL;
+    }
+    uint32_t num_locations;
+    memcpy(&num_locations, entry + sizeof(uint64_t), sizeof(uint32_t));
+    memcpy(num_recipes, entry + sizeof(uint64_t) + sizeof(uint32_t),
+           sizeof(uint32_t));
+    return (remat_recipe_t *)(entry + ALIGN_8(LOC_SIZES_HEADER_SIZE
+                                              + num_locations * sizeof(uint32_t)));
+}
+
+stack_map_record_t* stmap_next_record_with_id(stack_map_t *sm,
+                                              uint64_t patchpoint_id,
+                                              uint64_t *probe)
+{
+    uint64_t mask = sm->id_table_size - 1;
+    uint64_t hash = hash_id(patchpoint_id);
+    // Records with the same ID are inserted in order, so they are found in
+    // the order in which they appear in the stack map.
+    for (; *probe < sm->id_table_size; ++*probe) {
+        uint32_t entry = sm->id_table[(hash + *probe) & mask];
+        if (!entry) {
+            break;
+        }
+        stack_map_record_t *rec = &sm->stk_map_records[entry - 1];
+        if (rec->patchpoint_id == patchpoint_id) {
+            ++*probe;
+            return rec;
         }
     }
     return NULL;
 }
 
+stack_map_record_t* stmap_get_map_record(stack_map_t *sm, uint64_t patchpoint_id)
+{
+    uint64_t probe = 0;
+    return stmap_next_record_with_id(sm, patchpoint_id, &probe);
+}
+
 stack_map_record_t* stmap_get_map_record_after_addr(stack_map_t *sm,
                                                     uint64_t patchpoint_id,
                                                     uint64_t addr)
 {
-    for (size_t i = 0; i < sm->num_rec; ++i) {
-        stack_map_record_t rec = sm->stk_map_records[i];
-        if (rec.patchpoint_id == patchpoint_id) {
-            stack_size_record_t *size_rec = stmap_get_size_record(sm, i);
-            if (!size_rec) {
-                errx(1, "No stack map after call!. Exiting.\n");
-            }
-            uint64_t last_addr = get_sym_end(size_rec->fun_addr);
-            if (size_rec->fun_addr + rec.instr_offset >= addr
-                && addr >= size_rec->fun_addr && addr < last_addr) {
-                 return &sm->stk_map_records[i];
-            }
+    uint64_t probe = 0;
+    stack_map_record_t *rec = NULL;
+    while ((rec = stmap_next_record_with_id(sm, patchpoint_id, &probe))) {
+        stack_size_record_t *size_rec = stmap_get_size_record(sm, rec->index);
+        if (!size_rec) {
+            errx(1, "No stack map after call!. Exiting.\n");
+        }
+        uint64_t last_addr = get_sym_end(size_rec->fun_addr);
+        if (size_rec->fun_addr + rec->instr_offset >= addr
+            && addr >= size_rec->fun_addr && addr < last_addr) {
+             return rec;
         }
     }
     return NULL;
@@ -97,24 +353,41 @@ stack_map_record_t* stmap_get_map_record_in_func(stack_map_t *sm,
                                                  uint64_t patchpoint_id,
                                                  uint64_t fun_addr)
 {
-    for (size_t i = 0; i < sm->num_rec; ++i) {
-        stack_map_record_t rec = sm->stk_map_records[i];
-        if (rec.patchpoint_id == patchpoint_id) {
-            stack_size_record_t *size_rec = stmap_get_size_record(sm, i);
-            if (!size_rec) {
-                errx(1, "No stack map after call!. Exiting.\n");
-            }
-            if (size_rec->fun_addr == fun_addr) {
-                 return &sm->stk_map_records[i];
-            }
+    uint64_t probe = 0;
+    stack_map_record_t *rec = NULL;
+    while ((rec = stmap_next_record_with_id(sm, patchpoint_id, &probe))) {
+        stack_size_record_t *size_rec = stmap_get_size_record(sm, rec->index);
+        if (!size_rec) {
+            errx(1, "No stack map after call!. Exiting.\n");
+        }
+        if (size_rec->fun_addr == fun_addr) {
+             return rec;
         }
     }
     return NULL;
 }
 
+stack_map_record_t* stmap_get_map_record_at_addr(stack_map_t *sm,
+                                                 uint64_t addr)
+{
+    stack_map_record_t *found = NULL;
+    for (size_t i = 0; i < sm->num_rec; ++i) {
+        stack_size_record_t *size_rec = stmap_get_size_record(sm, i);
+        if (size_rec &&
+            size_rec->fun_addr + sm->stk_map_records[i].instr_offset == addr) {
+            // A `stackmap` call right before the patchpoint has the same
+            // address.
+            found = &sm->stk_map_records[i];
+        }
+    }
+    return found;
+}
+
 void assert_valid_reg_num(unw_regnum_t reg)
 {
-    if (reg < UNW_X86_64_RAX || reg > UNW_X86_64_R15) {
+    bool is_gp_reg = reg >= UNW_X86_64_RAX && reg <= UNW_X86_64_R15;
+    bool is_xmm_reg = reg >= XMM0_DWARF_REG_NUM && reg < REGISTER_COUNT;
+    if (!is_gp_reg && !is_xmm_reg) {
         errx(1, "Invalid register number %d", reg);
     }
 }
@@ -127,6 +400,10 @@ void* stmap_get_location_value(stack_map_t *sm, location_t loc, uint64_t *regs,
     switch (loc.kind) {
         case REGISTER:
             assert_valid_reg_num(loc.dwarf_reg_num);
+            // Only the low 64 bits of the XMM registers are recorded.
+            if (loc_size > sizeof(uint64_t)) {
+                errx(1, "Not implemented - vector register.");
+            }
             memcpy(loc_value, &regs[loc.dwarf_reg_num], loc_size);
             break;
         case DIRECT:
@@ -150,21 +427,13 @@ void* stmap_get_location_value(stack_map_t *sm, location_t loc, uint64_t *regs,
 
 stack_size_record_t* stmap_get_size_record(stack_map_t *sm, uint64_t sm_rec_idx)
 {
-    size_t record_count = 1;
-    // Each function contains a number of stackmap calls. This works out which
-    // function the specified stack map record is associated with. This
-    // approach works because LLVM preserves the order of locations, records
-    // and functions.
-    for (size_t i = 0; i < sm->num_func; ++i) {
-        stack_size_record_t rec = sm->stk_size_records[i];
-        if (sm_rec_idx + 1 >= record_count &&
-            sm_rec_idx + 1 < record_count + sm->stk_size_records[i].record_count) {
-            return &sm->stk_size_records[i];
-        } else {
-            record_count += rec.record_count;
-        }
+    // Each function contains a number of stackmap calls. The function each
+    // record is associated with is worked out in `index_records`.
+    if (sm_rec_idx >= sm->num_rec ||
+        sm->size_rec_indices[sm_rec_idx] == NO_SIZE_RECORD) {
+        return NULL;
     }
-    return NULL;
+    return &sm->stk_size_records[sm->size_rec_indices[sm_rec_idx]];
 }
 
 stack_size_record_t* stmap_get_size_record_in_func(stack_map_t *sm,
@@ -209,11 +478,11 @@ stack_map_pos_t* stmap_get_unopt_return_addr(stack_map_t *sm, uint64_t return_ad
         return NULL;
     }
     stack_map_record_t *unopt_call_rec =
-        stmap_get_map_record(sm, ~call_rec->patchpoint_id);
+        stmap_get_map_record(sm, PATCHPOINT_UNOPT_ID(call_rec->patchpoint_id));
 
     if (!unopt_call_rec) {
         errx(1, "(Unopt) map record not found (PPID = %lu). Exiting.\n",
-             ~call_rec->patchpoint_id);
+             PATCHPOINT_UNOPT_ID(call_rec->patchpoint_id));
     }
 
     stack_size_record_t *stk_size_rec =
@@ -227,6 +496,23 @@ stack_map_pos_t* stmap_get_unopt_return_addr(stack_map_t *sm, uint64_t return_ad
     return sm_pos;
 }
 
+uint64_t stmap_get_call_ret_addr(stack_map_t *sm, uint64_t stackmap_addr)
+{
+    for (size_t dist = 0; dist <= MAX_UNOPT_CALL_DIST; ++dist) {
+        uint8_t *call = (uint8_t *)(stackmap_addr - dist - CALL_REL32_SIZE);
+        if (*call != CALL_REL32_OPCODE) {
+            continue;
+        }
+        int32_t rel;
+        memcpy(&rel, call + 1, sizeof(rel));
+        uint64_t ret_addr = (uint64_t)call + CALL_REL32_SIZE;
+        if (stmap_get_size_record_in_func(sm, ret_addr + rel)) {
+            return ret_addr;
+        }
+    }
+    errx(1, "No call before the stackmap at %lx. Exiting.\n", stackmap_addr);
+}
+
 void stmap_print_stack_size_records(stack_map_t *sm)
 {
     for (size_t i = 0; i < sm->num_func; ++i) {
@@ -266,5 +552,8 @@ void stmap_free(stack_map_t *sm)
         free(rec->liveouts);
     }
     free(sm->stk_map_records);
+    free(sm->size_rec_indices);
+    free(sm->id_table);
+    free(sm->loc_sizes_table);
     free(sm);
 }
@@ -7,6 +7,31 @@
 
 #define PATCHPOINT_CALL_SIZE 13
 
+// `CheckPointPass` encodes the specialized version of the function (bits
+// 60-62, 0 for the generic version), the ID of the translation unit (bits
+// 40-59), the index of the function (bits 24-39) which contains a
+// stackmap/patchpoint call, and the index of the call in the function (bits
+// 0-23) in its ID. The ID of the corresponding call in the `__unopt_` twin of
+// the function, which is shared by all its versions, is the logical negation
+// of the ID of the call in the generic version.
+#define PATCHPOINT_VERSION_MASK ((uint64_t)0x7 << 60)
+#define PATCHPOINT_MAX_VERSION 7
+#define PATCHPOINT_ID_IS_UNOPT(id) ((int64_t)(id) < 0)
+#define PATCHPOINT_OPT_ID(id) \
+    (PATCHPOINT_ID_IS_UNOPT(id) ? ~(uint64_t)(id) : (uint64_t)(id))
+#define PATCHPOINT_UNOPT_ID(id) \
+    (~((uint64_t)(id) & ~PATCHPOINT_VERSION_MASK))
+#define PATCHPOINT_VERSION(id) \
+    ((uint32_t)((PATCHPOINT_OPT_ID(id) & PATCHPOINT_VERSION_MASK) >> 60))
+#define PATCHPOINT_WITH_VERSION(id, version) \
+    (((uint64_t)(id) & ~PATCHPOINT_VERSION_MASK) | (uint64_t)(version) << 60)
+#define PATCHPOINT_TU_ID(id) \
+    ((uint32_t)(PATCHPOINT_OPT_ID(id) >> 40) & 0xfffff)
+#define PATCHPOINT_FUN_INDEX(id) \
+    ((uint32_t)(PATCHPOINT_OPT_ID(id) >> 24) & 0xffff)
+#define PATCHPOINT_CALLSITE_INDEX(id) \
+    ((uint32_t)PATCHPOINT_OPT_ID(id) & 0xffffff)
+
 /**
  * This module provides an interface to the stack map section.
  *
@@ -23,6 +48,16 @@ typedef enum {
     CONST_INDEX = 0x5
 } location_type;
 
+// What a stackmap/patchpoint call records (see `RecordKind` in the passes).
+typedef enum {
+    RECORD_CALL                = 0x0, // the return address of a call
+    RECORD_GUARD               = 0x1, // a guard of an optimized function
+    RECORD_INVALIDATABLE_GUARD = 0x2, // an invalidatable guard
+    RECORD_COMPACT_GUARD       = 0x3, // the `stackmap` call of a compact guard
+    RECORD_SAFEPOINT_POLL      = 0x4, // a safepoint poll of an optimized function
+    RECORD_RESUME_POINT        = 0x5  // a guard or a poll of an `__unopt_` function
+} record_kind;
+
 // A live location recorded in the stackmap.
 typedef struct Location {
     uint8_t  kind;   // Register | Direct | Indirect | Constant | ConstantIndex
@@ -33,6 +68,28 @@ typedef struct Location {
     int32_t  offset;
 } location_t;
 
+// The operations used to rematerialize values (see `remat_recipe_t`).
+typedef enum {
+    REMAT_ADD = 0x1,
+    REMAT_SUB = 0x2,
+    REMAT_MUL = 0x3,
+    REMAT_AND = 0x4,
+    REMAT_OR  = 0x5,
+    REMAT_XOR = 0x6,
+    REMAT_SHL = 0x7
+} remat_op;
+
+// A recipe which recomputes the value of the location at index `location` of a
+// record from the location at index `base` of the same record:
+// value = base <op> constant. If `base` is a DIRECT location (an `alloca`), its
+// value is its address.
+typedef struct RematRecipe {
+    int64_t  constant;
+    uint32_t location;
+    uint16_t base;
+    uint16_t op;
+} remat_recipe_t;
+
 // A register which is 'live out', and, therefore, should be restored.
 typedef struct LiveOut {
     uint16_t dwarf_reg_num;
@@ -73,6 +130,22 @@ typedef struct StackMap {
     stack_size_record_t *stk_size_records;
     uint64_t *constants;
     stack_map_record_t *stk_map_records;
+
+    // The `.llvm_stackmap_sizes` section (see `stmap_set_location_sizes`).
+    uint8_t *loc_sizes;
+    uint64_t loc_sizes_size;
+
+    // The index of the stack size record of each stack map record.
+    uint32_t *size_rec_indices;
+    // An open addressing hash table which maps patchpoint IDs to the indices
+    // of their records (plus one; 0 marks an empty slot). Its size is a power
+    // of two.
+    uint32_t *id_table;
+    uint64_t id_table_size;
+    // An open addressing hash table which maps patchpoint IDs to their entries
+    // in `loc_sizes` (NULL marks an empty slot). Its size is a power of two.
+    uint8_t **loc_sizes_table;
+    uint64_t loc_sizes_table_size;
 } stack_map_t;
 
 // Identifies an address using a stack map record and a stack size record. This
@@ -85,9 +158,56 @@ typedef struct StackMapPosition {
 /*
  * Populate a StackMap with the information at the given address.
  *
- * The address needs to be the address of the .llvm_stackmaps section.
+ * The address needs to be the address of the .llvm_stackmaps section, and
+ * `size` its size. The section contains a stack map for each instrumented
+ * translation unit linked into the binary; their records are merged.
  */
-stack_map_t* stmap_create(uint8_t *start_addr);
+stack_map_t* stmap_create(uint8_t *start_addr, uint64_t size);
+
+/*
+ * Read the stack map of the running binary, and the sizes of its locations.
+ * Exit if either section is missing.
+ */
+stack_map_t* stmap_load();
+
+/*
+ * Associate the location size table at the given address with `sm`.
+ *
+ * The address needs to be the address of the .llvm_stackmap_sizes section,
+ * emitted by `LiveVariablesPass`. The section contains an entry for each
+ * stackmap/patchpoint call:
+ *
+ *   uint64_t patchpoint_id;
+ *   uint32_t num_locations;
+ *   uint32_t num_recipes;
+ *   uint32_t kind; // record_kind
+ *   uint32_t sizes[num_locations];
+ *   // padding to an 8-byte boundary
+ *   remat_recipe_t recipes[num_recipes];
+ *
+ * Each entry is aligned on an 8-byte boundary.
+ */
+void stmap_set_location_sizes(stack_map_t *sm, uint8_t *start_addr,
+                              uint64_t size);
+
+/*
+ * Return the sizes of the locations recorded for the patchpoint with the
+ * specified ID, or NULL if the table has no entry for it.
+ */
+uint32_t* stmap_get_location_sizes(stack_map_t *sm, uint64_t patchpoint_id);
+
+/*
+ * Return the kind of the stackmap/patchpoint call with the specified ID, or -1
+ * if the table has no entry for it.
+ */
+int stmap_get_record_kind(stack_map_t *sm, uint64_t patchpoint_id);
+
+/*
+ * Return the rematerialization recipes of the patchpoint with the specified
+ * ID, and store their number in `num_recipes`.
+ */
+remat_recipe_t* stmap_get_remat_recipes(stack_map_t *sm, uint64_t patchpoint_id,
+                                        uint32_t *num_recipes);
 
 /*
  * Free the StackMap.
@@ -103,6 +223,18 @@ void stmap_free(stack_map_t *sm);
  */
 stack_map_record_t* stmap_get_map_record(stack_map_t *sm, uint64_t patchpoint_id);
 
+/*
+ * Return the next stack map record with the specified ID, or NULL if there
+ * are no more such records. `probe` must be 0 in the first call; it is updated
+ * by each call:
+ *
+ *   uint64_t probe = 0;
+ *   while ((rec = stmap_next_record_with_id(sm, id, &probe))) { ... }
+ */
+stack_map_record_t* stmap_next_record_with_id(stack_map_t *sm,
+                                              uint64_t patchpoint_id,
+                                              uint64_t *probe);
+
 /*
  * Return the stack map record which corresponds to the patchpoint call with the
  * specified ID. The returned record will correspond to a patchpoint call
@@ -122,6 +254,14 @@ stack_map_record_t* stmap_get_map_record_in_func(stack_map_t *sm,
                                                  uint64_t patchpoint_id,
                                                  uint64_t fun_addr);
 
+/*
+ * Return the record of the patchpoint call whose shadow starts at `addr`, or
+ * NULL if there is no such record. If several records have this address, the
+ * last one is returned.
+ */
+stack_map_record_t* stmap_get_map_record_at_addr(stack_map_t *sm,
+                                                 uint64_t addr);
+
 /*
  * Return the stack size record associated with the specified stack map record.
  *
@@ -153,13 +293,25 @@ void* stmap_get_location_value(stack_map_t *sm, location_t loc, uint64_t *regs,
  */
 stack_map_pos_t* stmap_get_unopt_return_addr(stack_map_t *sm, uint64_t return_addr);
 
+/*
+ * Return the return address of the call recorded by the `stackmap` call at
+ * `stackmap_addr`: the end of the closest `call rel32` instruction before it
+ * which calls a function described by the stack map. Exit if there is no such
+ * instruction.
+ *
+ * In `__unopt_` functions, the instructions which store the result of the call
+ * may be placed between the call and the `stackmap` call.
+ */
+uint64_t stmap_get_call_ret_addr(stack_map_t *sm, uint64_t stackmap_addr);
+
 /*
  * Return the first stack map record located at an address greater than `addr`.
  */
 stack_map_record_t* stmap_first_rec_after_addr(stack_map_t *sm, uint64_t addr);
 
 /*
- * Exit if the specified register is not an x86-64 general purpose register.
+ * Exit if the specified register is neither an x86-64 general purpose register
+ * nor an XMM register.
  */
 void assert_valid_reg_num(unw_regnum_t reg);
 
@@ -0,0 +1,207 @@
+#include "tierup.h"
+#include "patch.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sched.h>
+
+#define UNOPT_PREFIX "__unopt_"
+#define SPEC_PREFIX "__spec"
+#define VERSION_TABLE_PREFIX "__versions_"
+// The maximum number of bytes between the end of a call instruction and the
+// `stackmap` call which records its return address.
+#define MAX_CALL_DIST 16
+
+// The number of times a guard failed.
+typedef struct GuardCounter {
+    int64_t sm_id;
+    uint64_t failures;
+    bool redirected;
+    // The function whose calls were redirected.
+    uint64_t fun_addr;
+} guard_counter_t;
+
+static guard_counter_t *counters = NULL;
+static size_t num_counters = 0;
+static tierup_stats_t stats;
+static uint64_t threshold = 0;
+static bool initialized = false;
+// Guards may fail in several threads at once.
+static int tierup_lock = 0;
+
+static void lock()
+{
+    while (__atomic_exchange_n(&tierup_lock, 1, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+}
+
+static void unlock()
+{
+    __atomic_store_n(&tierup_lock, 0, __ATOMIC_RELEASE);
+}
+
+static void print_stats()
+{
+    fprintf(stderr, "tier-up: %lu guard failures, %lu redirections, "
+            "%lu call sites patched, %lu versions disabled\n", stats.failures,
+            stats.redirections, stats.patched_call_sites,
+            stats.disabled_versions);
+}
+
+static void init_policy()
+{
+    char *value = getenv("GUARD_TIERUP_THRESHOLD");
+    threshold = value ? strtoull(value, NULL, 10) : TIERUP_DEFAULT_THRESHOLD;
+    if (getenv("GUARD_TIERUP_STATS")) {
+        atexit(print_stats);
+    }
+    initialized = true;
+}
+
+static guard_counter_t* get_counter(int64_t sm_id)
+{
+    for (size_t i = 0; i < num_counters; ++i) {
+        if (counters[i].sm_id == sm_id) {
+            return &counters[i];
+        }
+    }
+    counters = realloc(counters, ++num_counters * sizeof(guard_counter_t));
+    counters[num_counters - 1] = (guard_counter_t) { sm_id, 0, false, 0 };
+    return &counters[num_counters - 1];
+}
+
+/*
+ * Return the address of the `__unopt_` twin of the function which starts at
+ * `fun_addr`, or 0 if it doesn't have one.
+ */
+static uint64_t get_unopt_twin(uint64_t fun_addr)
+{
+    char *fun_name = get_sym_name(fun_addr);
+    if (!fun_name) {
+        return 0;
+    }
+    char *twin_name = malloc(strlen(UNOPT_PREFIX) + strlen(fun_name) + 1);
+    strcpy(twin_name, UNOPT_PREFIX);
+    strcat(twin_name, fun_name);
+    uint64_t twin_addr = get_sym_addr(twin_name);
+    free(twin_name);
+    free(fun_name);
+    return twin_addr;
+}
+
+/*
+ * Patch each call to `fun_addr` recorded in the stack map to call
+ * `unopt_addr` instead.
+ */
+static void redirect_calls(stack_map_t *sm, uint64_t fun_addr,
+                           uint64_t unopt_addr)
+{
+    for (size_t i = 0; i < sm->num_rec; ++i) {
+        stack_size_record_t *size_rec = stmap_get_size_record(sm, i);
+        if (!size_rec) {
+            continue;
+        }
+        // In optimized functions, each call is followed by a `stackmap` call
+        // which records its return address.
+        uint64_t ret_addr =
+            size_rec->fun_addr + sm->stk_map_records[i].instr_offset;
+        uint64_t call_addr = find_call_to(ret_addr, fun_addr, MAX_CALL_DIST);
+        if (call_addr) {
+            patch_call_target(call_addr, unopt_addr);
+            ++stats.patched_call_sites;
+        }
+    }
+}
+
+/*
+ * Disable the specialized version `version` (`__spec<version>_fun`) of a
+ * function, which starts at `spec_addr`, in the version table of the function.
+ */
+static void disable_version(uint64_t spec_addr, uint32_t version)
+{
+    char *spec_name = get_sym_name(spec_addr);
+    if (!spec_name) {
+        return;
+    }
+    // Skip the `__spec<version>_` prefix.
+    char *fun_name = strncmp(spec_name, SPEC_PREFIX, strlen(SPEC_PREFIX))
+        ? NULL : strchr(spec_name + strlen(SPEC_PREFIX), '_');
+    if (fun_name) {
+        char *table_name =
+            malloc(strlen(VERSION_TABLE_PREFIX) + strlen(fun_name + 1) + 1);
+        strcpy(table_name, VERSION_TABLE_PREFIX);
+        strcat(table_name, fun_name + 1);
+        uint8_t *table = (uint8_t *)get_object_addr(table_name);
+        if (table && table[version - 1]) {
+            // The dispatch of the function reads the table with volatile
+            // loads, so the next call runs the generic version.
+            table[version - 1] = 0;
+            ++stats.disabled_versions;
+        }
+        free(table_name);
+    }
+    free(spec_name);
+}
+
+/*
+ * Count a failure of the guard `sm_id`, and tier up if necessary (see
+ * `tierup_record_failure`). `tierup_lock` must be held.
+ */
+static void record_failure(stack_map_t *sm, int64_t sm_id, uint64_t guard_addr)
+{
+    if (!initialized) {
+        init_policy();
+    }
+    ++stats.failures;
+    // The versions are never inlined, so a guard with version bits is in the
+    // version which contains `guard_addr`.
+    if (PATCHPOINT_VERSION(sm_id)) {
+        disable_version(get_sym_start(guard_addr), PATCHPOINT_VERSION(sm_id));
+    }
+    guard_counter_t *counter = get_counter(sm_id);
+    ++counter->failures;
+    if (!threshold || counter->redirected || counter->failures < threshold) {
+        return;
+    }
+    counter->redirected = true;
+    // The guard may have been inlined, so redirect the calls to the function
+    // which actually contains it.
+    uint64_t fun_addr = get_sym_start(guard_addr);
+    uint64_t unopt_addr = get_unopt_twin(fun_addr);
+    if (!fun_addr || !unopt_addr) {
+        return;
+    }
+    ++stats.redirections;
+    counter->fun_addr = fun_addr;
+    redirect_calls(sm, fun_addr, unopt_addr);
+}
+
+void tierup_record_failure(stack_map_t *sm, int64_t sm_id,
+                           uint64_t guard_addr)
+{
+    lock();
+    record_failure(sm, sm_id, guard_addr);
+    unlock();
+}
+
+bool tierup_is_redirected(uint64_t fun_addr)
+{
+    bool redirected = false;
+    lock();
+    for (size_t i = 0; i < num_counters && !redirected; ++i) {
+        redirected = counters[i].redirected && counters[i].fun_addr == fun_addr;
+    }
+    unlock();
+    return redirected;
+}
+
+tierup_stats_t tierup_get_stats()
+{
+    lock();
+    tierup_stats_t copy = stats;
+    unlock();
+    return copy;
+}
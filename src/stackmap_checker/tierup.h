@@ -0,0 +1,63 @@
+#ifndef TIERUP_H
+#define TIERUP_H
+
+#include "stmap.h"
+#include <stdbool.h>
+
+#define TIERUP_DEFAULT_THRESHOLD 16
+
+/**
+ * The tier-up policy.
+ *
+ * If a guard keeps failing, deoptimizing each time it fails is more expensive
+ * than always running the unoptimized code. After a guard fails
+ * `GUARD_TIERUP_THRESHOLD` times (environment variable, 16 by default, 0
+ * disables the policy), each optimized call site which calls the function
+ * that contains the guard is patched to call the `__unopt_` twin of the
+ * function instead.
+ *
+ * A specialized version of a function (`__spec<n>_fun`, see
+ * `UnoptimizedCopyPass`) is disabled in the version table of the function the
+ * first time one of its guards fails: the later calls to the function run its
+ * generic optimized version instead.
+ *
+ * If the `GUARD_TIERUP_STATS` environment variable is set, the counters are
+ * printed when the program exits.
+ */
+
+typedef struct TierUpStats {
+    // The number of guard failures recorded.
+    uint64_t failures;
+    // The number of times the policy fired.
+    uint64_t redirections;
+    // The number of call sites patched to call an `__unopt_` function.
+    uint64_t patched_call_sites;
+    // The number of specialized versions disabled.
+    uint64_t disabled_versions;
+} tierup_stats_t;
+
+/*
+ * Record a failure of the guard with the specified ID. The guard is located in
+ * the function which contains `guard_addr`.
+ *
+ * If the guard failed too many times, redirect the calls to that function to
+ * its `__unopt_` twin. If the function is a specialized version, disable it.
+ *
+ * The state of the policy is locked, so guards may fail in several threads at
+ * once.
+ */
+void tierup_record_failure(stack_map_t *sm, int64_t sm_id,
+                           uint64_t guard_addr);
+
+/*
+ * Return true if the calls to the function which starts at `fun_addr` were
+ * redirected to its `__unopt_` twin.
+ */
+bool tierup_is_redirected(uint64_t fun_addr);
+
+/*
+ * Return the counters of the tier-up policy.
+ */
+tierup_stats_t tierup_get_stats();
+
+#endif // TIERUP_H
@@ -60,6 +60,22 @@ void* get_addr(const char *bin_name, const char *section_name)
     return NULL;
 }
 
+uint64_t get_section_size(const char *bin_name, const char *section_name)
+{
+    Elf64_Ehdr *elf = get_elf_header();
+    Elf64_Shdr *shdr = (Elf64_Shdr *) ((char *)elf + elf->e_shoff);
+    char *strtab = (char *)elf + shdr[elf->e_shstrndx].sh_offset;
+    for(int i = 0; i < elf->e_shnum; i++) {
+        if (strcmp(section_name, &strtab[shdr[i].sh_name]) == 0) {
+            uint64_t size = shdr[i].sh_size;
+            free_header(elf);
+            return size;
+        }
+    }
+    free_header(elf);
+    return 0;
+}
+
 uint64_t get_sym_end(uint64_t start_addr)
 {
     Elf64_Ehdr *elf = get_elf_header();
@@ -104,3 +120,64 @@ uint64_t get_sym_start(uint64_t addr)
     free_header(elf);
     return 0;
 }
+
+char* get_sym_name(uint64_t start_addr)
+{
+    Elf64_Ehdr *elf = get_elf_header();
+    Elf64_Shdr *shdr = (Elf64_Shdr *) ((char *)elf + elf->e_shoff);
+    for(int i = 0; i < elf->e_shnum; ++i) {
+        if (shdr[i].sh_type == SHT_SYMTAB) {
+            Elf64_Sym *stab = (Elf64_Sym *)((char *)elf + shdr[i].sh_offset);
+            // The names of the symbols are stored in the linked section.
+            char *names = (char *)elf + shdr[shdr[i].sh_link].sh_offset;
+            int symbol_count = shdr[i].sh_size / sizeof(Elf64_Sym);
+            for (int j = 0; j < symbol_count; ++j) {
+                if (stab[j].st_value == start_addr &&
+                    ELF64_ST_TYPE(stab[j].st_info) == STT_FUNC) {
+                    char *name = strdup(names + stab[j].st_name);
+                    free_header(elf);
+                    return name;
+                }
+            }
+        }
+    }
+    free_header(elf);
+    return NULL;
+}
+
+/*
+ * Return the address of the symbol of type `type` with the specified name, or
+ * 0 if there is no such symbol.
+ */
+static uint64_t find_symbol(const char *name, unsigned char type)
+{
+    Elf64_Ehdr *elf = get_elf_header();
+    Elf64_Shdr *shdr = (Elf64_Shdr *) ((char *)elf + elf->e_shoff);
+    for(int i = 0; i < elf->e_shnum; ++i) {
+        if (shdr[i].sh_type == SHT_SYMTAB) {
+            Elf64_Sym *stab = (Elf64_Sym *)((char *)elf + shdr[i].sh_offset);
+            char *names = (char *)elf + shdr[shdr[i].sh_link].sh_offset;
+            int symbol_count = shdr[i].sh_size / sizeof(Elf64_Sym);
+            for (int j = 0; j < symbol_count; ++j) {
+                if (ELF64_ST_TYPE(stab[j].st_info) == type &&
+                    !strcmp(names + stab[j].st_name, name)) {
+                    uint64_t addr = stab[j].st_value;
+                    free_header(elf);
+                    return addr;
+                }
+            }
+        }
+    }
+    free_header(elf);
+    return 0;
+}
+
+uint64_t get_sym_addr(const char *name)
+{
+    return find_symbol(name, STT_FUNC);
+}
+
+uint64_t get_object_addr(const char *name)
+{
+    return find_symbol(name, STT_OBJECT);
+}
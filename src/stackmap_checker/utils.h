@@ -6,6 +6,11 @@
  */
 void* get_addr(const char *bin_name, const char *section_name);
 
+/*
+ * Return the size of the specified section, or 0 if there is no such section.
+ */
+uint64_t get_section_size(const char *bin_name, const char *section_name);
+
 /*
  * Return the end address of the symbol with the specified start address.
  */
@@ -16,6 +21,24 @@ uint64_t get_sym_end(uint64_t start_addr);
  */
 uint64_t get_sym_start(uint64_t addr);
 
+/*
+ * Return the name of the symbol with the specified start address, or NULL if
+ * there is no such symbol. The returned string must be freed by the caller.
+ */
+char* get_sym_name(uint64_t start_addr);
+
+/*
+ * Return the address of the function with the specified name, or 0 if there
+ * is no such function.
+ */
+uint64_t get_sym_addr(const char *name);
+
+/*
+ * Return the address of the global variable with the specified name, or 0 if
+ * there is no such variable.
+ */
+uint64_t get_object_addr(const char *name);
+
 /*
  * Return the absolute path of this executable.
  */
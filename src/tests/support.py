@@ -15,5 +15,14 @@ def get_test_files(filename):
                 extract_files_with_extension(test_dir, '.c')]
 
 
+def get_extra_sources(test_dir, name):
+    """Return the additional translation units of the test program `name`."""
+    extra_dir = os.path.join(test_dir, name)
+    if not os.path.isdir(extra_dir):
+        return []
+    return [os.path.join(extra_dir, src) for src in
+                sorted(extract_files_with_extension(extra_dir, '.c'))]
+
+
 def extract_files_with_extension(dir_name, extension):
     return [name for name in os.listdir(dir_name) if name.endswith(extension)]
@@ -35,7 +35,9 @@ struct MarkUnoptimizedPass: public BasicBlockPass {
     }
     outs() << "Running MarkUnoptimizedPass on function: " << funName << '\n';
     for (auto &inst : bb) {
-      if (isa<ReturnInst>(inst) && inst.getNumOperands() == 1) {
+      // Only the `int` return values are replaced.
+      if (isa<ReturnInst>(inst) && inst.getNumOperands() == 1 &&
+          inst.getOperand(0)->getType()->isIntegerTy(32)) {
         outs() << inst << '\n';
         IRBuilder<> builder(bb.getContext());
         ReturnInst &retInst = cast<ReturnInst>(inst);
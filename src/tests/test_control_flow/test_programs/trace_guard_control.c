@@ -0,0 +1,32 @@
+#include <stdio.h>
+#include <stdint.h>
+#include "../../../stackmap_checker/speculate.h"
+
+// Defined by the runtime (see stackmap_checker/guard_control.h).
+int64_t guard_get_id(void *fun, uint32_t n);
+void guard_invalidate(int64_t sm_id);
+void guard_reset(int64_t sm_id);
+
+static volatile int input = 150;
+
+// Built with `MarkUnoptimizedPass`: `__unopt_check` returns 100, so the
+// program prints 100 only if the guard deoptimized `check`.
+__attribute__((noinline))
+int check(int x)
+{
+    __speculate_invalidatable(x > 0);
+    return x * 2;
+}
+
+int main(int argc, char **argv)
+{
+    int64_t id = guard_get_id(check, 0);
+    // The guard is valid, so it does nothing.
+    printf("%d\n", check(input));
+    guard_invalidate(id);
+    printf("%d\n", check(input));
+    // The next call runs the optimized `check` again.
+    guard_reset(id);
+    printf("%d\n", check(input));
+    return 0;
+}
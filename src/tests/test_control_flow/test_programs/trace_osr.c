@@ -0,0 +1,43 @@
+#include <stdio.h>
+#include <stdint.h>
+#include "../../../stackmap_checker/speculate.h"
+
+// Defined by the runtime (see stackmap_checker/osr.h).
+uint64_t osr_get_num_transfers();
+
+// Built with `-mllvm -osr-entries`: the guard at the entry of `sum_range`
+// fails, and the loop is moved back to the optimized `sum_range` after
+// `OSR_THRESHOLD` iterations. The program prints the number of frames moved
+// to optimized code, which is 0 if OSR was declined.
+
+#define ITERATIONS 100000
+
+long sum_range(int n, int step)
+{
+    __speculate(n < 0);
+    long sum = 0;
+    int count = 0;
+    for (int i = 0; i < n; i += step) {
+        sum += i % 7;
+        ++count;
+    }
+    printf("count = %d\n", count);
+    return sum;
+}
+
+void trace()
+{
+    char four = '4';
+    double k = 8.2345;
+    long x = sum_range(ITERATIONS, 3);
+    printf("x = %ld\n", x);
+    printf("four = %c\n", four);
+    printf("k = %lf\n", k);
+    printf("osr = %lu\n", osr_get_num_transfers());
+}
+
+int main(int argc, char **argv)
+{
+    trace();
+    return 0;
+}
@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+// Defined by the runtime (see stackmap_checker/safepoint.h).
+void safepoint_register_thread();
+void safepoint_unregister_thread();
+void safepoint_begin(bool deopt);
+void safepoint_end();
+
+static volatile int scale = 1;
+static volatile bool started = false;
+static volatile bool reloaded = false;
+static int deopt_marker = 0;
+
+long work(long iterations)
+{
+    long sum = 0;
+    for (long i = 0; i < iterations; ++i) {
+        sum += scale;
+    }
+    return sum;
+}
+
+// Built with `MarkUnoptimizedPass`: `__unopt_wait_for_reload` returns 100, so
+// the program prints 100 only if the thread was deoptimized.
+__attribute__((noinline))
+int wait_for_reload()
+{
+    started = true;
+    // The thread is parked at the poll on the back-edge of this loop, and
+    // resumes in `__unopt_wait_for_reload` after the safepoint.
+    while (!reloaded) {
+    }
+    return scale;
+}
+
+void* worker(void *result)
+{
+    safepoint_register_thread();
+    deopt_marker = wait_for_reload();
+    *(long *)result = work(10);
+    safepoint_unregister_thread();
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    long result = 0;
+    pthread_t thread;
+    pthread_create(&thread, NULL, worker, &result);
+    while (!started) {
+    }
+    safepoint_begin(true);
+    scale = 3;
+    reloaded = true;
+    safepoint_end();
+    pthread_join(thread, NULL);
+    printf("%ld\n", result);
+    printf("%d\n", deopt_marker);
+    return 0;
+}
@@ -16,8 +16,9 @@ def test_output(name):
     bin_path = os.path.join(test_dir, name)
     p = subprocess.run(bin_path, shell=True, stdout=subprocess.PIPE)
     clang_bin = '{path}_clang_'.format(path=bin_path)
-    clang_compile = 'clang -o {clang_bin} {path}.c'.format(clang_bin=clang_bin,
-                                                           path=bin_path)
+    extra_srcs = ' '.join(support.get_extra_sources(test_dir, name))
+    clang_compile = 'clang -o {clang_bin} {path}.c {extra}'.format(
+        clang_bin=clang_bin, path=bin_path, extra=extra_srcs)
     compile_proc = subprocess.run(clang_compile, shell=True,
                                   stdout=subprocess.PIPE)
     if compile_proc.returncode or p.returncode:
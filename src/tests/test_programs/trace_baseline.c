@@ -0,0 +1,45 @@
+#include <stdio.h>
+#include "../../stackmap_checker/speculate.h"
+
+// Built with `-mllvm -baseline-tier`: execution is resumed in optimized
+// `__unopt_` functions, whose recorded values are kept on the stack.
+
+int more_indirection(int x)
+{
+    __speculate(x < 0);
+    return x * 3;
+}
+
+long get_number(int level, long acc)
+{
+    double dbl = 2.54645 * level;
+    if (level < 3) {
+        printf("Call %d\n", level);
+        return get_number(level + 1, acc * 7 + level);
+    }
+    long total = acc;
+    for (int i = 0; i < 4; ++i) {
+        int x = more_indirection(i + level);
+        total = total * 5 + x;
+    }
+    printf("dbl = %lf\n", dbl);
+    printf("acc = %ld\n", acc);
+    printf("total = %ld\n", total);
+    return total;
+}
+
+void trace()
+{
+    char four = '4';
+    double k = 8.2345;
+    long x = get_number(0, 11);
+    printf("x = %ld\n", x);
+    printf("four = %c\n", four);
+    printf("k = %lf\n", k);
+}
+
+int main(int argc, char **argv)
+{
+    trace();
+    return 0;
+}
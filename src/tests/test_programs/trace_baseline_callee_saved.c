@@ -0,0 +1,49 @@
+#include <stdio.h>
+#include "../../stackmap_checker/speculate.h"
+
+// Built with `-mllvm -baseline-tier`: the guard in `accumulate` fails, so the
+// loop of `accumulate` continues in its baseline version, which then calls the
+// optimized `scale`, whose guard fails too. `main` and the baseline version of
+// `accumulate` keep values in callee-saved registers across these calls, so
+// the restored frames must restore them when they return.
+
+int scale(int x)
+{
+    __speculate(x < 6);
+    return x * 3;
+}
+
+long accumulate(int n)
+{
+    __speculate(n < 4);
+    long a = n;
+    long b = 1;
+    long c = 7;
+    long d = 0;
+    for (int i = 0; i < n; ++i) {
+        int s = scale(i);
+        a = a * 3 + s;
+        b = b * 5 - s;
+        c ^= (long)s << (i % 8);
+        d += a - b;
+    }
+    printf("n = %d: %ld %ld %ld %ld\n", n, a, b, c, d);
+    return a + b + c + d;
+}
+
+int main(int argc, char **argv)
+{
+    long total = 0;
+    long mix = argc;
+    long count = 0;
+    for (int n = argc + 1; n < 12; n += 3) {
+        long v = accumulate(n);
+        total += v;
+        mix = mix * 31 ^ v;
+        ++count;
+    }
+    printf("total = %ld\n", total);
+    printf("mix = %ld\n", mix);
+    printf("count = %ld\n", count);
+    return 0;
+}
@@ -0,0 +1,28 @@
+#include <stdio.h>
+#include "../../stackmap_checker/speculate.h"
+
+// Built with `-mllvm -compact-guards`: the guard in `more_indirection` is a
+// call to the shared failure handler, followed by a `stackmap` call.
+
+int more_indirection(int x, int y)
+{
+    int z = x * y;
+    __speculate(z < 100);
+    return z + x;
+}
+
+int get_number(int level)
+{
+    int total = 0;
+    for (int i = 1; i <= level; ++i) {
+        total += more_indirection(i, level);
+    }
+    return total;
+}
+
+int main(int argc, char **argv)
+{
+    printf("number = %d\n", get_number(5));
+    printf("number = %d\n", get_number(12));
+    return 0;
+}
@@ -0,0 +1,39 @@
+#include <stdio.h>
+#include "../../stackmap_checker/speculate.h"
+
+// The floating-point values which are live across the guard of `weighted_sum`
+// can stay in XMM registers in the optimized code: the guard fails in the
+// last iteration, and the unoptimized version resumes with their values.
+
+double weighted_sum(double *values, int n, double weight)
+{
+    double sum = 0.5;
+    float scale = 1.25f;
+    for (int i = 0; i < n; ++i) {
+        sum += values[i] * weight * scale;
+        __speculate(i < n - 1);
+        scale += 0.5f;
+    }
+    printf("scale = %f\n", scale);
+    return sum;
+}
+
+void trace()
+{
+    char four = '4';
+    double k = 8.2345;
+    double values[8];
+    for (int i = 0; i < 8; ++i) {
+        values[i] = i * 1.5;
+    }
+    double sum = weighted_sum(values, 8, 0.75);
+    printf("sum = %lf\n", sum);
+    printf("four = %c\n", four);
+    printf("k = %lf\n", k);
+}
+
+int main(int argc, char **argv)
+{
+    trace();
+    return 0;
+}
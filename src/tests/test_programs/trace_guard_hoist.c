@@ -0,0 +1,29 @@
+#include <stdio.h>
+#include "../../stackmap_checker/speculate.h"
+
+// The guards in the loop of `sum` check values which don't change in the
+// loop: `GuardOptPass` hoists them out of the loop, and merges them. The
+// merged guard fails before the first iteration in the first call to `sum`,
+// so the loop is executed by `__unopt_sum`. The hoisted guard is only checked
+// if the loop is entered: the last call doesn't enter it, and doesn't
+// deoptimize although `limit` is negative.
+
+int sum(int n, int limit)
+{
+    int total = 0;
+    for (int i = 0; i < n; ++i) {
+        __speculate(n < limit);
+        total += i;
+        __speculate(n < limit);
+        __speculate(limit > 0);
+    }
+    return total;
+}
+
+int main(int argc, char **argv)
+{
+    printf("sum = %d\n", sum(10, 5));
+    printf("sum = %d\n", sum(4, 5));
+    printf("sum = %d\n", sum(0, -1));
+    return 0;
+}
@@ -1,8 +1,10 @@
 #include <stdio.h>
+#include "../../stackmap_checker/speculate.h"
 
 int more_indirection()
 {
     int x = 3;
+    __speculate(0);
     return x;
 }
 
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include "../../stackmap_checker/speculate.h"
 
 int more_indirection(int depth)
 {
@@ -8,6 +9,7 @@ int more_indirection(int depth)
         int x = 3;
         return x;
     }
+    __speculate(0);
 }
 
 int more_indirection2()
@@ -1,7 +1,9 @@
 #include <stdio.h>
+#include "../../stackmap_checker/speculate.h"
 
 int more_indirection()
 {
+    __speculate(0);
     return 100;
 }
 
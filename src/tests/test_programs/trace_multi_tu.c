@@ -0,0 +1,16 @@
+#include <stdio.h>
+
+// Defined in trace_multi_tu/more_indirection.c.
+int more_indirection2(void);
+
+void trace()
+{
+    int x = more_indirection2();
+    printf("x = %d\n", x);
+}
+
+int main(int argc, char **argv)
+{
+    trace();
+    return 0;
+}
@@ -0,0 +1,13 @@
+#include "../../../stackmap_checker/speculate.h"
+
+int more_indirection()
+{
+    int x = 3;
+    __speculate(0);
+    return x;
+}
+
+int more_indirection2(void)
+{
+    return more_indirection() + 1;
+}
@@ -0,0 +1,50 @@
+#include <stdio.h>
+
+// Compiled with the profile of a training run (`trace_pgo__profile train`),
+// in which `clamped_sum` is always called with `limit == 100` and never sees a
+// negative value: `clamped_sum` is specialized for `limit == 100`, and the
+// branch which handles the negative values is replaced with a guard, which
+// fails in the last call.
+
+#define LEN 50
+
+long clamped_sum(int *values, int n, int limit)
+{
+    long sum = 0;
+    for (int i = 0; i < n; ++i) {
+        int value = values[i];
+        if (value < 0) {
+            printf("negative value at %d\n", i);
+            value = -value;
+        }
+        sum += value > limit ? limit : value;
+    }
+    return sum;
+}
+
+void trace(int train)
+{
+    char four = '4';
+    double k = 8.2345;
+    int values[LEN];
+    for (int i = 0; i < LEN; ++i) {
+        values[i] = i * 7 % 150;
+    }
+    long total = 0;
+    for (int i = 0; i < 10; ++i) {
+        total += clamped_sum(values, LEN, 100);
+    }
+    if (!train) {
+        values[LEN / 2] = -5;
+        total += clamped_sum(values, LEN, 100);
+    }
+    printf("total = %ld\n", total);
+    printf("four = %c\n", four);
+    printf("k = %lf\n", k);
+}
+
+int main(int argc, char **argv)
+{
+    trace(argc > 1);
+    return 0;
+}
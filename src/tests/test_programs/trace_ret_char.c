@@ -1,9 +1,11 @@
 #include <stdio.h>
+#include "../../stackmap_checker/speculate.h"
 
 
 char more_indirection()
 {
     char c = 'x';
+    __speculate(0);
     return c;
 }
 
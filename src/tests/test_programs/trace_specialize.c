@@ -0,0 +1,36 @@
+#include <stdio.h>
+#include "../../stackmap_checker/speculate.h"
+
+// Built with `-mllvm -specialize=scaled_sum:1=3,scaled_sum:1=4`: the calls
+// with `scale == 3` and `scale == 4` run the specialized versions of
+// `scaled_sum`. The guard fails in the first version, which is then disabled,
+// so the second call with `scale == 3` runs the generic version.
+
+long scaled_sum(int n, int scale)
+{
+    long sum = 0;
+    for (int i = 0; i < n; ++i) {
+        __speculate(i < 500);
+        sum += (long)i * scale;
+    }
+    return sum;
+}
+
+void trace()
+{
+    char four = '4';
+    double k = 8.2345;
+    long a = scaled_sum(1000, 3);
+    long b = scaled_sum(100, 3);
+    long c = scaled_sum(100, 4);
+    long d = scaled_sum(100, 7);
+    printf("a = %ld, b = %ld, c = %ld, d = %ld\n", a, b, c, d);
+    printf("four = %c\n", four);
+    printf("k = %lf\n", k);
+}
+
+int main(int argc, char **argv)
+{
+    trace();
+    return 0;
+}
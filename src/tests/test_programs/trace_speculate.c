@@ -0,0 +1,25 @@
+#include <stdio.h>
+#include "../../stackmap_checker/speculate.h"
+
+// The guard in `check_positive` only fails for the last value of `i`.
+
+int check_positive(int x)
+{
+    __speculate(x > 0);
+    return x * 2;
+}
+
+int sum(int n)
+{
+    int total = 0;
+    for (int i = n; i >= 0; --i) {
+        total += check_positive(i);
+    }
+    return total;
+}
+
+int main(int argc, char **argv)
+{
+    printf("sum = %d\n", sum(5));
+    return 0;
+}
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include "../../stackmap_checker/speculate.h"
 
 typedef struct LargeStruct {
     int a;
@@ -8,6 +9,7 @@ typedef struct LargeStruct {
 
 int more_indirection()
 {
+    __speculate(0);
     return 100;
 }
 
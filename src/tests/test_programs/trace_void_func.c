@@ -1,8 +1,10 @@
 #include <stdio.h>
+#include "../../stackmap_checker/speculate.h"
 
 void more_indirection()
 {
     printf("Void function!\n");
+    __speculate(0);
 }
 
 int get_number(int level)